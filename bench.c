@@ -0,0 +1,522 @@
+/*
+ * free-bench - Measure the overhead of free(1).
+ *
+ * BSD 2-Clause License
+ * 
+ * Copyright (c) 2023, rilysh <nightquick@proton.me>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if defined(__linux__)
+#  define _GNU_SOURCE    /* sched_setaffinity(2) */
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#if defined(__linux__)
+#  include <sched.h>
+#else
+#  include <sys/param.h>
+#  include <sys/cpuset.h>
+#endif
+
+#include "libfree.h"
+#include "render.h"
+
+/* Number of operations timed together, to keep the cost of
+   clock_gettime(2) out of the per-operation figures. */
+#define BENCH_BATCH    16
+
+/* Default and largest number of timed batches per stage */
+#define BENCH_ITERS      2000
+#define BENCH_MAX_ITERS  10000000
+
+/* Snapshots reduced by the batch stages */
+#define BENCH_WINDOW   4096
+
+/* Runs of each startup stage, one exec of free(1) per run */
+#define BENCH_SPAWNS   500
+
+/* Startup stages, the arguments given to free(1) */
+static const struct {
+	const char *name;
+	const char *arg;
+} spawns[] = {
+	{ "startup:table", NULL },
+	{ "startup:json",  "--json" },
+};
+
+#define NR_SPAWNS    (sizeof(spawns) / sizeof(spawns[0]))
+
+extern char **environ;
+
+/* Snapshots used when the source is the fixture, so the
+   renderers run on values which don't change between runs. */
+static const struct free_model fixtures[] = {
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ 17179869184, 4294967296, 12884901888, 2147483648, 536870912,
+	  4294967296, 104857600, 4190109696,
+	  1792224000000000000, 86400000000000, 1, 0, 0, 0, 0,
+	  0, 0, 0, 4294967296, 0 },
+	{ 4398046511104, 1099511627776, 3298534883328, 549755813888,
+	  1073741824, 68719476736, 0, 68719476736,
+	  1792224001000000000, 86401000000000, 2, 0, 0, 0, 0,
+	  2199023255552, 137438953472, 2748779069440, 3161095929856, 0 },
+	{ UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX,
+	  UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX,
+	  UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX,
+	  UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX },
+};
+
+#define NR_FIXTURES    (sizeof(fixtures) / sizeof(fixtures[0]))
+
+/* State shared by the benchmarked operations */
+struct bench_state {
+	struct free_ctx *ctx;
+	struct free_ctx *fixture_ctx;
+	struct free_model mod;
+	const struct free_model *src;
+	struct free_batch batch;
+	struct free_model *window;
+	uint64_t sink;
+	size_t next;
+	FILE *null;
+	int is_fixture;
+};
+
+/* Result of a stage */
+struct bench_result {
+	const char *stage;
+	const char *source;
+	size_t iters;
+	double mean, min, p50, p90, p99, max;
+	double calls;
+};
+
+/* Take the next snapshot, from the kernel or the fixtures.
+   With -f, the fixtures are replayed by the fixture backend
+   of libfree. */
+static void op_collect(struct bench_state *st)
+{
+	if (st->is_fixture && st->fixture_ctx) {
+		free_sample(st->fixture_ctx, &st->mod);
+		return;
+	}
+
+	if (st->is_fixture) {
+		st->mod = fixtures[st->next++ % NR_FIXTURES];
+		return;
+	}
+
+	free_sample(st->ctx, &st->mod);
+}
+
+static void op_pretty(struct bench_state *st)
+{
+	free(pretty_format(st->src->totalram, 0));
+}
+
+static void op_table(struct bench_state *st)
+{
+	print_general_memory(st->null, st->src, 0, 0, 1);
+}
+
+static void op_human(struct bench_state *st)
+{
+	print_general_memory(st->null, st->src, 1, 0, 1);
+}
+
+static void op_unit(struct bench_state *st)
+{
+	print_unit_memory(st->null, st->src, TO_Mi, 1);
+}
+
+static void op_json(struct bench_state *st)
+{
+	print_json(st->null, st->src);
+}
+
+/* Totals of every field over a window, from the columns of a
+   batch and then from the records themselves. */
+static void op_reduce(struct bench_state *st)
+{
+	struct free_reduce red;
+	size_t i;
+
+	for (i = 0; i < FREE_NR_FIELDS; i++) {
+		free_batch_reduce(&st->batch, i, 0, BENCH_WINDOW, &red);
+		st->sink += red.sum + red.min + red.max;
+	}
+}
+
+static void op_reduce_aos(struct bench_state *st)
+{
+	uint64_t sum, min, max, v;
+	size_t i, j;
+
+	for (i = 0; i < FREE_NR_FIELDS; i++) {
+		sum = max = 0;
+		min = UINT64_MAX;
+		for (j = 0; j < BENCH_WINDOW; j++) {
+			v = FREE_FIELD(&st->window[j], i);
+			sum += v;
+			min = v < min ? v : min;
+			max = v > max ? v : max;
+		}
+		st->sink += sum + min + max;
+	}
+}
+
+/* A full frame of the default output: collect and render */
+static void op_frame(struct bench_state *st)
+{
+	op_collect(st);
+	print_general_memory(st->null, &st->mod, 0, 0, 0);
+	fflush(st->null);
+}
+
+static const struct {
+	const char *name;
+	void (*op)(struct bench_state *);
+} stages[] = {
+	{ "collect",       op_collect },
+	{ "pretty_format", op_pretty },
+	{ "render:table",  op_table },
+	{ "render:human",  op_human },
+	{ "render:unit",   op_unit },
+	{ "render:json",   op_json },
+	{ "frame",         op_frame },
+	{ "reduce:batch",  op_reduce },
+	{ "reduce:aos",    op_reduce_aos },
+};
+
+#define NR_STAGES    (sizeof(stages) / sizeof(stages[0]))
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return ((x > y) - (x < y));
+}
+
+/* Sort the samples and compute their percentiles */
+static void summarize(double *samples, size_t n, double sum,
+		      struct bench_result *res)
+{
+	qsort(samples, n, sizeof(double), cmp_double);
+
+	res->mean = sum / (double)n;
+	res->min = samples[0];
+	res->p50 = samples[n / 2];
+	res->p90 = samples[n * 90 / 100];
+	res->p99 = samples[n * 99 / 100];
+	res->max = samples[n - 1];
+}
+
+/* Add up the cost of the samples taken by both contexts */
+static void bench_stats(const struct bench_state *st, struct free_stats *sum)
+{
+	struct free_stats fx;
+
+	free_ctx_stats(st->ctx, sum);
+	if (st->fixture_ctx) {
+		free_ctx_stats(st->fixture_ctx, &fx);
+		sum->samples += fx.samples;
+		sum->syscalls += fx.syscalls;
+	}
+}
+
+/* Run a stage and compute its ns/op percentiles, and the
+   system calls issued per sample taken. */
+static void run_stage(struct bench_state *st, size_t idx, size_t iters,
+		      double *samples, struct bench_result *res)
+{
+	struct free_stats before, after;
+	uint64_t start;
+	double sum;
+	size_t i, j;
+
+	/* Warm up the caches and the allocator */
+	for (i = 0; i < iters / 10 + 1; i++)
+		stages[idx].op(st);
+
+	bench_stats(st, &before);
+	sum = 0;
+	for (i = 0; i < iters; i++) {
+		st->src = st->is_fixture ? &fixtures[i % NR_FIXTURES] : &st->mod;
+
+		start = now_ns();
+		for (j = 0; j < BENCH_BATCH; j++)
+			stages[idx].op(st);
+		samples[i] = (double)(now_ns() - start) / BENCH_BATCH;
+		sum += samples[i];
+	}
+
+	bench_stats(st, &after);
+
+	summarize(samples, iters, sum, res);
+	res->calls = after.samples == before.samples ? 0 :
+		(double)(after.syscalls - before.syscalls) /
+		(double)(after.samples - before.samples);
+	res->stage = stages[idx].name;
+	res->source = st->is_fixture ? "fixture" : "kernel";
+	res->iters = iters * BENCH_BATCH;
+}
+
+/* Time the startup of free(1), from the exec to the exit of
+   the process, with its output sent to /dev/null. */
+static void run_spawn(const char *path, size_t idx, double *samples,
+		      struct bench_result *res)
+{
+	posix_spawn_file_actions_t fa;
+	char *argv[3];
+	uint64_t start;
+	double sum;
+	pid_t pid;
+	size_t i;
+	int status;
+
+	argv[0] = (char *)path;
+	argv[1] = (char *)spawns[idx].arg;
+	argv[2] = NULL;
+
+	if (posix_spawn_file_actions_init(&fa) != 0 ||
+	    posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null",
+					     O_WRONLY, 0) != 0) {
+		perror("posix_spawn_file_actions()");
+		exit(EXIT_FAILURE);
+	}
+
+	sum = 0;
+	for (i = 0; i < BENCH_SPAWNS; i++) {
+		start = now_ns();
+		errno = posix_spawn(&pid, path, &fa, NULL, argv, environ);
+		if (errno != 0 || waitpid(pid, &status, 0) == -1 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+		samples[i] = (double)(now_ns() - start);
+		sum += samples[i];
+	}
+
+	posix_spawn_file_actions_destroy(&fa);
+
+	summarize(samples, BENCH_SPAWNS, sum, res);
+	res->stage = spawns[idx].name;
+	res->source = "kernel";
+	res->iters = BENCH_SPAWNS;
+	res->calls = 0;
+}
+
+/* Pin the process to a CPU, so the results aren't skewed
+   by migrations. */
+static void pin_cpu(int cpu)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == -1)
+		perror("sched_setaffinity()");
+#else
+	cpuset_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1,
+			       sizeof(set), &set) == -1)
+		perror("cpuset_setaffinity()");
+#endif
+}
+
+static void print_result(const struct bench_result *res, int is_json)
+{
+	if (is_json) {
+		fprintf(stdout,
+			"{\"stage\":\"%s\",\"source\":\"%s\",\"ops\":%zu,"
+			"\"mean_ns\":%.1f,\"min_ns\":%.1f,\"p50_ns\":%.1f,"
+			"\"p90_ns\":%.1f,\"p99_ns\":%.1f,\"max_ns\":%.1f,"
+			"\"calls_per_sample\":%.1f}\n",
+			res->stage, res->source, res->iters, res->mean,
+			res->min, res->p50, res->p90, res->p99, res->max,
+			res->calls);
+		return;
+	}
+
+	fprintf(stdout, "%-14s %-8s %10.1f %10.1f %10.1f %10.1f %10.1f %6.1f\n",
+		res->stage, res->source, res->mean, res->p50, res->p90,
+		res->p99, res->max, res->calls);
+}
+
+/* Convert the number of an option, which must be from min to
+   max. Exits on anything else, rather than guess a number. */
+static unsigned long xstrtoul(int opt, const char *src, unsigned long min,
+			      unsigned long max)
+{
+	unsigned long val;
+	char *eptr;
+
+	errno = 0;
+	val = strtoul(src, &eptr, 10);
+	if (*src < '0' || *src > '9' || *eptr != '\0' || errno ||
+	    val < min || val > max) {
+		fprintf(stderr, "free-bench: -%c expects an integer from %lu to %lu\n",
+			opt, min, max);
+		exit(EXIT_FAILURE);
+	}
+
+	return (val);
+}
+
+_Noreturn
+static void usage(int status)
+{
+	fputs("Usage: free-bench [-n ITERATIONS] [-c CPU] [-f FILE] [-x PATH] [-j]\n", stdout);
+	fputs("Measure the overhead of each stage of free(1), in ns/op.\n\n", stdout);
+	fputs("Options:\n", stdout);
+	fputs("  -n N    number of timed batches per stage\n", stdout);
+	fputs("  -c CPU  pin the benchmark to CPU (default: 0)\n", stdout);
+	fputs("  -f FILE collect the fixtures from FILE with the fixture backend\n", stdout);
+	fputs("  -x PATH also time the startup of the free(1) at PATH, exec to exit\n", stdout);
+	fputs("  -j      print the results as JSON, one object per line\n", stdout);
+	exit(status);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_state st = {0};
+	struct bench_result res;
+	const char *spawn_path;
+	double *samples;
+	size_t iters, i;
+	int opt, cpu, is_json;
+
+	iters = BENCH_ITERS;
+	cpu = is_json = 0;
+	spawn_path = NULL;
+
+	while ((opt = getopt(argc, argv, "n:c:f:x:jh")) != -1) {
+		switch (opt) {
+		case 'n':
+			iters = xstrtoul(opt, optarg, 1, BENCH_MAX_ITERS);
+			break;
+
+		case 'c':
+			cpu = (int)xstrtoul(opt, optarg, 0, CPU_SETSIZE - 1);
+			break;
+
+		case 'f':
+			st.fixture_ctx = free_ctx_open_fixture(optarg);
+			if (st.fixture_ctx == NULL) {
+				perror(optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'x':
+			spawn_path = optarg;
+			break;
+
+		case 'j':
+			is_json = 1;
+			break;
+
+		case 'h':
+			usage(EXIT_SUCCESS);
+			/* unreachable */
+
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+
+	pin_cpu(cpu);
+
+	samples = calloc(iters > BENCH_SPAWNS ? iters : BENCH_SPAWNS,
+			 sizeof(double));
+	st.window = calloc(BENCH_WINDOW, sizeof(*st.window));
+	st.ctx = free_ctx_open(FREE_CTX_DEFAULT);
+	st.null = fopen("/dev/null", "w");
+	if (samples == NULL || st.window == NULL || st.ctx == NULL ||
+	    st.null == NULL || free_batch_init(&st.batch, BENCH_WINDOW) == -1) {
+		perror("free-bench");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!is_json)
+		fprintf(stdout, "%-14s %-8s %10s %10s %10s %10s %10s %6s\n",
+			"stage", "source", "mean", "p50", "p90", "p99", "max",
+			"calls");
+
+	/* Every stage runs against the live kernel first,
+	   then against the fixtures. */
+	for (st.is_fixture = 0; st.is_fixture <= 1; st.is_fixture++) {
+		free_sample(st.ctx, &st.mod);
+
+		/* Window of the reduce stages */
+		free_batch_clear(&st.batch);
+		for (i = 0; i < BENCH_WINDOW; i++) {
+			op_collect(&st);
+			st.window[i] = st.mod;
+			free_batch_push(&st.batch, &st.mod);
+		}
+
+		for (i = 0; i < NR_STAGES; i++) {
+			run_stage(&st, i, iters, samples, &res);
+			print_result(&res, is_json);
+		}
+	}
+
+	for (i = 0; spawn_path != NULL && i < NR_SPAWNS; i++) {
+		run_spawn(spawn_path, i, samples, &res);
+		print_result(&res, is_json);
+	}
+
+	fclose(st.null);
+	free_ctx_close(st.ctx);
+	free_ctx_close(st.fixture_ctx);
+	free_batch_free(&st.batch);
+	free(st.window);
+	free(samples);
+	exit(EXIT_SUCCESS);
+}
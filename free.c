@@ -27,74 +27,403 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#if defined(__linux__)
+#  define _GNU_SOURCE    /* accept4(2) */
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <time.h>
 #include <math.h>
+#include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <kvm.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <spawn.h>
+#include <stdatomic.h>
 #include <getopt.h>
+#include <limits.h>
 #include <sys/cdefs.h>
-#include <sys/sysctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#if defined(__linux__)
+#  include <sys/epoll.h>
+#  include <sys/timerfd.h>
+#else
+#  include <sys/event.h>
+#endif
+
+#include "libfree.h"
+#include "render.h"
 
 #ifdef ENABLE_LOCALE
 #  include <libintl.h>
 #  include <locale.h>
-#  define _(msg)    gettext(msg)
+#  define _(msg)    lazy_gettext(msg)
 #else
 #  define _(msg)    msg
 #endif
 
+#ifdef ENABLE_LOCALE
+static pthread_once_t locale_once = PTHREAD_ONCE_INIT;
+
+/* Enable localization. Loading the locale and the catalog
+   probes the file system, so it's done on the first message
+   to translate, which a plain or JSON output never prints.
+   Only the messages and the character set follow the locale,
+   the numbers are always printed and parsed in the C locale. */
+static void locale_init(void)
+{
+	setlocale(LC_CTYPE, "");
+	setlocale(LC_MESSAGES, "");
+	bindtextdomain("free", "/usr/share/locale/");
+	textdomain("free");
+}
+
+static inline char *lazy_gettext(const char *msg)
+{
+	pthread_once(&locale_once, locale_init);
+	return (gettext(msg));
+}
+#endif
+
 /* Program version */
 #define PROGRAM_VERSION    "0.1"
 
-/* Multiply with page size */
-#define CONVERT_UNIT(x) (x * (uint64_t)(sysconf(_SC_PAGESIZE)))
-
-/* Units (in decimal) */
-#define TO_B    (uint64_t)1
-#define TO_K    (uint64_t)1000
-#define TO_M    (uint64_t)(TO_K * 1000)
-#define TO_G    (uint64_t)(TO_M * 1000)
-#define TO_T    (uint64_t)(TO_G * 1000)
-#define TO_P    (uint64_t)(TO_T * 1000)
-#define TO_E    (uint64_t)(TO_P * 1000)
-#define TO_Z    (uint64_t)(TO_E * 1000)
-#define TO_Y    (uint64_t)(TO_Z * 1000)
-
-/* Units (in binary) */
-#define TO_Bi   (uint64_t)1
-#define TO_Ki   (uint64_t)1024
-#define TO_Mi   (uint64_t)(TO_Ki * 1024)
-#define TO_Gi   (uint64_t)(TO_Mi * 1024)
-#define TO_Ti   (uint64_t)(TO_Gi * 1024)
-#define TO_Pi   (uint64_t)(TO_Ti * 1024)
-#define TO_Ei   (uint64_t)(TO_Pi * 1024)
-#define TO_Zi   (uint64_t)(TO_Ei * 1024)
-#define TO_Yi   (uint64_t)(To_Zi * 1024)
-
-/* Structure where retrieved values will reside */
-struct free_model {
-        uint64_t totalram;
-	uint64_t freeram;
-	uint64_t usedram;
-	uint64_t buffer;
-	uint64_t shared;
-	uint64_t totalswap;
-	uint64_t usedswap;
-	uint64_t freeswap;
+/* Default socket of the snapshot daemon (--daemon, --client) */
+#define FREE_SOCKET_PATH   "/var/run/free.sock"
+
+/* Header of a binary snapshot sent by the daemon */
+#define FREE_WIRE_MAGIC    (uint32_t)0x46524545 /* "FREE" */
+#define FREE_WIRE_VERSION  (uint32_t)4
+
+/* Default shared memory segment of the daemon (--shm, --shm-read) */
+#define FREE_SHM_NAME      "/free.snapshot"
+
+/* Maximum number of events handled per event loop iteration */
+#define EVL_MAX            64
+
+/* Longest JSON line and host name read by --aggregate */
+#define AGG_LINE_MAX       4096
+#define AGG_HOST_MAX       256
+
+/* Default number of hosts listed by --aggregate (--top) */
+#define AGG_TOP            5
+
+/* Size of the --live view: rows, history of the sparklines,
+   width of the bar graphs and largest cell (in bytes, the
+   sparklines are UTF-8). */
+#define LIVE_ROWS          15
+#define LIVE_SPARK         60
+#define LIVE_BAR           50
+#define LIVE_CELL_MAX      256
+
+/* Binary snapshot as sent by the daemon. Both ends are on the
+   same host, so "struct free_model" is sent as it is. */
+struct free_wire {
+	uint32_t magic;
+	uint32_t version;
+	struct free_model mod;
+};
+
+/* Snapshots are copied through the ring of --backpressure
+   word by word */
+#define NR_MODEL_WORDS (sizeof(struct free_model) / sizeof(uint64_t))
+
+/* Cost of a frame, for --self-stats */
+struct self_frame {
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+	uint64_t syscalls;
+	uint64_t bytes_read;
+	uint64_t retries;
+};
+
+/* Latest snapshot of a host (--aggregate) */
+struct host_entry {
+	char *name;    /* NULL if the slot is free */
+	uint64_t hash;
+	struct free_model mod;
+};
+
+/* Open addressing hash table of the hosts, kept in
+   a single flat array. */
+struct host_table {
+	struct host_entry *slots;
+	size_t cap;
+	size_t len;
+};
+
+/* Used RAM of a host, to rank the hosts */
+struct host_rank {
+	double pct;
+	struct host_entry *entry;
+};
+
+/* Snapshot stream read by --aggregate */
+struct agg_source {
+	const char *name;
+	int fd;
+	int is_socket;
+	int is_polled;
+	size_t len;
+	char buf[AGG_LINE_MAX];
+};
+
+/* Where the snapshots come from: the collector context,
+   a daemon socket (--client) or shared memory (--shm-read) */
+struct snap_source {
+	struct free_ctx *ctx;
+	int cfd;
+	struct free_shm *shm;
+};
+
+/* Cells of the --live view, redrawn only when they change */
+enum {
+	LC_CLOCK,
+	LC_MEM_TOTAL,
+	LC_MEM_FREE,
+	LC_MEM_USED,
+	LC_MEM_BUFFER,
+	LC_MEM_SHARED,
+	LC_SWAP_TOTAL,
+	LC_SWAP_FREE,
+	LC_SWAP_USED,
+	LC_MEM_BAR,
+	LC_SWAP_BAR,
+	LC_MEM_SPARK,
+	LC_SWAP_SPARK,
+	LC_RATE,
+	NR_LIVE_CELLS,
+};
+
+/* Position of every cell, the columns line up with
+   the output of print_general_memory(). */
+static const struct {
+	int row;
+	int col;
+} live_layout[NR_LIVE_CELLS] = {
+	[LC_CLOCK]      = { 1, 66 },
+	[LC_MEM_TOTAL]  = { 4, 6 },
+	[LC_MEM_FREE]   = { 4, 22 },
+	[LC_MEM_USED]   = { 4, 34 },
+	[LC_MEM_BUFFER] = { 4, 46 },
+	[LC_MEM_SHARED] = { 4, 60 },
+	[LC_SWAP_TOTAL] = { 5, 7 },
+	[LC_SWAP_FREE]  = { 5, 22 },
+	[LC_SWAP_USED]  = { 5, 34 },
+	[LC_MEM_BAR]    = { 7, 7 },
+	[LC_SWAP_BAR]   = { 8, 7 },
+	[LC_MEM_SPARK]  = { 10, 7 },
+	[LC_SWAP_SPARK] = { 11, 7 },
+	[LC_RATE]       = { 13, 7 },
+};
+
+/* History of a sparkline, a fixed ring of percentages */
+struct spark {
+	double val[LIVE_SPARK];
+	unsigned int head;
+	unsigned int len;
+};
+
+/* State of the --live view: the cells on screen, the
+   history of the sparklines and the output buffer. */
+struct live_view {
+	char cells[NR_LIVE_CELLS][LIVE_CELL_MAX];
+	struct spark mem;
+	struct spark swap;
+	uint64_t last_used;
+	uint64_t last_ns;
+	int redraw;
+	size_t len;
+	char out[NR_LIVE_CELLS * (LIVE_CELL_MAX + 16) + 256];
+};
+
+/* Record of the --history ring, a snapshot starts on
+   its own cache line. */
+struct hist_rec {
+	_Alignas(64) struct free_model mod;
+};
+
+/* Ring of the last snapshots (--history), allocated once.
+   Once full, the oldest record is overwritten. */
+struct hist_ring {
+	struct hist_rec *recs;
+	size_t cap;
+	size_t head;
+	size_t len;
+};
+
+/* Backpressure policies of the sampler ring (--backpressure),
+   BP_NONE samples and prints on the same thread. */
+enum {
+	BP_NONE,
+	BP_DROP_OLDEST,
+	BP_DROP_NEWEST,
+	BP_BLOCK,
+};
+
+/* Slots of the ring between the sampler and the writer */
+#define SPSC_SLOTS    64
+
+/* Single producer (sampler), single consumer (writer) ring.
+   The indexes only grow, each one on its own cache line. */
+struct spsc_ring {
+	_Alignas(64) _Atomic size_t head;
+	_Alignas(64) _Atomic size_t tail;
+	_Alignas(64) _Atomic uint64_t slots[SPSC_SLOTS][NR_MODEL_WORDS];
+	_Atomic uint64_t dropped;
+	_Atomic int stop;
+	_Atomic int eof;
+	sem_t items;
+	sem_t spaces;
+	int policy;
+};
+
+/* Arguments of the sampler thread */
+struct sampler {
+	struct spsc_ring *ring;
+	struct snap_source *src;
+	double secs;
+	int count;
+};
+
+/* Fastest rate of a source (--rates), in Hz */
+#define RATE_MAX_HZ    1000
+
+/* Deadline of the multi-rate scheduler (--rates), one per
+   source and one for the frames (FREE_NR_SOURCES). */
+struct rate_timer {
+	uint64_t deadline;
+	uint64_t period;
+	int source;
+};
+
+/* Min-heap of the deadlines, the next one is timers[0] */
+struct rate_heap {
+	struct rate_timer timers[FREE_NR_SOURCES + 1];
+	size_t len;
+};
+
+/* Weight of the latest rate of change in its EWMA, and the
+   change, as a fraction of the total, wanted between two
+   snapshots of --adaptive. */
+#define ADAPT_ALPHA    0.5
+#define ADAPT_QUANTUM  (1.0 / 1024)
+
+/* Bounds and state of the adaptive interval (--adaptive), in
+   nanoseconds. "ewma" is the rate of change of the used RAM
+   and swap, in fractions of their totals per second. */
+struct adapt_state {
+	uint64_t min;
+	uint64_t max;
+	uint64_t cur;
+	double ewma;
+	struct free_model prev;
+	int primed;
+};
+
+/* Event returned by evl_wait() */
+struct evl_event {
+	int fd;
+	int is_timer;
+};
+
+/* Operators of the alert rules, ALERT_EQ is or'ed */
+enum {
+	ALERT_GT = 1,
+	ALERT_LT = 2,
+	ALERT_EQ = 4,
+};
+
+/* The threshold of a rule is absolute */
+#define ALERT_NO_BASE  ((size_t)-1)
+
+/* Fields which an alert rule can test, a percentage is
+   relative to the total of base_off. */
+static const struct {
+	const char *name;
+	size_t off;
+	size_t base_off;
+} alert_fields[] = {
+	{ "total",      offsetof(struct free_model, totalram),  ALERT_NO_BASE },
+	{ "used",       offsetof(struct free_model, usedram),   offsetof(struct free_model, totalram) },
+	{ "free",       offsetof(struct free_model, freeram),   offsetof(struct free_model, totalram) },
+	{ "buffer",     offsetof(struct free_model, buffer),    offsetof(struct free_model, totalram) },
+	{ "shared",     offsetof(struct free_model, shared),    offsetof(struct free_model, totalram) },
+	{ "swap_total", offsetof(struct free_model, totalswap), ALERT_NO_BASE },
+	{ "swap_used",  offsetof(struct free_model, usedswap),  offsetof(struct free_model, totalswap) },
+	{ "swap_free",  offsetof(struct free_model, freeswap),  offsetof(struct free_model, totalswap) },
+	{ "arc",        offsetof(struct free_model, arc_size),  offsetof(struct free_model, totalram) },
+	{ "avail",      offsetof(struct free_model, avail),     offsetof(struct free_model, totalram) },
+};
+
+#define NR_ALERT_FIELDS  (sizeof(alert_fields) / sizeof(alert_fields[0]))
+
+/* Compiled alert rule (--alert) and its state */
+struct alert_rule {
+	const char *text;
+	const char *exec;
+	size_t off;
+	size_t base_off;
+	int op;
+	double limit;
+	double clear;
+	int64_t for_ns;
+	int firing;
+	uint64_t since;
+};
+
+struct alert_set {
+	struct alert_rule *rules;
+	size_t len;
+	size_t running;         /* Hooks not reaped yet */
 };
 
 /* Option flag structure */
 struct opt_flag {
-        uint64_t power_flag;
+        int power_flag;
         int human_flag;
 	int decimal_flag;
 	int total_flag;
 	int secs_flag;
 	int count_flag;
+	int json_flag;
+	int daemon_flag;
+	int client_flag;
+	int shm_read_flag;
+	int self_flag;
+	int aggregate_flag;
+	int live_flag;
+	int timestamp_flag;
+	int consistent_flag;
+	int swap_devices_flag;
+	int policy;
+	int rates_flag;
+	double rates[FREE_NR_SOURCES];
+	int adaptive_flag;
+	struct adapt_state adapt;
+	size_t history;
+	struct alert_set alerts;
+	const char *socket_path;
+	const char *shm_name;
+	const char *fixture_path;
+	const char *arcstats_path;
+	int cache_of_flag;
+	unsigned int threads;
+	int page_census_flag;
+	const char *wss_target;
+	uint64_t window;
 };
 
 enum {
@@ -105,6 +434,9 @@ enum {
 	G_OPT        = 4,
 	T_OPT        = 5,
 	P_OPT        = 6,
+	E_OPT        = 7,
+	Z_OPT        = 8,
+	Y_OPT        = 9,
 
 	/* To binary options */
 	Bi_OPT       = 10,
@@ -113,6 +445,9 @@ enum {
 	Gi_OPT       = 13,
 	Ti_OPT       = 14,
 	Pi_OPT       = 15,
+	Ei_OPT       = 16,
+	Zi_OPT       = 17,
+	Yi_OPT       = 18,
 
 	/* Use pow(1000, n) instead of pow(1024, n) */
 	DECIMAL_OPT  = 19,
@@ -124,8 +459,78 @@ enum {
 	COUNT_OPT    = 'c',
 	HELP_OPT     = 20,
 	VERSION_OPT  = 21,
+	JSON_OPT     = 22,
+	DAEMON_OPT   = 23,
+	SOCKET_OPT   = 24,
+	CLIENT_OPT   = 25,
+	SHM_OPT      = 26,
+	SHM_READ_OPT = 27,
+	SELF_OPT     = 28,
+	FIXTURE_OPT  = 29,
+	AGGREGATE_OPT = 30,
+	TOP_OPT      = 31,
+	LIVE_OPT     = 32,
+	HISTORY_OPT  = 33,
+	ALERT_OPT    = 34,
+	TIMESTAMP_OPT = 35,
+	CONSISTENT_OPT = 36,
+	SWAP_DEVICES_OPT = 37,
+	BACKPRESSURE_OPT = 38,
+	RATES_OPT    = 39,
+	ADAPTIVE_OPT = 40,
+	ARCSTATS_OPT = 41,
+	CACHE_OF_OPT = 42,
+	THREADS_OPT  = 43,
+	PAGE_CENSUS_OPT = 44,
+	WSS_OPT      = 45,
+	WINDOW_OPT   = 46,
 };
 
+/* Set by the signal handler to stop the daemon or the main loop */
+static volatile sig_atomic_t stop_flag;
+
+/* Environment of the hooks of --alert */
+extern char **environ;
+
+/* Set by the signal handler when the terminal is resized (--live) */
+static volatile sig_atomic_t winch_flag;
+
+/* Set by the signal handler to dump the history (--history) */
+static volatile sig_atomic_t dump_flag;
+
+/* Snapshots with values which couldn't be read, shown as "-"
+   (null in JSON). Counted by the sampling threads. */
+static atomic_uint sample_errors;
+
+/* Take a snapshot of every source, counting a failed one */
+static void sample_all(struct free_ctx *ctx, struct free_model *mod)
+{
+	if (free_sample(ctx, mod) == -1)
+		atomic_fetch_add_explicit(&sample_errors, 1, memory_order_relaxed);
+}
+
+/* Read a single source again (--rates), counting a failure */
+static void sample_one(struct free_ctx *ctx, int src, struct free_model *mod)
+{
+	if (free_sample_source(ctx, src, mod) == -1)
+		atomic_fetch_add_explicit(&sample_errors, 1, memory_order_relaxed);
+}
+
+/* Exit status of a run, an error if some values couldn't be
+   read. */
+static int run_status(void)
+{
+	unsigned int n;
+
+	n = atomic_load_explicit(&sample_errors, memory_order_relaxed);
+	if (n == 0)
+		return (EXIT_SUCCESS);
+
+	fflush(stdout);
+	fprintf(stderr, "free: %u snapshots had values which couldn't be read\n", n);
+	return (EXIT_FAILURE);
+}
+
 /* Convert string to int */
 static int xatoi(const char *src)
 {
@@ -146,312 +551,2310 @@ static int xatoi(const char *src)
 	return ((int)((int)(val) & INT32_MAX));
 }
 
-/* Format the output bytes to a human readable format.
-   e.g.
-   Input: 1985596 (in kB, decimal)
-   Output: 1.9Gi (in binary) and 2.0G (in decimal) */
-static char *pretty_format(uint64_t nsz, int is_decimal)
+/* Convert string to a positive double */
+static double xatof(const char *src)
 {
-	double base, res;
-	int idx;
-	char *p;
+	char *eptr;
+	double val;
+
+	val = strtod(src, &eptr);
+	if (eptr == src || *eptr != '\0' || val != val) {
+		fputs(_("free: expected a number "), stderr);
+		fputs(_("but found something else.\n"), stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	return (val);
+}
+
+/* Sleep for a fractional number of seconds. A signal
+   only cuts it short if it asks to stop, or to dump the
+   history. */
+static void sleep_secs(double secs)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)secs;
+	ts.tv_nsec = (long)((secs - (double)ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR &&
+	       !stop_flag && !dump_flag)
+		;
+}
+
+/* Read a clock, in nanoseconds */
+static uint64_t clock_ns(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+/* Monotonic time of a snapshot, or the current time for
+   snapshots without one (fixtures). */
+static uint64_t snap_time(const struct free_model *mod)
+{
+	return (mod->ts_mono ? mod->ts_mono : clock_ns(CLOCK_MONOTONIC));
+}
+
+/* Open the collector context, reading the kernel or
+   replaying a fixture file (--fixture). */
+static struct free_ctx *collect_open(struct opt_flag *flag)
+{
+	struct free_ctx *ctx;
+
+	if (flag->fixture_path) {
+		ctx = free_ctx_open_fixture(flag->fixture_path);
+		if (ctx == NULL) {
+			perror(flag->fixture_path);
+			exit(EXIT_FAILURE);
+		}
+
+		return (ctx);
+	}
+
+	ctx = free_ctx_open(flag->consistent_flag ? FREE_CTX_CONSISTENT :
+			    FREE_CTX_DEFAULT);
+	if (ctx == NULL) {
+		perror("free_ctx_open()");
+		exit(EXIT_FAILURE);
+	}
+
+	if (flag->arcstats_path &&
+	    free_ctx_arcstats(ctx, flag->arcstats_path) == -1) {
+		perror(flag->arcstats_path);
+		exit(EXIT_FAILURE);
+	}
+
+	return (ctx);
+}
+
+/* Print one frame of the collected information in
+   the format selected by the options. */
+static void print_frame(struct free_model *mod, struct opt_flag *flag)
+{
+	char buf[32];
+	time_t t;
+
+	/* JSON output always has the stamps */
+	if (flag->timestamp_flag && !flag->json_flag) {
+		t = (time_t)(mod->ts_real / 1000000000);
+		strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", gmtime(&t));
+		fprintf(stdout, "Time: %s.%09luZ, monotonic %lu.%09lu, seq %lu\n",
+			buf, mod->ts_real % 1000000000, mod->ts_mono / 1000000000,
+			mod->ts_mono % 1000000000, mod->seq);
+	}
+
+	if (flag->json_flag)
+		print_json(stdout, mod);
+	else if (flag->power_flag)
+		print_unit_memory(stdout, mod, flag->power_flag,
+				  flag->total_flag);
+	else
+		print_general_memory(stdout, mod, flag->human_flag,
+				     flag->decimal_flag, flag->total_flag);
+}
+
+/* Print the swap devices (--swap-devices), below the frame
+   and in the same format. */
+static void print_swap_frame(struct free_ctx *ctx, struct opt_flag *flag)
+{
+	struct free_swap_dev devs[FREE_SWAP_DEV_MAX];
+	int n, unit;
+
+	n = free_swap_devices(ctx, devs, FREE_SWAP_DEV_MAX);
+	if (n == -1) {
+		perror("free_swap_devices()");
+		return;
+	}
+
+	if (flag->json_flag) {
+		print_swap_devices_json(stdout, devs, (size_t)n);
+		return;
+	}
+
+	unit = flag->power_flag ? flag->power_flag :
+		flag->decimal_flag ? TO_K : TO_Ki;
+	fputc('\n', stdout);
+	print_swap_devices(stdout, devs, (size_t)n, flag->human_flag,
+			   flag->decimal_flag, unit);
+}
+
+/* Print the census of the physical pages (--page-census),
+   below the frame and in the same format. */
+static void print_census_frame(struct opt_flag *flag)
+{
+	struct free_page_census pc;
+	int unit;
+
+	if (free_page_census(flag->threads, &pc) == -1) {
+		perror("free_page_census()");
+		return;
+	}
+
+	if (flag->json_flag) {
+		print_page_census_json(stdout, &pc);
+		return;
+	}
+
+	unit = flag->power_flag ? flag->power_flag :
+		flag->decimal_flag ? TO_K : TO_Ki;
+	fputc('\n', stdout);
+	print_page_census(stdout, &pc, flag->human_flag, flag->decimal_flag,
+			  unit);
+}
+
+/* Start measuring the cost of a frame (--self-stats). */
+static void self_begin(struct free_ctx *ctx, struct self_frame *frame)
+{
+	struct free_stats st = {0};
+
+	if (ctx)
+		free_ctx_stats(ctx, &st);
+
+	frame->syscalls = st.syscalls;
+	frame->bytes_read = st.bytes_read;
+	frame->retries = st.retries;
+
+	/* The wall clock is read around the CPU clock, so the
+	   wall time always covers the CPU time. */
+	frame->wall_ns = clock_ns(CLOCK_MONOTONIC);
+	frame->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+/* Stop measuring the cost of a frame, and print it as
+   a footer, or a JSON trailer. */
+static void self_end(struct free_ctx *ctx, struct self_frame *frame, int is_json)
+{
+	struct free_stats st = {0};
+
+	frame->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - frame->cpu_ns;
+	frame->wall_ns = clock_ns(CLOCK_MONOTONIC) - frame->wall_ns;
+	if (ctx)
+		free_ctx_stats(ctx, &st);
+
+	frame->syscalls = st.syscalls - frame->syscalls;
+	frame->bytes_read = st.bytes_read - frame->bytes_read;
+	frame->retries = st.retries - frame->retries;
+
+	if (is_json) {
+		fprintf(stdout,
+			"{\"self\":{\"wall_ns\":%lu,\"cpu_ns\":%lu,"
+			"\"syscalls\":%lu,\"bytes_read\":%lu,\"retries\":%lu}}\n",
+			frame->wall_ns, frame->cpu_ns, frame->syscalls,
+			frame->bytes_read, frame->retries);
+		return;
+	}
+
+	fprintf(stdout,
+		"Self: wall %.1fus, cpu %.1fus, %lu syscalls, %lu bytes read, "
+		"%lu retries\n",
+		(double)frame->wall_ns / 1000.0, (double)frame->cpu_ns / 1000.0,
+		frame->syscalls, frame->bytes_read, frame->retries);
+}
+
+/* Print the maximum resident set size of free itself. */
+static void self_exit(int is_json)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		return;
+
+	/* "ru_maxrss" is in kilobytes */
+	if (is_json)
+		fprintf(stdout, "{\"self\":{\"maxrss_kb\":%ld}}\n", ru.ru_maxrss);
+	else
+		fprintf(stdout, "Self: max RSS %ldKi\n", ru.ru_maxrss);
+}
+
+/* Parse a duration, e.g. 10s, 500ms, 2m or 1h (seconds
+   without a suffix). Returns -1 if it's malformed. */
+static int64_t parse_duration(const char *src)
+{
+	char *eptr;
+	double val;
+
+	val = strtod(src, &eptr);
+	if (eptr == src || val < 0 || val != val)
+		return (-1);
+
+	if (strcmp(eptr, "ms") == 0)
+		val /= 1000.0;
+	else if (strcmp(eptr, "m") == 0)
+		val *= 60.0;
+	else if (strcmp(eptr, "h") == 0)
+		val *= 3600.0;
+	else if (*eptr != '\0' && strcmp(eptr, "s") != 0)
+		return (-1);
+
+	return ((int64_t)(val * 1e9));
+}
+
+/* Parse the value of an alert, a number of bytes with an
+   optional unit (K, Ki, M, Mi, ...) or a percentage. */
+static int parse_alert_value(const char *src, double *val, int *is_pct)
+{
+	static const char units[] = "KMGTP";
+	const char *u;
+	char *eptr;
+	double mul;
+
+	*val = strtod(src, &eptr);
+	*is_pct = 0;
+	if (eptr == src || *val != *val)
+		return (-1);
+
+	if (*eptr == '\0')
+		return (0);
+
+	if (strcmp(eptr, "%") == 0) {
+		*is_pct = 1;
+		return (0);
+	}
+
+	u = strchr(units, *eptr);
+	if (u == NULL || *u == '\0')
+		return (-1);
+
+	mul = 1000.0;
+	if (*++eptr == 'i') {
+		mul = 1024.0;
+		eptr++;
+	}
+	if (*eptr != '\0')
+		return (-1);
+
+	*val *= pow(mul, (double)(u - units + 1));
+	return (0);
+}
+
+_Noreturn
+static void alert_error(const char *spec)
+{
+	fputs(_("free: invalid alert rule: "), stderr);
+	fputs(spec, stderr);
+	fputc('\n', stderr);
+	exit(EXIT_FAILURE);
+}
+
+/* Compile an alert rule, e.g. "used>90%:for=10s:hyst=5:exec=/hook",
+   into the rule table. Everything is resolved here, so that
+   evaluating a rule is an offset, a division and a comparison. */
+static void alert_compile(struct alert_set *set, const char *spec)
+{
+	struct alert_rule *rule, *rules;
+	char *buf, *expr, *opt, *p;
+	double hyst;
+	size_t i, len;
+	int is_pct;
+
+	rules = realloc(set->rules, (set->len + 1) * sizeof(*rules));
+	buf = strdup(spec);
+	if (rules == NULL || buf == NULL) {
+		perror("realloc()");
+		abort();
+	}
+
+	set->rules = rules;
+	rule = &set->rules[set->len];
+	memset(rule, 0, sizeof(*rule));
+	rule->text = spec;
+	hyst = 0;
+
+	/* Field */
+	expr = strsep(&buf, ":");
+	len = strcspn(expr, "<>");
+	for (i = 0; i < NR_ALERT_FIELDS; i++) {
+		if (strlen(alert_fields[i].name) == len &&
+		    strncmp(alert_fields[i].name, expr, len) == 0)
+			break;
+	}
+	if (i == NR_ALERT_FIELDS)
+		alert_error(spec);
+
+	rule->off = alert_fields[i].off;
+	rule->base_off = alert_fields[i].base_off;
+
+	/* Operator */
+	p = expr + len;
+	if (*p == '\0')
+		alert_error(spec);
+	rule->op = (p[0] == '>' ? ALERT_GT : ALERT_LT) | (p[1] == '=' ? ALERT_EQ : 0);
+	p += p[1] == '=' ? 2 : 1;
+
+	/* Threshold */
+	if (parse_alert_value(p, &rule->limit, &is_pct) == -1 ||
+	    (is_pct && rule->base_off == ALERT_NO_BASE))
+		alert_error(spec);
+	if (!is_pct)
+		rule->base_off = ALERT_NO_BASE;
+
+	/* Options */
+	while ((opt = strsep(&buf, ":")) != NULL) {
+		if (strncmp(opt, "exec=", 5) == 0 && opt[5] != '\0') {
+			rule->exec = opt + 5;
+		} else if (strncmp(opt, "for=", 4) == 0) {
+			if ((rule->for_ns = parse_duration(opt + 4)) < 0)
+				alert_error(spec);
+		} else if (strncmp(opt, "hyst=", 5) == 0) {
+			if (parse_alert_value(opt + 5, &hyst, &is_pct) == -1)
+				alert_error(spec);
+		} else {
+			alert_error(spec);
+		}
+	}
+
+	/* Once fired, the rule clears on the other side of the
+	   hysteresis band only. */
+	rule->clear = rule->op & ALERT_GT ? rule->limit - hyst : rule->limit + hyst;
+	set->len++;
+}
+
+/* Run the hook of an alert, without waiting for it. Its
+   arguments are the state ("fire" or "clear"), the rule
+   and the value. */
+static void alert_notify(struct alert_set *set, struct alert_rule *rule,
+			 double val)
+{
+	char value[32];
+	char *argv[5];
+	pid_t pid;
+
+	snprintf(value, sizeof(value), "%.1f", val);
+	if (rule->exec == NULL) {
+		fprintf(stderr, "free: alert %s: %s (%s)\n",
+			rule->firing ? "fire" : "clear", rule->text, value);
+		return;
+	}
+
+	argv[0] = (char *)rule->exec;
+	argv[1] = rule->firing ? "fire" : "clear";
+	argv[2] = (char *)rule->text;
+	argv[3] = value;
+	argv[4] = NULL;
+
+	/* Reaped by alert_reap(), on a later sample */
+	if (posix_spawn(&pid, rule->exec, NULL, NULL, argv, environ) != 0)
+		fprintf(stderr, "free: can't run %s\n", rule->exec);
+	else
+		set->running++;
+}
+
+/* Reap the hooks which exited, without waiting for the others.
+   They are the only children of free. SIGCHLD keeps its default
+   action, ignoring it would be inherited by the hooks and break
+   the ones which wait for their own children. */
+static void alert_reap(struct alert_set *set)
+{
+	while (set->running && waitpid(-1, NULL, WNOHANG) > 0)
+		set->running--;
+}
+
+/* Evaluate every alert rule against a snapshot. A rule fires
+   (or clears) once its condition held for its whole minimum
+   duration. */
+static void alert_eval(struct alert_set *set, const struct free_model *mod,
+		       uint64_t now)
+{
+	struct alert_rule *rule;
+	uint64_t raw, base;
+	double val, lim;
+	size_t i;
+	int cond;
+
+	alert_reap(set);
+	for (i = 0; i < set->len; i++) {
+		rule = &set->rules[i];
+		raw = *(const uint64_t *)((const char *)mod + rule->off);
+		base = rule->base_off != ALERT_NO_BASE ?
+			*(const uint64_t *)((const char *)mod + rule->base_off) : 0;
+
+		/* A value which couldn't be read keeps the rule as it is */
+		if (raw == (uint64_t)-1 || base == (uint64_t)-1)
+			continue;
+
+		val = (double)raw;
+		if (rule->base_off != ALERT_NO_BASE)
+			val = base > 0 ? val * 100.0 / (double)base : 0.0;
+
+		lim = rule->firing ? rule->clear : rule->limit;
+		switch (rule->op) {
+		case ALERT_GT:
+			cond = val > lim;
+			break;
+		case ALERT_GT | ALERT_EQ:
+			cond = val >= lim;
+			break;
+		case ALERT_LT:
+			cond = val < lim;
+			break;
+		default:
+			cond = val <= lim;
+			break;
+		}
+
+		/* Nothing to do while the state holds */
+		if (cond == rule->firing) {
+			rule->since = 0;
+			continue;
+		}
+
+		if (rule->since == 0)
+			rule->since = now;
+		if (now - rule->since < (uint64_t)rule->for_ns)
+			continue;
+
+		rule->firing = cond;
+		rule->since = 0;
+		alert_notify(set, rule, val);
+	}
+}
+
+/* Open an event queue, kqueue(2) on the BSDs and epoll(7) on Linux. */
+static int evl_open(void)
+{
+#if defined(__linux__)
+	return (epoll_create1(EPOLL_CLOEXEC));
+#else
+	return (kqueue());
+#endif
+}
+
+/* Watch a file descriptor for readability. There is no matching
+   delete function, close(2) removes it from the queue. */
+static int evl_add(int evl, int fd)
+{
+#if defined(__linux__)
+	struct epoll_event ev = {0};
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uint64_t)(unsigned int)fd;
+	return (epoll_ctl(evl, EPOLL_CTL_ADD, fd, &ev));
+#else
+	struct kevent kev;
+
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	return (kevent(evl, &kev, 1, NULL, 0, NULL));
+#endif
+}
+
+/* Add a periodic timer, firing every "msecs" milliseconds.
+   Only one timer per queue is supported. */
+static int evl_add_timer(int evl, long msecs)
+{
+#if defined(__linux__)
+	struct itimerspec its = {0};
+	struct epoll_event ev = {0};
+	int tfd;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd == -1)
+		return (-1);
+
+	its.it_interval.tv_sec = msecs / 1000;
+	its.it_interval.tv_nsec = (msecs % 1000) * 1000000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(tfd, 0, &its, NULL) == -1) {
+		close(tfd);
+		return (-1);
+	}
+
+	/* Tag the timer, so evl_wait() can tell it apart */
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uint64_t)(unsigned int)tfd | ((uint64_t)1 << 32);
+	return (epoll_ctl(evl, EPOLL_CTL_ADD, tfd, &ev));
+#else
+	struct kevent kev;
+
+	EV_SET(&kev, 0, EVFILT_TIMER, EV_ADD, 0, msecs, NULL);
+	return (kevent(evl, &kev, 1, NULL, 0, NULL));
+#endif
+}
+
+/* Wait for events. Returns the number of events stored in
+   "out", or -1 on error (e.g. EINTR). */
+static int evl_wait(int evl, struct evl_event *out, int max)
+{
+#if defined(__linux__)
+	struct epoll_event evs[EVL_MAX];
+	uint64_t expired;
+#else
+	struct kevent evs[EVL_MAX];
+#endif
+	int i, n;
+
+	if (max > EVL_MAX)
+		max = EVL_MAX;
+
+#if defined(__linux__)
+	n = epoll_wait(evl, evs, max, -1);
+	for (i = 0; i < n; i++) {
+		out[i].fd = (int)(evs[i].data.u64 & UINT32_MAX);
+		out[i].is_timer = (int)(evs[i].data.u64 >> 32);
+
+		/* Drain the timer, otherwise it stays readable */
+		if (out[i].is_timer &&
+		    read(out[i].fd, &expired, sizeof(expired)) == -1)
+			out[i].is_timer = 0;
+	}
+#else
+	n = kevent(evl, NULL, 0, evs, max, NULL);
+	for (i = 0; i < n; i++) {
+		out[i].fd = (int)evs[i].ident;
+		out[i].is_timer = evs[i].filter == EVFILT_TIMER;
+	}
+#endif
 
-	if (nsz <= 0)
-		return strdup("0B");
+	return (n);
+}
+
+/* Signal handler of the daemon and the main loop */
+static void stop_handler(int sig)
+{
+	(void)sig;
+	stop_flag = 1;
+}
+
+/* Answer the requests pending on a client connection.
+   Every request is a single byte, 'b' for a binary snapshot
+   (struct free_wire) and 'j' for a JSON line. Returns -1 if
+   the connection should be closed. */
+static int serve_client(int fd, const struct free_wire *wire,
+			const char *json, size_t json_len)
+{
+	char req[64];
+	ssize_t i, n, ret;
+
+	n = read(fd, req, sizeof(req));
+	if (n <= 0)
+		return (-1);
+
+	for (i = 0; i < n; i++) {
+		if (req[i] == 'b')
+			ret = send(fd, wire, sizeof(*wire), MSG_NOSIGNAL);
+		else if (req[i] == 'j')
+			ret = send(fd, json, json_len, MSG_NOSIGNAL);
+		else
+			return (-1);
+
+		/* The socket is non-blocking, a client that doesn't
+		   read its answers is dropped instead of stalling
+		   everyone else. */
+		if (ret == -1 ||
+		    (size_t)ret != (req[i] == 'b' ? sizeof(*wire) : json_len))
+			return (-1);
+	}
+
+	return (0);
+}
+
+/* Create (or open) the shared memory segment where
+   the daemon publishes its snapshots. */
+static struct free_shm *shm_create(const char *name)
+{
+	struct free_shm *shm;
+	int fd;
+
+	fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd == -1 || ftruncate(fd, sizeof(*shm)) == -1) {
+		perror("shm_open()");
+		exit(EXIT_FAILURE);
+	}
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		perror("mmap()");
+		exit(EXIT_FAILURE);
+	}
+
+	shm->magic = FREE_WIRE_MAGIC;
+	shm->version = FREE_WIRE_VERSION;
+	return (shm);
+}
+
+/* Map the shared memory segment of a running daemon. */
+static struct free_shm *shm_attach(const char *name)
+{
+	struct free_shm *shm;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1) {
+		perror("shm_open()");
+		exit(EXIT_FAILURE);
+	}
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		perror("mmap()");
+		exit(EXIT_FAILURE);
+	}
+
+	if (shm->magic != FREE_WIRE_MAGIC || shm->version != FREE_WIRE_VERSION) {
+		fputs(_("free: unknown snapshot format.\n"), stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	return (shm);
+}
+
+/* Create the listening socket of the daemon. */
+static int daemon_listen(const char *path)
+{
+	struct sockaddr_un sun = {0};
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fputs(_("free: socket path is too long.\n"), stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Remove a stale socket left by a previous run */
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    listen(fd, SOMAXCONN) == -1) {
+		perror("bind()");
+		exit(EXIT_FAILURE);
+	}
+
+	return (fd);
+}
+
+/* Run as a daemon: collect a snapshot every "secs" seconds,
+   and serve the latest one to every client connected to
+   the socket, and in shared memory if --shm is given. */
+static int run_daemon(struct free_ctx *ctx, struct opt_flag *flag, double secs)
+{
+	struct evl_event evs[EVL_MAX];
+	struct free_wire wire = {0};
+	struct sigaction sa = {0};
+	struct free_shm *shm;
+	char json[1024];
+	size_t json_len;
+	int evl, lfd, cfd, i, n;
+
+	sa.sa_handler = stop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	wire.magic = FREE_WIRE_MAGIC;
+	wire.version = FREE_WIRE_VERSION;
+	sample_all(ctx, &wire.mod);
+	json_len = format_json(json, sizeof(json), &wire.mod);
+
+	shm = NULL;
+	if (flag->shm_name) {
+		shm = shm_create(flag->shm_name);
+		free_shm_publish(shm, &wire.mod);
+	}
+
+	lfd = daemon_listen(flag->socket_path);
+	evl = evl_open();
+	if (evl == -1 || evl_add(evl, lfd) == -1 ||
+	    evl_add_timer(evl, secs ? (long)(secs * 1000) : 1000) == -1) {
+		perror("evl_open()");
+		unlink(flag->socket_path);
+		exit(EXIT_FAILURE);
+	}
+
+	while (!stop_flag) {
+		n = evl_wait(evl, evs, EVL_MAX);
+		if (n == -1 && errno != EINTR) {
+			perror("evl_wait()");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (evs[i].is_timer) {
+				/* Take a new snapshot */
+				sample_all(ctx, &wire.mod);
+				json_len = format_json(json, sizeof(json), &wire.mod);
+				if (shm)
+					free_shm_publish(shm, &wire.mod);
+				if (flag->alerts.len)
+					alert_eval(&flag->alerts, &wire.mod,
+						   snap_time(&wire.mod));
+			} else if (evs[i].fd == lfd) {
+				/* Accept all pending connections */
+				while ((cfd = accept4(lfd, NULL, NULL,
+						      SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+					if (evl_add(evl, cfd) == -1)
+						close(cfd);
+				}
+			} else if (serve_client(evs[i].fd, &wire, json, json_len) == -1) {
+				close(evs[i].fd);
+			}
+		}
+	}
+
+	close(lfd);
+	close(evl);
+	unlink(flag->socket_path);
+	if (shm) {
+		munmap(shm, sizeof(*shm));
+		shm_unlink(flag->shm_name);
+	}
+	return (run_status());
+}
+
+/* Connect to the daemon. */
+static int client_connect(const char *path)
+{
+	struct sockaddr_un sun = {0};
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fputs(_("free: socket path is too long.\n"), stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		perror("connect()");
+		exit(EXIT_FAILURE);
+	}
+
+	return (fd);
+}
+
+/* Ask the daemon for its latest snapshot. */
+static void client_fetch(int fd, struct free_model *mod)
+{
+	struct free_wire wire;
+	size_t off;
+	ssize_t ret;
+
+	if (write(fd, "b", 1) != 1) {
+		perror("write()");
+		exit(EXIT_FAILURE);
+	}
+
+	for (off = 0; off < sizeof(wire); off += (size_t)ret) {
+		ret = read(fd, (char *)&wire + off, sizeof(wire) - off);
+		if (ret <= 0) {
+			fputs(_("free: connection closed by the daemon.\n"), stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (wire.magic != FREE_WIRE_MAGIC || wire.version != FREE_WIRE_VERSION) {
+		fputs(_("free: unknown snapshot format.\n"), stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	*mod = wire.mod;
+}
+
+/* Take a snapshot from the selected source. */
+static void take_snapshot(struct snap_source *src, struct free_model *mod)
+{
+	if (src->cfd != -1)
+		client_fetch(src->cfd, mod);
+	else if (src->shm)
+		free_shm_read(src->shm, mod);
+	else
+		sample_all(src->ctx, mod);
+}
+
+/* Signal handler of --history, dump the ring */
+static void dump_handler(int sig)
+{
+	(void)sig;
+	dump_flag = 1;
+}
+
+/* Allocate the --history ring. This is the only allocation,
+   recording a snapshot is a copy. */
+static void hist_init(struct hist_ring *ring, size_t cap)
+{
+	ring->recs = aligned_alloc(_Alignof(struct hist_rec),
+				   cap * sizeof(struct hist_rec));
+	if (ring->recs == NULL) {
+		perror("aligned_alloc()");
+		exit(EXIT_FAILURE);
+	}
+
+	ring->cap = cap;
+	ring->head = ring->len = 0;
+}
+
+/* Record a snapshot, overwriting the oldest one once full */
+static inline void hist_push(struct hist_ring *ring, const struct free_model *mod)
+{
+	ring->recs[ring->head].mod = *mod;
+	if (++ring->head == ring->cap)
+		ring->head = 0;
+	if (ring->len < ring->cap)
+		ring->len++;
+}
+
+/* Print every recorded snapshot, oldest first, in the
+   output format selected by the options. */
+static void hist_dump(struct hist_ring *ring, struct opt_flag *flag)
+{
+	size_t i, idx;
+
+	if (flag->json_flag)
+		fprintf(stdout, "{\"history\":%zu}\n", ring->len);
+	else
+		fprintf(stdout, "History: %zu snapshots, oldest first\n\n", ring->len);
+
+	for (i = 0; i < ring->len; i++) {
+		idx = (ring->head + ring->cap - ring->len + i) % ring->cap;
+		print_frame(&ring->recs[idx].mod, flag);
+		if (!flag->json_flag)
+			fputc('\n', stdout);
+	}
+
+	fflush(stdout);
+}
+
+/* Wait until the next frame is due, dumping the history
+   whenever SIGUSR1 is received meanwhile. */
+static void watch_sleep(double secs, struct hist_ring *ring, struct opt_flag *flag)
+{
+	uint64_t deadline, now;
+
+	deadline = clock_ns(CLOCK_MONOTONIC) + (uint64_t)(secs * 1e9);
+	while (!stop_flag && (now = clock_ns(CLOCK_MONOTONIC)) < deadline) {
+		sleep_secs((double)(deadline - now) / 1e9);
+		if (dump_flag) {
+			dump_flag = 0;
+			hist_dump(ring, flag);
+		}
+	}
+}
+
+/* Parse the bounds of --adaptive, two durations MIN:MAX
+   within the ones accepted by -s. */
+static void parse_adaptive(struct adapt_state *ad, const char *src)
+{
+	const char *sep;
+	char lo[32];
+	int64_t min, max;
+
+	sep = strchr(src, ':');
+	if (sep == NULL || (size_t)(sep - src) >= sizeof(lo))
+		goto bad;
+
+	memcpy(lo, src, (size_t)(sep - src));
+	lo[sep - src] = '\0';
+	min = parse_duration(lo);
+	max = parse_duration(sep + 1);
+	if (min < 10000000 || max < min || max > (int64_t)216000 * 1000000000)
+		goto bad;
+
+	ad->min = (uint64_t)min;
+	ad->max = (uint64_t)max;
+	return;
+
+bad:
+	fputs(_("free: invalid interval: "), stderr);
+	fputs(src, stderr);
+	fputs(_(" (e.g. 100ms:10s, from 0.01 to 216000 seconds)\n"), stderr);
+	exit(EXIT_FAILURE);
+}
+
+/* Change of a used counter, as a fraction of its total */
+static inline double adapt_delta(uint64_t cur, uint64_t prev, uint64_t total)
+{
+	if (total == 0 || total == (uint64_t)-1 || cur == (uint64_t)-1 ||
+	    prev == (uint64_t)-1)
+		return (0);
+
+	return ((cur > prev ? (double)(cur - prev) : (double)(prev - cur)) /
+		(double)total);
+}
+
+/* Interval until the next snapshot of --adaptive. The rate of
+   change of the used RAM and swap is smoothed by an EWMA, and
+   the interval is the one in which it would move by
+   ADAPT_QUANTUM. A faster interval is taken at once, a slower
+   one at most doubles the previous, so a quiet system is
+   backed off exponentially, up to MAX. */
+static uint64_t adapt_next(struct adapt_state *ad, const struct free_model *mod)
+{
+	double rate, want;
+
+	if (!ad->primed) {
+		ad->prev = *mod;
+		ad->cur = ad->min;
+		ad->primed = 1;
+		return (ad->cur);
+	}
+
+	/* The snapshots of a fixture have no time, use the
+	   interval which was slept instead. */
+	rate = (adapt_delta(mod->usedram, ad->prev.usedram, mod->totalram) +
+		adapt_delta(mod->usedswap, ad->prev.usedswap, mod->totalswap)) /
+		((double)ad->cur / 1e9);
+	ad->ewma = ADAPT_ALPHA * rate + (1 - ADAPT_ALPHA) * ad->ewma;
+	ad->prev = *mod;
+
+	want = ad->ewma > 0 ? ADAPT_QUANTUM / ad->ewma * 1e9 : (double)ad->max;
+	if (want < (double)ad->cur)
+		ad->cur = want > (double)ad->min ? (uint64_t)want : ad->min;
+	else if (want < (double)ad->cur * 2 && want < (double)ad->max)
+		ad->cur = (uint64_t)want;
+	else
+		ad->cur = ad->cur * 2 < ad->max ? ad->cur * 2 : ad->max;
+
+	return (ad->cur);
+}
+
+/* Parse a backpressure policy (--backpressure) */
+static int parse_policy(const char *src)
+{
+	if (strcmp(src, "drop-oldest") == 0)
+		return (BP_DROP_OLDEST);
+	if (strcmp(src, "drop-newest") == 0)
+		return (BP_DROP_NEWEST);
+	if (strcmp(src, "block") == 0)
+		return (BP_BLOCK);
+
+	fputs(_("free: backpressure is drop-oldest, drop-newest or block.\n"),
+	      stderr);
+	exit(EXIT_FAILURE);
+}
+
+/* Copy a snapshot in or out of a slot of the ring, word by
+   word, as the other thread may touch the slot meanwhile
+   (drop-oldest). */
+static void slot_store(_Atomic uint64_t *slot, const struct free_model *mod)
+{
+	uint64_t words[NR_MODEL_WORDS];
+	size_t i;
+
+	memcpy(words, mod, sizeof(words));
+	for (i = 0; i < NR_MODEL_WORDS; i++)
+		atomic_store_explicit(&slot[i], words[i], memory_order_relaxed);
+}
+
+static void slot_load(_Atomic uint64_t *slot, struct free_model *mod)
+{
+	uint64_t words[NR_MODEL_WORDS];
+	size_t i;
+
+	for (i = 0; i < NR_MODEL_WORDS; i++)
+		words[i] = atomic_load_explicit(&slot[i], memory_order_relaxed);
+	memcpy(mod, words, sizeof(words));
+}
+
+/* Push a snapshot (sampler side). When the ring is full, the
+   policy decides: drop this snapshot, wait for the writer, or
+   take the oldest snapshot back from the writer. */
+static void spsc_push(struct spsc_ring *ring, const struct free_model *mod)
+{
+	size_t head, tail;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	for (;;) {
+		tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+		if (head - tail < SPSC_SLOTS)
+			break;
+
+		if (ring->policy == BP_DROP_NEWEST) {
+			atomic_fetch_add_explicit(&ring->dropped, 1,
+						  memory_order_relaxed);
+			return;
+		}
+
+		if (ring->policy == BP_BLOCK) {
+			if (atomic_load_explicit(&ring->stop, memory_order_acquire))
+				return;
+			sem_wait(&ring->spaces);
+			continue;
+		}
+
+		/* Drop the oldest, unless the writer took it first */
+		if (atomic_compare_exchange_strong_explicit(&ring->tail, &tail,
+							    tail + 1,
+							    memory_order_acq_rel,
+							    memory_order_acquire))
+			atomic_fetch_add_explicit(&ring->dropped, 1,
+						  memory_order_relaxed);
+	}
+
+	slot_store(ring->slots[head % SPSC_SLOTS], mod);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	sem_post(&ring->items);
+}
+
+/* Pop the oldest snapshot (writer side). Returns -1 if the
+   ring is empty. The tail is moved with a CAS: if the sampler
+   dropped the slot while it was copied, the copy is retried on
+   the next one. */
+static int spsc_pop(struct spsc_ring *ring, struct free_model *mod)
+{
+	size_t tail;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	do {
+		if (tail == atomic_load_explicit(&ring->head, memory_order_acquire))
+			return (-1);
+
+		slot_load(ring->slots[tail % SPSC_SLOTS], mod);
+	} while (!atomic_compare_exchange_strong_explicit(&ring->tail, &tail,
+							  tail + 1,
+							  memory_order_acq_rel,
+							  memory_order_acquire));
+
+	sem_post(&ring->spaces);
+	return (0);
+}
+
+/* Sampler thread: take a snapshot on every deadline. The
+   deadlines are absolute, so a late snapshot doesn't shift
+   the next ones. */
+static void *sampler_main(void *arg)
+{
+	struct sampler *sp = arg;
+	struct free_model mod;
+	struct timespec ts;
+	uint64_t next;
+	int count;
+
+	count = sp->count;
+	next = clock_ns(CLOCK_MONOTONIC);
+	while (!atomic_load_explicit(&sp->ring->stop, memory_order_acquire)) {
+		take_snapshot(sp->src, &mod);
+		spsc_push(sp->ring, &mod);
+		if (count && --count == 0)
+			break;
+
+		next += (uint64_t)(sp->secs * 1e9);
+		ts.tv_sec = (time_t)(next / 1000000000);
+		ts.tv_nsec = (long)(next % 1000000000);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+	}
+
+	atomic_store_explicit(&sp->ring->eof, 1, memory_order_release);
+	sem_post(&sp->ring->items);
+	return (NULL);
+}
+
+/* Loop of -s with --backpressure. Snapshots are taken by a
+   sampler thread and printed by this one, so a blocked stdout
+   doesn't delay the sampling. The sequence numbers of the
+   snapshots show where some were dropped. */
+static int run_pipeline(struct snap_source *src, struct opt_flag *flag,
+			double secs, int count, struct hist_ring *hist)
+{
+	struct sigaction sa = {0};
+	struct spsc_ring *ring;
+	struct free_model mod;
+	struct sampler sp;
+	sigset_t set, old;
+	pthread_t tid;
+	uint64_t dropped;
+	int first;
+
+	ring = aligned_alloc(64, sizeof(*ring));
+	if (ring == NULL) {
+		perror("aligned_alloc()");
+		abort();
+	}
+
+	memset(ring, 0, sizeof(*ring));
+	ring->policy = flag->policy;
+	if (sem_init(&ring->items, 0, 0) == -1 ||
+	    sem_init(&ring->spaces, 0, 0) == -1) {
+		perror("sem_init()");
+		exit(EXIT_FAILURE);
+	}
+
+	/* sem_wait(3) returns on ^C, to print the drop counter */
+	sa.sa_handler = stop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* Signals are handled by this thread, not the sampler */
+	sp.ring = ring;
+	sp.src = src;
+	sp.secs = secs;
+	sp.count = count;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	if (pthread_create(&tid, NULL, sampler_main, &sp) != 0) {
+		perror("pthread_create()");
+		exit(EXIT_FAILURE);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	for (first = 1; !stop_flag;) {
+		if (sem_wait(&ring->items) == -1 && errno != EINTR)
+			break;
+
+		if (dump_flag) {
+			dump_flag = 0;
+			hist_dump(hist, flag);
+		}
+
+		while (!stop_flag && spsc_pop(ring, &mod) == 0) {
+			if (!first && !flag->json_flag)
+				fputc('\n', stdout);
+			first = 0;
+
+			if (flag->history)
+				hist_push(hist, &mod);
+			if (flag->alerts.len)
+				alert_eval(&flag->alerts, &mod, snap_time(&mod));
+			print_frame(&mod, flag);
+		}
+
+		fflush(stdout);
+		if (atomic_load_explicit(&ring->eof, memory_order_acquire) &&
+		    atomic_load_explicit(&ring->tail, memory_order_acquire) ==
+		    atomic_load_explicit(&ring->head, memory_order_acquire))
+			break;
+	}
+
+	/* Wake the sampler up if it waits for room */
+	atomic_store_explicit(&ring->stop, 1, memory_order_release);
+	sem_post(&ring->spaces);
+	pthread_join(tid, NULL);
+
+	dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+	if (dropped)
+		fprintf(stderr, "free: %lu snapshots dropped\n", dropped);
+
+	sem_destroy(&ring->items);
+	sem_destroy(&ring->spaces);
+	free(ring);
+	return (run_status());
+}
+
+/* Parse the rates of the sources (--rates), e.g.
+   "mem=100,swap=1,shared=0.1" in Hz. */
+static void parse_rates(double *rates, const char *spec)
+{
+	char *buf, *p, *tok, *eptr;
+	size_t len;
+	int i;
+
+	buf = strdup(spec);
+	if (buf == NULL) {
+		perror("strdup()");
+		abort();
+	}
+
+	for (p = buf; (tok = strsep(&p, ",")) != NULL;) {
+		len = strcspn(tok, "=");
+		for (i = 0; i < FREE_NR_SOURCES; i++) {
+			if (strlen(free_source_names[i]) == len &&
+			    strncmp(free_source_names[i], tok, len) == 0)
+				break;
+		}
+
+		if (i == FREE_NR_SOURCES || tok[len] != '=')
+			goto bad;
+
+		rates[i] = strtod(tok + len + 1, &eptr);
+		if (eptr == tok + len + 1 || *eptr != '\0' ||
+		    !(rates[i] > 0 && rates[i] <= RATE_MAX_HZ))
+			goto bad;
+	}
+
+	free(buf);
+	return;
+
+bad:
+	fputs(_("free: invalid rates: "), stderr);
+	fputs(spec, stderr);
+	fputs(_(" (e.g. mem=100,swap=1, up to 1000 Hz)\n"), stderr);
+	exit(EXIT_FAILURE);
+}
+
+/* Restore the heap property below a timer */
+static void rate_sift_down(struct rate_heap *heap, size_t i)
+{
+	struct rate_timer tmp;
+	size_t l, r, min;
+
+	for (;;) {
+		l = 2 * i + 1;
+		r = l + 1;
+		min = i;
+		if (l < heap->len &&
+		    heap->timers[l].deadline < heap->timers[min].deadline)
+			min = l;
+		if (r < heap->len &&
+		    heap->timers[r].deadline < heap->timers[min].deadline)
+			min = r;
+		if (min == i)
+			return;
+
+		tmp = heap->timers[i];
+		heap->timers[i] = heap->timers[min];
+		heap->timers[min] = tmp;
+		i = min;
+	}
+}
+
+/* Add a timer, due at "deadline" and every "period" after */
+static void rate_push(struct rate_heap *heap, uint64_t deadline,
+		      uint64_t period, int source)
+{
+	struct rate_timer tmp;
+	size_t i, parent;
+
+	i = heap->len++;
+	heap->timers[i].deadline = deadline;
+	heap->timers[i].period = period;
+	heap->timers[i].source = source;
+
+	for (; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (heap->timers[parent].deadline <= heap->timers[i].deadline)
+			break;
+
+		tmp = heap->timers[i];
+		heap->timers[i] = heap->timers[parent];
+		heap->timers[parent] = tmp;
+	}
+}
+
+/* Loop of --rates. Every source is read at its own rate, by
+   this single thread, from a min-heap of deadlines; frames
+   show the latest values every N seconds (-s, default 1),
+   with the age of each source. */
+static int run_rates(struct snap_source *src, struct opt_flag *flag,
+		     double secs, int count, struct hist_ring *hist)
+{
+	struct free_model mod = {0};
+	struct rate_heap heap = {0};
+	struct rate_timer *top;
+	struct sigaction sa = {0};
+	struct timespec ts;
+	uint64_t now, frame, period;
+	int i;
+
+	sa.sa_handler = stop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	frame = (uint64_t)((secs ? secs : 1) * 1e9);
+	now = clock_ns(CLOCK_MONOTONIC);
+
+	/* Read every source once, the first frame is due now.
+	   Sources without a rate follow the frames. */
+	sample_all(src->ctx, &mod);
+	rate_push(&heap, now, frame, FREE_NR_SOURCES);
+	for (i = 0; i < FREE_NR_SOURCES; i++) {
+		period = flag->rates[i] ? (uint64_t)(1e9 / flag->rates[i]) : frame;
+		rate_push(&heap, now + period, period, i);
+	}
+
+	while (!stop_flag) {
+		top = &heap.timers[0];
+		ts.tv_sec = (time_t)(top->deadline / 1000000000);
+		ts.tv_nsec = (long)(top->deadline % 1000000000);
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+			if (dump_flag) {
+				dump_flag = 0;
+				hist_dump(hist, flag);
+			}
+			continue;
+		}
+
+		if (top->source == FREE_NR_SOURCES) {
+			/* Frame, with the ages as of the latest read */
+			if (flag->history)
+				hist_push(hist, &mod);
+			print_frame(&mod, flag);
+			if (flag->swap_devices_flag)
+				print_swap_frame(src->ctx, flag);
+			if (flag->page_census_flag)
+				print_census_frame(flag);
+			if (count && --count == 0)
+				break;
+			if (!flag->json_flag)
+				fputc('\n', stdout);
+			fflush(stdout);
+		} else {
+			sample_one(src->ctx, top->source, &mod);
+			if (flag->alerts.len)
+				alert_eval(&flag->alerts, &mod, snap_time(&mod));
+		}
+
+		/* Missed deadlines are skipped, not caught up */
+		now = clock_ns(CLOCK_MONOTONIC);
+		top->deadline += top->period;
+		if (top->deadline <= now)
+			top->deadline = now + top->period;
+		rate_sift_down(&heap, 0);
+	}
+
+	return (EXIT_SUCCESS);
+}
+
+/* Signal handler of --live, the terminal was resized */
+static void winch_handler(int sig)
+{
+	(void)sig;
+	winch_flag = 1;
+}
+
+/* Append to the output buffer of the live view */
+static void live_puts(struct live_view *lv, const char *s, size_t len)
+{
+	if (lv->len + len > sizeof(lv->out))
+		len = sizeof(lv->out) - lv->len;
+
+	memcpy(lv->out + lv->len, s, len);
+	lv->len += len;
+}
+
+/* Write the output buffer of the live view at once */
+static void live_flush(struct live_view *lv)
+{
+	size_t off;
+	ssize_t ret;
+
+	for (off = 0; off < lv->len; off += (size_t)ret) {
+		ret = write(STDOUT_FILENO, lv->out + off, lv->len - off);
+		if (ret == -1 && errno == EINTR)
+			ret = 0;
+		else if (ret == -1)
+			break;
+	}
+
+	lv->len = 0;
+}
+
+/* Move the cursor, and print "s" there */
+static void live_at(struct live_view *lv, int row, int col, const char *s)
+{
+	char buf[32];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "\033[%d;%dH", row, col);
+	live_puts(lv, buf, (size_t)len);
+	live_puts(lv, s, strlen(s));
+}
+
+/* Add a value to a sparkline history. The oldest value
+   is overwritten once the ring is full. */
+static void spark_push(struct spark *sp, double val)
+{
+	sp->val[sp->head] = val;
+	sp->head = (sp->head + 1) % LIVE_SPARK;
+	if (sp->len < LIVE_SPARK)
+		sp->len++;
+}
+
+/* Draw a sparkline of percentages, oldest value first.
+   It's always LIVE_SPARK columns wide. */
+static void spark_format(const struct spark *sp, char *buf, size_t len)
+{
+	static const char *const levels[] = {
+		"▁", "▂", "▃", "▄",
+		"▅", "▆", "▇", "█",
+	};
+	unsigned int i, idx;
+	size_t off;
+	int lvl;
+
+	off = 0;
+	for (i = sp->len; i < LIVE_SPARK && off + 1 < len; i++)
+		buf[off++] = ' ';
+
+	for (i = 0; i < sp->len; i++) {
+		idx = (sp->head + LIVE_SPARK - sp->len + i) % LIVE_SPARK;
+		lvl = (int)(sp->val[idx] * 8.0 / 100.0);
+		lvl = lvl < 0 ? 0 : (lvl > 7 ? 7 : lvl);
+		if (off + strlen(levels[lvl]) + 1 > len)
+			break;
+
+		memcpy(buf + off, levels[lvl], strlen(levels[lvl]));
+		off += strlen(levels[lvl]);
+	}
+
+	buf[off] = '\0';
+}
+
+/* Draw a bar graph of a percentage, e.g. [|||||     ] 50.0% */
+static void bar_format(double pct, char *buf, size_t len)
+{
+	char bar[LIVE_BAR + 1];
+	int fill;
+
+	fill = (int)(pct * LIVE_BAR / 100.0 + 0.5);
+	fill = fill < 0 ? 0 : (fill > LIVE_BAR ? LIVE_BAR : fill);
+	memset(bar, '|', (size_t)fill);
+	memset(bar + fill, ' ', (size_t)(LIVE_BAR - fill));
+	bar[LIVE_BAR] = '\0';
+
+	snprintf(buf, len, "[%s] %5.1f%%", bar, pct);
+}
+
+/* Format a value of the table, as --human or in kibibytes */
+static void live_value(char *buf, size_t len, uint64_t val,
+		       struct opt_flag *flag, int width)
+{
+	char *p;
+
+	if (flag->human_flag) {
+		p = pretty_format(val, flag->decimal_flag);
+		snprintf(buf, len, "%*s", width, p);
+		free(p);
+	} else if (val == (uint64_t)-1) {
+		snprintf(buf, len, "%*s", width, "-");
+	} else {
+		snprintf(buf, len, "%*lu", width, val / (flag->decimal_flag ? 1000 : 1024));
+	}
+}
+
+/* Percentage of "part" in "whole" */
+static double live_pct(uint64_t part, uint64_t whole)
+{
+	if (whole == 0 || whole == (uint64_t)-1 || part > whole)
+		return (0.0);
+
+	return ((double)part * 100.0 / (double)whole);
+}
+
+/* Build the cells of a frame of the live view */
+static void live_build(struct live_view *lv, const struct free_model *mod,
+		       struct opt_flag *flag, char cells[][LIVE_CELL_MAX])
+{
+	uint64_t now;
+	double rate;
+	time_t t;
+	char *p;
+
+	t = mod->ts_real ? (time_t)(mod->ts_real / 1000000000) : time(NULL);
+	strftime(cells[LC_CLOCK], LIVE_CELL_MAX, "%H:%M:%S", localtime(&t));
+
+	live_value(cells[LC_MEM_TOTAL], LIVE_CELL_MAX, mod->totalram, flag, 15);
+	live_value(cells[LC_MEM_FREE], LIVE_CELL_MAX, mod->freeram, flag, 11);
+	live_value(cells[LC_MEM_USED], LIVE_CELL_MAX, mod->usedram, flag, 11);
+	live_value(cells[LC_MEM_BUFFER], LIVE_CELL_MAX, mod->buffer, flag, 13);
+	live_value(cells[LC_MEM_SHARED], LIVE_CELL_MAX, mod->shared, flag, 12);
+	live_value(cells[LC_SWAP_TOTAL], LIVE_CELL_MAX, mod->totalswap, flag, 14);
+	live_value(cells[LC_SWAP_FREE], LIVE_CELL_MAX, mod->freeswap, flag, 11);
+	live_value(cells[LC_SWAP_USED], LIVE_CELL_MAX, mod->usedswap, flag, 11);
+
+	bar_format(live_pct(mod->usedram, mod->totalram),
+		   cells[LC_MEM_BAR], LIVE_CELL_MAX);
+	bar_format(live_pct(mod->usedswap, mod->totalswap),
+		   cells[LC_SWAP_BAR], LIVE_CELL_MAX);
+
+	spark_push(&lv->mem, live_pct(mod->usedram, mod->totalram));
+	spark_push(&lv->swap, live_pct(mod->usedswap, mod->totalswap));
+	spark_format(&lv->mem, cells[LC_MEM_SPARK], LIVE_CELL_MAX);
+	spark_format(&lv->swap, cells[LC_SWAP_SPARK], LIVE_CELL_MAX);
+
+	/* Change of the used RAM per second, between the stamps of
+	   the snapshots. The same snapshot twice (a daemon slower
+	   than the view) keeps the previous rate. */
+	now = snap_time(mod);
+	if (now == lv->last_ns)
+		return;
+
+	if (lv->last_ns && now > lv->last_ns && mod->usedram != (uint64_t)-1 &&
+	    lv->last_used != (uint64_t)-1) {
+		rate = ((double)mod->usedram - (double)lv->last_used) * 1e9 /
+			(double)(now - lv->last_ns);
+		p = pretty_format((uint64_t)fabs(rate), flag->decimal_flag);
+		snprintf(cells[LC_RATE], LIVE_CELL_MAX, "%c%s/s%-12s",
+			 rate < 0 ? '-' : '+', p, "");
+		free(p);
+	} else {
+		snprintf(cells[LC_RATE], LIVE_CELL_MAX, "%-20s", "-");
+	}
+
+	lv->last_used = mod->usedram;
+	lv->last_ns = now;
+}
+
+/* Draw the parts of the live view which never change */
+static void live_draw_static(struct live_view *lv, double secs)
+{
+	char buf[64];
+
+	live_puts(lv, "\033[H\033[2J", 7);
+	snprintf(buf, sizeof(buf), "free - every %gs", secs);
+	live_at(lv, 1, 1, buf);
+	live_at(lv, 3, 1,
+		"               total        free        used        buffer       shared");
+	live_at(lv, 4, 1, "Mem:");
+	live_at(lv, 5, 1, "Swap:");
+	live_at(lv, 7, 1, "Mem");
+	live_at(lv, 8, 1, "Swap");
+	live_at(lv, 10, 1, "Mem");
+	live_at(lv, 11, 1, "Swap");
+	live_at(lv, 13, 1, "Used:");
+}
+
+/* Redraw the cells which changed since the previous frame */
+static void live_draw(struct live_view *lv, char cells[][LIVE_CELL_MAX])
+{
+	int i;
+
+	for (i = 0; i < NR_LIVE_CELLS; i++) {
+		if (!lv->redraw && strcmp(cells[i], lv->cells[i]) == 0)
+			continue;
+
+		live_at(lv, live_layout[i].row, live_layout[i].col, cells[i]);
+		memcpy(lv->cells[i], cells[i], LIVE_CELL_MAX);
+	}
+
+	/* Park the cursor below the view */
+	live_at(lv, LIVE_ROWS, 1, "");
+	lv->redraw = 0;
+}
+
+/* Full-screen view, redrawn in place. Only the cells which
+   changed since the previous frame are written, so a frame
+   is a few bytes on a quiet system. */
+static int run_live(struct snap_source *src, struct opt_flag *flag,
+		    double secs, int count)
+{
+	char cells[NR_LIVE_CELLS][LIVE_CELL_MAX];
+	struct free_model mod;
+	struct live_view *lv;
+	struct sigaction sa = {0};
+
+	lv = calloc(1, sizeof(*lv));
+	if (lv == NULL) {
+		perror("calloc()");
+		abort();
+	}
+
+	sa.sa_handler = stop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = winch_handler;
+	sigaction(SIGWINCH, &sa, NULL);
+
+	if (secs == 0)
+		secs = 1;
+
+	/* Alternate screen, hidden cursor */
+	live_puts(lv, "\033[?1049h\033[?25l", 14);
+	winch_flag = 1;
+
+	while (!stop_flag) {
+		if (winch_flag) {
+			winch_flag = 0;
+			live_draw_static(lv, secs);
+			lv->redraw = 1;
+		}
+
+		take_snapshot(src, &mod);
+		if (flag->alerts.len)
+			alert_eval(&flag->alerts, &mod, snap_time(&mod));
+		live_build(lv, &mod, flag, cells);
+		live_draw(lv, cells);
+		live_flush(lv);
+
+		if (count && --count == 0)
+			break;
+
+		sleep_secs(secs);
+	}
+
+	live_puts(lv, "\033[?25h\033[?1049l", 14);
+	live_flush(lv);
+	free(lv);
+	return (run_status());
+}
+
+/* Hash a host name (FNV-1a) */
+static uint64_t host_hash(const char *name)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 1099511628211ULL;
+
+	return (h);
+}
+
+/* Find the entry of a host, and add it if it's missing.
+   Collisions are resolved by linear probing, and the table
+   doubles once it's 3/4 full. */
+static struct host_entry *host_lookup(struct host_table *tab, const char *name)
+{
+	struct host_entry *slots, *e;
+	size_t cap, i, j;
+	uint64_t h;
+
+	if ((tab->len + 1) * 4 > tab->cap * 3) {
+		cap = tab->cap ? tab->cap * 2 : 64;
+		slots = calloc(cap, sizeof(*slots));
+		if (slots == NULL) {
+			perror("calloc()");
+			abort();
+		}
+
+		for (i = 0; i < tab->cap; i++) {
+			if (tab->slots[i].name == NULL)
+				continue;
+
+			for (j = tab->slots[i].hash & (cap - 1); slots[j].name;
+			     j = (j + 1) & (cap - 1))
+				;
+			slots[j] = tab->slots[i];
+		}
+
+		free(tab->slots);
+		tab->slots = slots;
+		tab->cap = cap;
+	}
+
+	h = host_hash(name);
+	for (i = h & (tab->cap - 1); ; i = (i + 1) & (tab->cap - 1)) {
+		e = &tab->slots[i];
+		if (e->name == NULL)
+			break;
+		if (e->hash == h && strcmp(e->name, name) == 0)
+			return (e);
+	}
+
+	e->name = strdup(name);
+	if (e->name == NULL) {
+		perror("strdup()");
+		abort();
+	}
+	e->hash = h;
+	tab->len++;
+	return (e);
+}
+
+/* Find the closing quote of a JSON string, "p" is past the
+   opening one. Escaped quotes are skipped. */
+static const char *json_string_end(const char *p)
+{
+	for (; *p != '"'; p++) {
+		if (*p == '\0')
+			return (NULL);
+		if (*p == '\\' && p[1] != '\0')
+			p++;
+	}
+
+	return (p);
+}
+
+/* Copy the JSON string from "p" to "end" (its closing quote)
+   into "dst" of "size" bytes, unescaped and truncated if it
+   doesn't fit. \uXXXX is written as UTF-8, a NUL is dropped. */
+static void json_unescape(char *dst, size_t size, const char *p,
+			  const char *end)
+{
+	char utf[3], hex[5];
+	unsigned long cp;
+	size_t n, len;
+
+	for (len = 0; p < end; p++) {
+		utf[0] = *p;
+		n = 1;
+		if (*p == '\\') {
+			switch (*++p) {
+			case 'b': utf[0] = '\b'; break;
+			case 'f': utf[0] = '\f'; break;
+			case 'n': utf[0] = '\n'; break;
+			case 'r': utf[0] = '\r'; break;
+			case 't': utf[0] = '\t'; break;
+			case 'u':
+				if (end - p < 5)
+					return;
+				memcpy(hex, p + 1, 4);
+				hex[4] = '\0';
+				cp = strtoul(hex, NULL, 16);
+				p += 4;
+				if (cp == 0) {
+					n = 0;
+				} else if (cp < 0x80) {
+					utf[0] = (char)cp;
+				} else if (cp < 0x800) {
+					utf[0] = (char)(0xc0 | cp >> 6);
+					utf[1] = (char)(0x80 | (cp & 0x3f));
+					n = 2;
+				} else {
+					utf[0] = (char)(0xe0 | cp >> 12);
+					utf[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+					utf[2] = (char)(0x80 | (cp & 0x3f));
+					n = 3;
+				}
+				break;
+			default:        /* \" \\ and \/ */
+				utf[0] = *p;
+				break;
+			}
+		}
+
+		if (len + n >= size)
+			break;
+		memcpy(dst + len, utf, n);
+		len += n;
+	}
+
+	dst[len] = '\0';
+}
+
+/* Parse a JSON line written by --json or by the daemon. Only
+   flat objects of numbers (or null, for a missing value) are
+   understood, plus an optional "host" string. Returns the
+   number of fields found. */
+static int parse_json_line(const char *line, struct free_model *mod,
+			   char *host, size_t host_len)
+{
+	const char *p, *key, *end;
+	char *eptr;
+	size_t klen, i;
+	int found;
+
+	memset(mod, 0, sizeof(*mod));
+	found = 0;
+
+	for (p = line; (p = strchr(p, '"')) != NULL; ) {
+		key = ++p;
+		end = strchr(p, '"');
+		if (end == NULL)
+			break;
+
+		klen = (size_t)(end - key);
+		for (p = end + 1; *p == ' '; p++)
+			;
+		if (*p != ':')
+			continue;
+		for (p++; *p == ' '; p++)
+			;
+
+		/* String value, only "host" is kept */
+		if (*p == '"') {
+			end = json_string_end(p + 1);
+			if (end == NULL)
+				break;
+
+			if (klen == 4 && strncmp(key, "host", 4) == 0)
+				json_unescape(host, host_len + 1, p + 1, end);
+
+			p = end + 1;
+			continue;
+		}
+
+		for (i = 0; i < FREE_NR_FIELDS; i++) {
+			if (strlen(free_fields[i].name) == klen &&
+			    strncmp(free_fields[i].name, key, klen) == 0)
+				break;
+		}
+
+		if (i < FREE_NR_FIELDS && strncmp(p, "null", 4) == 0) {
+			/* A value the host couldn't read */
+			*(uint64_t *)((char *)mod + free_fields[i].off) = (uint64_t)-1;
+			found++;
+			p += 4;
+		} else if (i < FREE_NR_FIELDS) {
+			*(uint64_t *)((char *)mod + free_fields[i].off) =
+				strtoull(p, &eptr, 10);
+			if (eptr != p)
+				found++;
+			p = eptr;
+		}
+	}
+
+	return (found);
+}
+
+/* Open a source of --aggregate, a daemon socket or a file
+   (or a FIFO) of JSON lines. Returns -1 if it's unusable. */
+static int agg_open(struct agg_source *src, int evl)
+{
+	struct sockaddr_un sun = {0};
+	struct stat st;
+
+	if (stat(src->name, &st) == -1) {
+		perror(src->name);
+		return (-1);
+	}
+
+	src->is_socket = S_ISSOCK(st.st_mode);
+	if (src->is_socket) {
+		if (strlen(src->name) >= sizeof(sun.sun_path)) {
+			fputs(_("free: socket path is too long.\n"), stderr);
+			return (-1);
+		}
+
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, src->name);
+		src->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (src->fd != -1 &&
+		    connect(src->fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+			close(src->fd);
+			src->fd = -1;
+		}
+	} else {
+		src->fd = open(src->name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	}
+
+	if (src->fd == -1) {
+		perror(src->name);
+		return (-1);
+	}
+
+	/* epoll(7) refuses regular files, they are read on every
+	   tick instead. */
+	if (evl_add(evl, src->fd) == -1) {
+		if (errno != EPERM) {
+			perror(src->name);
+			close(src->fd);
+			src->fd = -1;
+			return (-1);
+		}
+		src->is_polled = 1;
+	}
+
+	return (0);
+}
+
+/* Read what's available on a source, and update the state of
+   the hosts it reports. Returns -1 once the source is done. */
+static int agg_read(struct agg_source *src, struct host_table *tab)
+{
+	struct free_model mod;
+	struct host_entry *e;
+	char host[AGG_HOST_MAX], *line, *nl;
+	ssize_t n;
+
+	for (;;) {
+		n = read(src->fd, src->buf + src->len, sizeof(src->buf) - src->len - 1);
+		if (n == 0)
+			return (src->is_polled ? 0 : -1);
+		if (n == -1)
+			return (errno == EAGAIN || errno == EINTR ? 0 : -1);
+
+		src->len += (size_t)n;
+		src->buf[src->len] = '\0';
+
+		for (line = src->buf; (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+			*nl = '\0';
+			snprintf(host, sizeof(host), "%s", src->name);
+			if (parse_json_line(line, &mod, host, sizeof(host) - 1) == 0)
+				continue;
+
+			e = host_lookup(tab, host);
+			e->mod = mod;
+		}
+
+		/* Keep the partial line for the next read, unless
+		   it's too long to ever fit. */
+		src->len -= (size_t)(line - src->buf);
+		if (src->len == sizeof(src->buf) - 1)
+			src->len = 0;
+		memmove(src->buf, line, src->len);
+	}
+}
+
+/* Used RAM of a host in percent */
+static double used_pct(const struct free_model *mod)
+{
+	if (mod->totalram == 0 || mod->totalram == (uint64_t)-1)
+		return (0.0);
+
+	return ((double)mod->usedram * 100.0 / (double)mod->totalram);
+}
+
+static int cmp_host_rank(const void *a, const void *b)
+{
+	double x = ((const struct host_rank *)a)->pct;
+	double y = ((const struct host_rank *)b)->pct;
+
+	return ((x < y) - (x > y));
+}
+
+/* Print a value of the fleet view, as --human or in kibibytes */
+static void print_agg_value(uint64_t val, struct opt_flag *flag, int width)
+{
+	char *p;
+
+	if (flag->human_flag) {
+		p = pretty_format(val, flag->decimal_flag);
+		fprintf(stdout, "%*s", width, p);
+		free(p);
+	} else if (val == (uint64_t)-1) {
+		fprintf(stdout, "%*s", width, "-");
+	} else {
+		fprintf(stdout, "%*lu", width, val / (flag->decimal_flag ? 1000 : 1024));
+	}
+}
+
+/* Print a member of the fleet object, null if it's missing
+   on a host (the sum saturates to the sentinel). */
+static void print_json_value(const char *name, uint64_t val)
+{
+	if (val == (uint64_t)-1)
+		fprintf(stdout, ",\"%s\":null", name);
+	else
+		fprintf(stdout, ",\"%s\":%lu", name, val);
+}
+
+/* Print the fleet totals, the used RAM percentiles and
+   the hosts using the largest part of their RAM. */
+static void print_fleet(struct host_table *tab, struct free_batch *batch,
+			struct opt_flag *flag, int top)
+{
+	struct free_model sum = {0};
+	struct free_reduce red;
+	struct host_rank *rank;
+	size_t i, n;
 
-	p = calloc(30, sizeof(char));
-	if (p == NULL) {
+	rank = calloc(tab->len + 1, sizeof(*rank));
+	if (rank == NULL) {
 		perror("calloc()");
-	        abort();
-		/* unreachable */
+		abort();
 	}
 
-	/* Decimal pow(1000, n) */
-	if (is_decimal) {
-		const char *suff[10] = {
-			"B", "K", "M", "G", "T",
-			"P", "E", "Z", "Y"
-		};
+	/* The batch grows with the table of hosts */
+	if (batch->cap < tab->cap) {
+		free_batch_free(batch);
+		if (free_batch_init(batch, tab->cap) == -1) {
+			perror("free_batch_init()");
+			abort();
+		}
+	}
 
-		base = log10((double)nsz) / log10(1000.0);
-		res = round(pow(1000.0, base - floor(base)) * 10.0) / 10.0;
-		idx = (int)floor(base);
+	free_batch_clear(batch);
+	for (i = n = 0; i < tab->cap; i++) {
+		if (tab->slots[i].name == NULL)
+			continue;
 
-		snprintf(p, (size_t)30, "%0.1lf%s", res, suff[idx]);
+		free_batch_push(batch, &tab->slots[i].mod);
+		rank[n].pct = used_pct(&tab->slots[i].mod);
+		rank[n].entry = &tab->slots[i];
+		n++;
+	}
 
-	/* Binary pow(1024, n) */
-	} else {
-	        const char *suff[10] = {
-			"B", "Ki", "Mi", "Gi", "Ti",
-			"Pi", "Ei", "Zi", "Yi"
-		};
+	/* Totals of the fleet, column by column */
+	for (i = 0; i < FREE_NR_FIELDS; i++) {
+		free_batch_reduce(batch, i, 0, n, &red);
+		*(uint64_t *)((char *)&sum + free_fields[i].off) = red.sum;
+	}
 
-		base = log10((double)nsz) / log10(1024.0);
-		res = round(pow(1024.0, base - floor(base)) * 10.0) / 10.0;
-		idx = (int)floor(base);
+	/* Highest usage first */
+	qsort(rank, n, sizeof(*rank), cmp_host_rank);
+	if ((size_t)top > n)
+		top = (int)n;
+
+	if (flag->json_flag) {
+		fprintf(stdout, "{\"hosts\":%zu", n);
+		print_json_value("totalram", sum.totalram);
+		print_json_value("freeram", sum.freeram);
+		print_json_value("usedram", sum.usedram);
+		print_json_value("totalswap", sum.totalswap);
+		print_json_value("freeswap", sum.freeswap);
+		print_json_value("usedswap", sum.usedswap);
+		fprintf(stdout, ",\"used_p50\":%.1f,\"used_p90\":%.1f,"
+			"\"used_p99\":%.1f,\"worst\":[",
+			rank[n / 2].pct, rank[n / 10].pct, rank[n / 100].pct);
+		for (i = 0; i < (size_t)top; i++) {
+			fputs(i ? ",{\"host\":" : "{\"host\":", stdout);
+			print_json_string(stdout, rank[i].entry->name);
+			fprintf(stdout, ",\"used_pct\":%.1f}", rank[i].pct);
+		}
+		fputs("]}\n", stdout);
+		free(rank);
+		return;
+	}
 
-		snprintf(p, (size_t)30, "%0.1lf%s", res, suff[idx]);
+	fprintf(stdout, "Hosts: %zu\n", n);
+	fprintf(stdout, "               total        free        used\n");
+	fputs("Mem: ", stdout);
+	print_agg_value(sum.totalram, flag, 15);
+	print_agg_value(sum.freeram, flag, 12);
+	print_agg_value(sum.usedram, flag, 12);
+	fputs("\nSwap:", stdout);
+	print_agg_value(sum.totalswap, flag, 15);
+	print_agg_value(sum.freeswap, flag, 12);
+	print_agg_value(sum.usedswap, flag, 12);
+	fputc('\n', stdout);
+
+	/* The list is sorted in descending order, so pN
+	   is found (100 - N)% from the start. */
+	fprintf(stdout, "Used: p50 %.1f%%, p90 %.1f%%, p99 %.1f%%\n",
+		rank[n / 2].pct, rank[n / 10].pct, rank[n / 100].pct);
+	for (i = 0; i < (size_t)top; i++) {
+		fprintf(stdout, "  %-30s %6.1f%% ", rank[i].entry->name, rank[i].pct);
+		print_agg_value(rank[i].entry->mod.usedram, flag, 12);
+		print_agg_value(rank[i].entry->mod.totalram, flag, 12);
+		fputc('\n', stdout);
 	}
 
-	return (p);
+	free(rank);
 }
 
-/* Get the size of total reachable memory by the operating system. */
-static void get_total_memory(struct free_model *mod)
+/* Ask a daemon for its latest snapshot, as a JSON line */
+static void agg_request(struct agg_source *src, struct agg_source **by_fd)
 {
-	uint64_t total = 0;
-	size_t sz;
-	int ret;
-
-	sz = sizeof(total);
-        ret = sysctlbyname("vm.stats.vm.v_page_count", &total, &sz, NULL, 0);
-	if (ret == -1) {
-	        mod->totalram = (uint64_t)-1;
+	if (src->fd == -1 || !src->is_socket || write(src->fd, "j", 1) == 1)
 		return;
-	}
 
-	/* Assign retrieved value to "totalram" */
-	mod->totalram = CONVERT_UNIT(total);
+	by_fd[src->fd] = NULL;
+	close(src->fd);
+	src->fd = -1;
 }
 
-/* Get the size of total free (unused) memory */
-static void get_free_memory(struct free_model *mod)
+/* Merge the snapshot streams of many hosts and print the
+   fleet view every "secs" seconds. Sources are daemon sockets,
+   asked for a JSON snapshot on every tick, or files and FIFOs
+   of JSON lines, e.g. written by "free --json -s 1". */
+static int run_aggregate(struct opt_flag *flag, char **names, int nr_names,
+			 double secs, int count, int top)
 {
-	uint64_t free = 0;
-	size_t sz;
-	int ret;
-
-	sz = sizeof(free);
-	ret = sysctlbyname("vm.stats.vm.v_free_count", &free, &sz, NULL, 0);
-	if (ret == -1) {
-		mod->freeram = (uint64_t)-1;
-		return;
+	struct evl_event evs[EVL_MAX];
+	struct host_table tab = {0};
+	struct free_batch batch = {0};
+	struct agg_source *srcs, **by_fd;
+	struct sigaction sa = {0};
+	int evl, i, n, maxfd, tick;
+
+	sa.sa_handler = stop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	evl = evl_open();
+	if (evl == -1 || evl_add_timer(evl, secs ? (long)(secs * 1000) : 1000) == -1) {
+		perror("evl_open()");
+		exit(EXIT_FAILURE);
 	}
 
-	mod->freeram = CONVERT_UNIT(free);
-}
+	srcs = calloc((size_t)nr_names, sizeof(*srcs));
+	if (srcs == NULL) {
+		perror("calloc()");
+		abort();
+	}
 
-/* Get the size of total used memory */
-static inline void get_used_memory(struct free_model *mod)
-{
-	get_total_memory(mod);
-	get_free_memory(mod);
+	maxfd = 0;
+	for (i = 0; i < nr_names; i++) {
+		srcs[i].name = names[i];
+		if (agg_open(&srcs[i], evl) == 0 && srcs[i].fd > maxfd)
+			maxfd = srcs[i].fd;
+	}
 
-	mod->usedram = mod->totalram - mod->freeram;
-}
+	/* File descriptors are small integers, so this is the
+	   cheapest way to find the source of an event. */
+	by_fd = calloc((size_t)maxfd + 1, sizeof(*by_fd));
+	if (by_fd == NULL) {
+		perror("calloc()");
+		abort();
+	}
 
-/* Get the size of buffer'd memory
-   Note: I'm not sure whether or not kernel buffer
-   also is included in "vm.stats.vm.v_active_count".
-   We need to look for some documentation on this. */
-static void get_buffer_memory(struct free_model *mod)
-{
-	uint64_t buffer = 0;
-	size_t sz;
-	int ret;
+	for (i = 0; i < nr_names; i++) {
+		if (srcs[i].fd == -1)
+			continue;
 
-	sz = sizeof(buffer);
-	ret = sysctlbyname("vm.stats.vm.v_active_count", &buffer, &sz, NULL, 0);
-	if (ret == -1) {
-		mod->buffer = (uint64_t)-1;
-		return;
+		by_fd[srcs[i].fd] = &srcs[i];
+		agg_request(&srcs[i], by_fd);
 	}
 
-	mod->buffer = CONVERT_UNIT(buffer);
-}
+	while (!stop_flag) {
+		n = evl_wait(evl, evs, EVL_MAX);
+		if (n == -1 && errno != EINTR) {
+			perror("evl_wait()");
+			break;
+		}
 
-/* Get the size of shared memory
-   Note: This isn't like the "shared" memory across
-   the system, it's rather a constant value that can
-   be tune'd.
+		tick = 0;
+		for (i = 0; i < n; i++) {
+			if (evs[i].is_timer) {
+				tick = 1;
+			} else if (evs[i].fd <= maxfd && by_fd[evs[i].fd] &&
+				   agg_read(by_fd[evs[i].fd], &tab) == -1) {
+				by_fd[evs[i].fd]->fd = -1;
+				by_fd[evs[i].fd] = NULL;
+				close(evs[i].fd);
+			}
+		}
 
-   e.g.
-   sysctl -w kern.ipc.shmmax=123456789 */
-static void get_shared_memory(struct free_model *mod, int is_decimal)
-{
-	uint64_t shared = 0;
-	size_t sz;
-	int ret;
+		if (!tick)
+			continue;
 
-	sz = sizeof(shared);
-	ret = sysctlbyname("kern.ipc.shmmax", &shared, &sz, NULL, 0);
-	if (ret == -1) {
-		mod->shared = (uint64_t)-1;
-		return;
-	}
+		for (i = 0; i < nr_names; i++) {
+			if (srcs[i].fd != -1 && srcs[i].is_polled)
+				agg_read(&srcs[i], &tab);
+		}
 
-	mod->shared = shared / (is_decimal ? 1000 : 1024);
-}
+		print_fleet(&tab, &batch, flag, top);
+		fflush(stdout);
+		if (count && --count == 0)
+			break;
 
-/* Get the size of the total and used swap space
-   Note: If you've multiple swap partitions, then
-   the calculated value of the total and used swap
-   size will be the sum of all swap partitions. */
-static void get_total_and_used_swap(struct free_model *mod)
-{
-	kvm_t *kvm;
-	struct kvm_swap kswap;
-	int ret;
+		if (!flag->json_flag)
+			fputc('\n', stdout);
 
-	kvm = kvm_open(NULL, "/dev/null", "/dev/null", O_RDONLY, "kvm_open");
-	if (kvm == NULL) {
-		perror("kvm_open()");
-		abort();
+		for (i = 0; i < nr_names; i++)
+			agg_request(&srcs[i], by_fd);
 	}
 
-	ret = kvm_getswapinfo(kvm, &kswap, 1, 0);
-	if (ret == -1) {
-		/* Ignore return value */
-		kvm_close(kvm);
-		perror("kvm_getswapinfo()");
-		abort();
+	for (i = 0; i < nr_names; i++) {
+		if (srcs[i].fd != -1)
+			close(srcs[i].fd);
 	}
 
-	mod->totalswap = CONVERT_UNIT(kswap.ksw_total);
-	mod->usedswap = CONVERT_UNIT(kswap.ksw_used);
+	for (i = 0; (size_t)i < tab.cap; i++)
+		free(tab.slots[i].name);
 
-	kvm_close(kvm);
+	free(tab.slots);
+	free_batch_free(&batch);
+	free(by_fd);
+	free(srcs);
+	close(evl);
+	return (EXIT_SUCCESS);
 }
 
-/* Get the size of free (unused) swap space */
-static inline void get_free_swap(struct free_model *mod)
+/* Print the entries of a page cache report */
+static void print_cache_entries(const struct free_cache_entry *ents, size_t n,
+				struct opt_flag *flag, int is_dir)
 {
-	get_total_and_used_swap(mod);
+	size_t i;
+
+	if (flag->json_flag) {
+		for (i = 0; i < n; i++) {
+			fputs(i ? ",{\"path\":" : "{\"path\":", stdout);
+			print_json_string(stdout, ents[i].path);
+			fprintf(stdout, ",\"cached\":%lu,\"size\":%lu",
+				ents[i].cached, ents[i].size);
+			if (is_dir)
+				fprintf(stdout, ",\"files\":%lu", ents[i].files);
+			fputc('}', stdout);
+		}
+		return;
+	}
+
+	if (n == 0)
+		return;
 
-	mod->freeswap = mod->totalswap - mod->usedswap;
+	fprintf(stdout, "\n%12s %12s", "cached", "size");
+	if (is_dir)
+		fprintf(stdout, " %9s", "files");
+	fprintf(stdout, "  %s\n", is_dir ? "Directory" : "File");
+	for (i = 0; i < n; i++) {
+		print_agg_value(ents[i].cached, flag, 12);
+		print_agg_value(ents[i].size, flag, 13);
+		if (is_dir)
+			fprintf(stdout, " %9lu", ents[i].files);
+		fprintf(stdout, "  %s\n", ents[i].path);
+	}
 }
 
-/* Print all collected information about RAM and swap.
-   These are, "totalram", "freeram", "usedram",
-   "buffer", "shared", "totalswap", "freeswap",
-   "usedswap", "total_ram_swap", "free_ram_swap",
-   and "used_ram_swap". */
-static void print_general_memory(
-	struct free_model *mod, int is_pretty, int is_decimal, int is_total)
+/* Walk the trees of --cache-of and show which directories
+   and files hold the most page cache. */
+static int run_cache_of(struct opt_flag *flag, const char *const *paths,
+			size_t n, int top)
 {
-	/* Hold the values temporarily */
-	char *totalram, *freeram, *usedram,
-		*buffer, *shared, *totalswap,
-		*freeswap, *usedswap, *total_ram_swap,
-		*free_ram_swap, *used_ram_swap;
-	uint64_t unit;
+	static const char *const methods[] = {
+		[FREE_CACHE_CACHESTAT] = "cachestat",
+		[FREE_CACHE_MINCORE] = "mincore",
+	};
+	struct free_cache_report rep;
 
-	fprintf(stdout,
-		"               total        free        used        buffer       shared\n");
-	if (is_pretty) {
-		/* RAM information */
-		totalram = pretty_format(mod->totalram, is_decimal);
-		freeram = pretty_format(mod->freeram, is_decimal);
-		usedram = pretty_format(mod->usedram, is_decimal);
-		buffer = pretty_format(mod->buffer, is_decimal);
-		shared = pretty_format(mod->shared, is_decimal);
-
-		/* Swap information */
-		totalswap = pretty_format(mod->totalswap, is_decimal);
-		freeswap = pretty_format(mod->freeswap, is_decimal);
-		usedswap = pretty_format(mod->usedswap, is_decimal);
+	if (free_cache_scan(paths, n, flag->threads, (size_t)top, &rep) == -1) {
+		perror("free_cache_scan()");
+		return (EXIT_FAILURE);
+	}
 
+	if (flag->json_flag) {
 		fprintf(stdout,
-			"Mem: %15s %11s %11s %13s %12s\n", totalram, freeram,
-			usedram, buffer, shared);
-		fprintf(stdout,
-			"Swap: %14s %11s %11s\n",
-		        totalswap, freeswap, usedswap);
-
-		if (is_total) {
-			total_ram_swap = pretty_format(mod->totalram + mod->totalswap, is_decimal);
-			free_ram_swap = pretty_format(mod->freeram + mod->freeswap, is_decimal);
-			used_ram_swap = pretty_format(mod->usedram + mod->usedswap, is_decimal);
-
-			fprintf(stdout,
-				"Total: %13s %11s %11s\n",
-				total_ram_swap, free_ram_swap, used_ram_swap);
-
-			/* Free allocated buffers */
-			free(total_ram_swap);
-			free(free_ram_swap);
-			free(used_ram_swap);
-		}
-
-		/* RAM */
-		free(totalram);
-		free(freeram);
-		free(usedram);
-		free(buffer);
-		free(shared);
-
-		/* Swap */
-		free(totalswap);
-		free(freeswap);
-		free(usedswap);
+			"{\"cached\":%lu,\"size\":%lu,\"files\":%lu,"
+			"\"dirs\":%lu,\"errors\":%lu,\"method\":\"%s\",\"top_dirs\":[",
+			rep.cached, rep.size, rep.files, rep.dirs, rep.errors,
+			methods[rep.method]);
+		print_cache_entries(rep.top_dirs, rep.nr_dirs, flag, 1);
+		fputs("],\"top_files\":[", stdout);
+		print_cache_entries(rep.top_files, rep.nr_files, flag, 0);
+		fputs("]}\n", stdout);
 	} else {
-		unit = is_decimal ? 1000 : 1024;
-		fprintf(stdout,
-			"Mem: %15lu %11lu %11lu %13lu %12lu\n",
-			mod->totalram / unit, mod->freeram / unit, mod->usedram / unit,
-			mod->buffer / unit, mod->shared / unit);
-		fprintf(stdout,
-			"Swap: %14lu %11lu %11lu\n", mod->totalswap / unit,
-			mod->freeswap / unit, mod->usedswap / unit);
-
-		if (is_total) {
-			fprintf(stdout,
-				"Total: %13lu %11lu %11lu\n",
-				(mod->totalram + mod->totalswap) / unit,
-				(mod->freeram + mod->freeswap) / unit,
-				(mod->usedram + mod->usedswap) / unit);
-		}
+		fputs(_("Cached:"), stdout);
+		print_agg_value(rep.cached, flag, 12);
+		fputs(_(" of"), stdout);
+		print_agg_value(rep.size, flag, 12);
+		fprintf(stdout, _(" in %lu files, %lu directories (%s)\n"),
+			rep.files, rep.dirs, methods[rep.method]);
+		if (rep.errors)
+			fprintf(stdout, _("%lu files or directories couldn't be read\n"),
+				rep.errors);
+
+		print_cache_entries(rep.top_dirs, rep.nr_dirs, flag, 1);
+		print_cache_entries(rep.top_files, rep.nr_files, flag, 0);
 	}
-}
 
-/* Print all collected information about RAM and swap,
-   and divide them with a divisor.
-   Printed values are, "totalram", "freeram", "usedram",
-   "buffer", "shared", "totalswap", "freeswap", and
-   "usedswap". */
-static void print_unit_memory(struct free_model *mod, uint64_t unit)
-{
-	fprintf(stdout,
-		"               total        free        used        buffer       shared\n");
-	fprintf(stdout,
-		"Mem: %15lu %11lu %11lu %13lu %12lu\n",
-	        mod->totalram / unit, mod->freeram / unit,
-		mod->usedram / unit, mod->buffer / unit,
-		mod->shared / unit);
-	fprintf(stdout,
-		"Swap: %14lu %11lu %11lu\n",
-		mod->totalswap / unit, mod->freeswap / unit,
-		mod->usedswap / unit);
+	free_cache_report_free(&rep);
+	return (EXIT_SUCCESS);
 }
 
-/* Collect information about RAM and swap and
-   pass them to the function print_unit_memory(...). */
-static void print_all_uinfo(struct free_model *mod, uint64_t unit)
+/* Directory of the cgroups, for the names given to --wss */
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+/* Estimate the working set of the process or cgroup of --wss,
+   the pages it accesses in the window of --window. */
+static int run_wss(struct opt_flag *flag)
 {
-	get_total_memory(mod);
-	get_free_memory(mod);
-	get_buffer_memory(mod);
-	get_used_memory(mod);
-	get_shared_memory(mod, 1);
+	const char *target = flag->wss_target;
+	struct free_wss ws;
+	char path[PATH_MAX];
+	uint64_t tracked, accessed;
+	pid_t pid;
+	int ret;
 
-	get_total_and_used_swap(mod);
-	get_free_swap(mod);
-	print_unit_memory(mod, unit);
-}
+	/* A PID is a number, anything else a cgroup */
+	pid = 0;
+	if (strspn(target, "0123456789") == strlen(target)) {
+		pid = (pid_t)xatoi(target);
+		if (pid <= 0) {
+			fputs(_("free: invalid PID: "), stderr);
+			fputs(target, stderr);
+			fputc('\n', stderr);
+			return (EXIT_FAILURE);
+		}
+	} else if (target[0] != '/') {
+		snprintf(path, sizeof(path), CGROUP_ROOT"/%s", target);
+		target = path;
+	}
 
-/* Collect information about RAM and swap and
-   pass them to the function print_general_memory(...). */
-static void print_all_ginfo(struct free_model *mod, int is_pretty, int is_decimal, int is_total)
-{
-	get_total_memory(mod);
-	get_free_memory(mod);
-	get_buffer_memory(mod);
-	get_used_memory(mod);
-	get_shared_memory(mod, is_decimal);
+	ret = free_wss(pid, target, flag->window, flag->threads, &ws);
+	if (ret == -1) {
+		perror("free_wss()");
+		return (EXIT_FAILURE);
+	}
+
+	tracked = ws.tracked * ws.pagesize;
+	accessed = ws.accessed * ws.pagesize;
+	if (flag->json_flag) {
+		fputs("{\"wss\":{\"target\":", stdout);
+		print_json_string(stdout, flag->wss_target);
+		fprintf(stdout, ",\"window_ns\":%lu,\"tracked\":%lu,\"accessed\":%lu}}\n",
+			flag->window, tracked, accessed);
+	} else {
+		fputs(_("Accessed:"), stdout);
+		print_agg_value(accessed, flag, 12);
+		fputs(_(" of"), stdout);
+		print_agg_value(tracked, flag, 12);
+		fprintf(stdout, _(" in %.3gs (%.1f%%)\n"), (double)flag->window / 1e9,
+			ws.tracked ? 100.0 * (double)ws.accessed / (double)ws.tracked : 0.0);
+	}
 
-	get_total_and_used_swap(mod);
-	get_free_swap(mod);
-	print_general_memory(mod, is_pretty, is_decimal, is_total);
+	return (EXIT_SUCCESS);
 }
 
 /* Show the usage. */
@@ -467,16 +2870,57 @@ static void usage(int status)
 	fputs(_("  --giga         show the output in gigabytes\n"), stdout);
 	fputs(_("  --tera         show the output in terabytes\n"), stdout);
 	fputs(_("  --peta         show the output in petabytes\n"), stdout);
+	fputs(_("  --exa          show the output in exabytes\n"), stdout);
+	fputs(_("  --zetta        show the output in zettabytes\n"), stdout);
+	fputs(_("  --yotta        show the output in yottabytes\n"), stdout);
 	fputs(_("  --kibi         show the output in kibibytes\n"), stdout);
 	fputs(_("  --mibi         show the output in mibibytes\n"), stdout);
 	fputs(_("  --gibi         show the output in gibibytes\n"), stdout);
 	fputs(_("  --tibi         show the output in tibibytes\n"), stdout);
 	fputs(_("  --pibi         show the output in pibibytes\n"), stdout);
+	fputs(_("  --exbi         show the output in exbibytes\n"), stdout);
+	fputs(_("  --zebi         show the output in zebibytes\n"), stdout);
+	fputs(_("  --yobi         show the output in yobibytes\n"), stdout);
 	fputs(_("  --decimal      use decimal format, e.g. pow(1000, n)\n"), stdout);
 	fputs(_("  -h, --human    show the output in human readable form, e.g. 2.3G\n"), stdout);
 	fputs(_("  -t, --total    show the sum of total, free, and used RAM and swap\n"), stdout);
-	fputs(_("  -s, --secs     continue printing in every N seconds\n"), stdout);
+	fputs(_("  -s, --secs     continue printing in every N seconds, e.g. 0.5\n"), stdout);
 	fputs(_("  -c, --count    continue printing N times and exit\n"), stdout);
+	fputs(_("  --json         show the output as JSON, one object per line\n"), stdout);
+	fputs(_("  --daemon       serve snapshots taken every N seconds (-s) on a socket\n"), stdout);
+	fputs(_("  --client       show the latest snapshot of a running daemon\n"), stdout);
+	fputs(_("  --socket PATH  socket of the daemon (default: "FREE_SOCKET_PATH")\n"), stdout);
+	fputs(_("  --shm NAME     also publish the daemon snapshots in shared memory\n"), stdout);
+	fputs(_("  --shm-read     show the latest snapshot published in shared memory\n"), stdout);
+	fputs(_("  --self-stats   show what each frame costs to free itself\n"), stdout);
+	fputs(_("  --fixture FILE replay the snapshots of FILE instead of the kernel\n"), stdout);
+	fputs(_("  --aggregate SOURCE...\n"), stdout);
+	fputs(_("                 show the totals of many hosts, read from daemon\n"), stdout);
+	fputs(_("                 sockets or files of JSON lines\n"), stdout);
+	fputs(_("  --top N        list the N hosts using the most RAM (default: 5)\n"), stdout);
+	fputs(_("  --live         full-screen view, redrawn in place every N seconds\n"), stdout);
+	fputs(_("  --history N    keep the last N snapshots, printed on SIGUSR1\n"), stdout);
+	fputs(_("  --alert RULE   report or run a hook when a rule, e.g. used>90%,\n"), stdout);
+	fputs(_("                 starts or stops holding (repeatable)\n"), stdout);
+	fputs(_("  --timestamp    show the time and sequence number of each table\n"), stdout);
+	fputs(_("  --consistent   read a snapshot again if its counters disagree\n"), stdout);
+	fputs(_("  --swap-devices also show the size and usage of every swap device\n"), stdout);
+	fputs(_("  --backpressure POLICY\n"), stdout);
+	fputs(_("                 sample on a separate thread (-s), and when output\n"), stdout);
+	fputs(_("                 lags: drop-oldest, drop-newest or block\n"), stdout);
+	fputs(_("  --rates SRC=HZ,...\n"), stdout);
+	fputs(_("                 read mem, active, shared and swap at their own rates\n"), stdout);
+	fputs(_("  --adaptive MIN:MAX\n"), stdout);
+	fputs(_("                 loop faster while the used RAM or swap moves, e.g. 100ms:10s\n"), stdout);
+	fputs(_("  --arcstats PATH\n"), stdout);
+	fputs(_("                 read the ZFS ARC from the kstat file PATH\n"), stdout);
+	fputs(_("  --cache-of PATH...\n"), stdout);
+	fputs(_("                 show the directories and files using the page cache\n"), stdout);
+	fputs(_("  --threads N    threads of --cache-of, --page-census and --wss\n"), stdout);
+	fputs(_("  --page-census  also show the classes of the physical pages\n"), stdout);
+	fputs(_("  --wss PID|CGROUP\n"), stdout);
+	fputs(_("                 estimate the working set of a process or cgroup\n"), stdout);
+	fputs(_("  --window DUR   window of --wss, e.g. 30s (default: 10s)\n"), stdout);
 	fputs(_("  --help         print this help section\n"), stdout);
 	fputs(_("  --version      print the current version\n"), stdout);
 	exit(status);
@@ -492,7 +2936,9 @@ static void show_version(void)
 
 int main(int argc, char **argv)
 {
-        int opt, secs, count;
+        int opt, count, top;
+	int64_t win;
+	double secs;
         struct option longopts[] = {
 		{ "bytes",    no_argument,       NULL, B_OPT },
 		{ "kilo",     no_argument,       NULL, K_OPT },
@@ -500,31 +2946,63 @@ int main(int argc, char **argv)
 		{ "giga",     no_argument,       NULL, G_OPT },
 		{ "tera",     no_argument,       NULL, T_OPT },
 		{ "peta",     no_argument,       NULL, P_OPT },
+		{ "exa",      no_argument,       NULL, E_OPT },
+		{ "zetta",    no_argument,       NULL, Z_OPT },
+		{ "yotta",    no_argument,       NULL, Y_OPT },
 	        { "kibi",     no_argument,       NULL, Ki_OPT },
 		{ "mibi",     no_argument,       NULL, Mi_OPT },
 		{ "gibi",     no_argument,       NULL, Gi_OPT },
 		{ "tibi",     no_argument,       NULL, Ti_OPT },
 		{ "pibi",     no_argument,       NULL, Pi_OPT },
+		{ "exbi",     no_argument,       NULL, Ei_OPT },
+		{ "zebi",     no_argument,       NULL, Zi_OPT },
+		{ "yobi",     no_argument,       NULL, Yi_OPT },
 	        { "human",    no_argument,       NULL, HUMAN_OPT },
 		{ "decimal",  no_argument,       NULL, DECIMAL_OPT },
 		{ "total",    no_argument,       NULL, TOTAL_OPT },
 		{ "secs",     required_argument, NULL, SECS_OPT },
 		{ "count",    required_argument, NULL, COUNT_OPT },
+		{ "json",     no_argument,       NULL, JSON_OPT },
+		{ "daemon",   no_argument,       NULL, DAEMON_OPT },
+		{ "socket",   required_argument, NULL, SOCKET_OPT },
+		{ "client",   no_argument,       NULL, CLIENT_OPT },
+		{ "shm",      required_argument, NULL, SHM_OPT },
+		{ "shm-read", no_argument,       NULL, SHM_READ_OPT },
+		{ "self-stats", no_argument,     NULL, SELF_OPT },
+		{ "fixture",  required_argument, NULL, FIXTURE_OPT },
+		{ "aggregate", no_argument,      NULL, AGGREGATE_OPT },
+		{ "top",      required_argument, NULL, TOP_OPT },
+		{ "live",     no_argument,       NULL, LIVE_OPT },
+		{ "history",  required_argument, NULL, HISTORY_OPT },
+		{ "alert",    required_argument, NULL, ALERT_OPT },
+		{ "timestamp", no_argument,      NULL, TIMESTAMP_OPT },
+		{ "consistent", no_argument,     NULL, CONSISTENT_OPT },
+		{ "swap-devices", no_argument,   NULL, SWAP_DEVICES_OPT },
+		{ "backpressure", required_argument, NULL, BACKPRESSURE_OPT },
+		{ "rates",    required_argument, NULL, RATES_OPT },
+		{ "adaptive", required_argument, NULL, ADAPTIVE_OPT },
+		{ "arcstats", required_argument, NULL, ARCSTATS_OPT },
+		{ "cache-of", no_argument,       NULL, CACHE_OF_OPT },
+		{ "threads",  required_argument, NULL, THREADS_OPT },
+		{ "page-census", no_argument,    NULL, PAGE_CENSUS_OPT },
+		{ "wss",      required_argument, NULL, WSS_OPT },
+		{ "window",   required_argument, NULL, WINDOW_OPT },
 		{ "help",     no_argument,       NULL, HELP_OPT },
 		{ "version",  no_argument,       NULL, VERSION_OPT },
 		{ NULL,       0,                 NULL, 0 },
 	};
 	struct opt_flag flag = {0};
 	struct free_model mod = {0};
+	struct snap_source src = { NULL, -1, NULL };
+	struct hist_ring ring = {0};
+	struct self_frame frame = {0};
+	struct sigaction sa = {0};
 
-	opt = secs = count = 0;
-
-	/* Enable localization */
-#ifdef ENABLE_LOCALE
-	setlocale(LC_ALL, "");
-	bindtextdomain("free", "/usr/share/locale/");
-	textdomain("free");
-#endif
+	opt = count = 0;
+	top = AGG_TOP;
+	secs = 0;
+	flag.socket_path = FREE_SOCKET_PATH;
+	flag.window = 10000000000;
 
 	if (argc >= 2 && argv[1][0] != '-')
 		usage(EXIT_FAILURE);
@@ -563,6 +3041,21 @@ int main(int argc, char **argv)
 			flag.power_flag = TO_P;
 		        break;
 
+		case E_OPT:
+			/* option: --exa */
+			flag.power_flag = TO_E;
+			break;
+
+		case Z_OPT:
+			/* option: --zetta */
+			flag.power_flag = TO_Z;
+			break;
+
+		case Y_OPT:
+			/* option: --yotta */
+			flag.power_flag = TO_Y;
+			break;
+
 		case Ki_OPT:
 			/* option: --kibi */
 		        flag.power_flag = TO_Ki;
@@ -588,6 +3081,21 @@ int main(int argc, char **argv)
 			flag.power_flag = TO_Pi;
 			break;
 
+		case Ei_OPT:
+			/* option: --exbi */
+			flag.power_flag = TO_Ei;
+			break;
+
+		case Zi_OPT:
+			/* option: --zebi */
+			flag.power_flag = TO_Zi;
+			break;
+
+		case Yi_OPT:
+			/* option: --yobi */
+			flag.power_flag = TO_Yi;
+			break;
+
 		case HUMAN_OPT:
 			/* option: --human */
 			flag.human_flag = 1;
@@ -609,11 +3117,11 @@ int main(int argc, char **argv)
 			if (optarg == NULL)
 				usage(EXIT_FAILURE);
 
-		        secs = xatoi(optarg);
-			if (secs < 1) {
+		        secs = xatof(optarg);
+			if (secs < 0.01) {
 				fputs(_("free: oops, seconds must not be "),
 				      stderr);
-				fputs(_("smaller than 1.\n"), stderr);
+				fputs(_("smaller than 0.01.\n"), stderr);
 				exit(EXIT_FAILURE);
 			}
 
@@ -647,6 +3155,189 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case JSON_OPT:
+			/* option: --json */
+			flag.json_flag = 1;
+			break;
+
+		case DAEMON_OPT:
+			/* option: --daemon */
+			flag.daemon_flag = 1;
+			break;
+
+		case SOCKET_OPT:
+			/* option: --socket */
+			if (optarg == NULL)
+				usage(EXIT_FAILURE);
+
+			flag.socket_path = optarg;
+			break;
+
+		case CLIENT_OPT:
+			/* option: --client */
+			flag.client_flag = 1;
+			break;
+
+		case SHM_OPT:
+			/* option: --shm */
+			if (optarg == NULL)
+				usage(EXIT_FAILURE);
+
+			flag.shm_name = optarg;
+			break;
+
+		case SHM_READ_OPT:
+			/* option: --shm-read */
+			flag.shm_read_flag = 1;
+			break;
+
+		case SELF_OPT:
+			/* option: --self-stats */
+			flag.self_flag = 1;
+			break;
+
+		case FIXTURE_OPT:
+			/* option: --fixture */
+			if (optarg == NULL)
+				usage(EXIT_FAILURE);
+
+			flag.fixture_path = optarg;
+			break;
+
+		case AGGREGATE_OPT:
+			/* option: --aggregate */
+			flag.aggregate_flag = 1;
+			break;
+
+		case TOP_OPT:
+			/* option: --top */
+			if (optarg == NULL)
+				usage(EXIT_FAILURE);
+
+			top = xatoi(optarg);
+			break;
+
+		case LIVE_OPT:
+			/* option: --live */
+			flag.live_flag = 1;
+			break;
+
+		case HISTORY_OPT:
+			/* option: --history */
+			if (optarg == NULL)
+				usage(EXIT_FAILURE);
+
+			flag.history = (size_t)xatoi(optarg);
+			if (flag.history < 1) {
+				fputs(_("free: oops, history must not be "),
+				      stderr);
+				fputs(_("smaller than 1.\n"), stderr);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case ALERT_OPT:
+			/* option: --alert */
+			if (optarg == NULL)
+				usage(EXIT_FAILURE);
+
+			alert_compile(&flag.alerts, optarg);
+			break;
+
+		case TIMESTAMP_OPT:
+			/* option: --timestamp */
+			flag.timestamp_flag = 1;
+			break;
+
+		case CONSISTENT_OPT:
+			/* option: --consistent */
+			flag.consistent_flag = 1;
+			break;
+
+		case SWAP_DEVICES_OPT:
+			/* option: --swap-devices */
+			flag.swap_devices_flag = 1;
+			break;
+
+		case BACKPRESSURE_OPT:
+			/* option: --backpressure */
+			if (optarg == NULL)
+				usage(EXIT_FAILURE);
+
+			flag.policy = parse_policy(optarg);
+			break;
+
+		case RATES_OPT:
+			/* option: --rates */
+			if (optarg == NULL)
+				usage(EXIT_FAILURE);
+
+			parse_rates(flag.rates, optarg);
+			flag.rates_flag = 1;
+			break;
+
+		case ADAPTIVE_OPT:
+			/* option: --adaptive */
+			if (optarg == NULL)
+				usage(EXIT_FAILURE);
+
+			parse_adaptive(&flag.adapt, optarg);
+			flag.adaptive_flag = 1;
+			break;
+
+		case ARCSTATS_OPT:
+			/* option: --arcstats */
+			if (optarg == NULL)
+				usage(EXIT_FAILURE);
+
+			flag.arcstats_path = optarg;
+			break;
+
+		case CACHE_OF_OPT:
+			/* option: --cache-of */
+			flag.cache_of_flag = 1;
+			break;
+
+		case THREADS_OPT:
+			/* option: --threads */
+			if (optarg == NULL)
+				usage(EXIT_FAILURE);
+
+			flag.threads = (unsigned int)xatoi(optarg);
+			if (flag.threads < 1 || flag.threads > FREE_CACHE_MAX_THREADS) {
+				fputs(_("free: threads must be from 1 to 64.\n"), stderr);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case PAGE_CENSUS_OPT:
+			/* option: --page-census */
+			flag.page_census_flag = 1;
+			break;
+
+		case WSS_OPT:
+			/* option: --wss */
+			if (optarg == NULL)
+				usage(EXIT_FAILURE);
+
+			flag.wss_target = optarg;
+			break;
+
+		case WINDOW_OPT:
+			/* option: --window */
+			if (optarg == NULL)
+				usage(EXIT_FAILURE);
+
+			win = parse_duration(optarg);
+			if (win <= 0) {
+				fputs(_("free: invalid window: "), stderr);
+				fputs(optarg, stderr);
+				fputs(_(" (e.g. 10s, 500ms, 5m)\n"), stderr);
+				exit(EXIT_FAILURE);
+			}
+			flag.window = (uint64_t)win;
+			break;
+
 		case HELP_OPT:
 			/* option: --help */
 			usage(EXIT_SUCCESS);
@@ -664,40 +3355,180 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* Sources of --aggregate are the remaining arguments */
+	if (flag.aggregate_flag) {
+		if (optind == argc)
+			usage(EXIT_FAILURE);
+
+		exit(run_aggregate(&flag, argv + optind, argc - optind,
+				   secs, count, top));
+	}
+
+	/* Paths of --cache-of are the remaining arguments */
+	if (flag.cache_of_flag) {
+		if (optind == argc)
+			usage(EXIT_FAILURE);
+
+		exit(run_cache_of(&flag, (const char *const *)argv + optind,
+				  (size_t)(argc - optind), top));
+	}
+
+	if (flag.wss_target) {
+		if (optind != argc)
+			usage(EXIT_FAILURE);
+
+		exit(run_wss(&flag));
+	}
+
 	if (optind != argc)
 		usage(EXIT_FAILURE);
 
-	/* Main loop, it will go on if flag.secs_flag or flag.count_flag
-	   is provided as an argument. */
-	do {
-		if (flag.power_flag) {
-			print_all_uinfo(&mod, flag.power_flag);
+	if (flag.daemon_flag + flag.client_flag + flag.shm_read_flag > 1) {
+		fputs(_("free: --daemon, --client and --shm-read can't be used together.\n"),
+		      stderr);
+		exit(EXIT_FAILURE);
+	}
 
-			if (!flag.count_flag && !flag.secs_flag)
-				break;
-		}
+	if (flag.arcstats_path && (flag.client_flag || flag.shm_read_flag ||
+				   flag.fixture_path)) {
+		fputs(_("free: --arcstats can't be used with --client, --shm-read or --fixture.\n"),
+		      stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	if (flag.swap_devices_flag && (flag.client_flag || flag.shm_read_flag)) {
+		fputs(_("free: --swap-devices can't be used with --client or --shm-read.\n"),
+		      stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	if (flag.page_census_flag && (flag.client_flag || flag.shm_read_flag ||
+				      flag.fixture_path || flag.daemon_flag ||
+				      flag.live_flag)) {
+		fputs(_("free: --page-census can't be used with --client, --shm-read, --fixture,\n"
+			"      --daemon or --live.\n"), stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	if (flag.rates_flag && (flag.daemon_flag || flag.client_flag ||
+				flag.shm_read_flag || flag.live_flag ||
+				flag.policy || flag.self_flag)) {
+		fputs(_("free: --rates can't be used with --daemon, --client, --shm-read,\n"
+			"      --live, --backpressure or --self-stats.\n"), stderr);
+		exit(EXIT_FAILURE);
+	}
 
-		if (flag.human_flag)
-			print_all_ginfo(&mod, 1, flag.decimal_flag, flag.total_flag);
+	if (flag.adaptive_flag && (flag.daemon_flag || flag.live_flag ||
+				   flag.policy || flag.rates_flag)) {
+		fputs(_("free: --adaptive can't be used with --daemon, --live, --backpressure\n"
+			"      or --rates.\n"), stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	/* A dump on SIGUSR1 would be drawn over the full-screen view */
+	if (flag.history && flag.live_flag) {
+		fputs(_("free: --history can't be used with --live.\n"), stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	/* The sampler thread only runs the loop of -s */
+	if (flag.policy && (!flag.secs_flag || flag.daemon_flag || flag.live_flag)) {
+		fputs(_("free: --backpressure needs -s, and can't be used with --daemon\n"
+			"      or --live.\n"), stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	/* The interval of -s is chosen by --adaptive */
+	if (flag.adaptive_flag)
+		flag.secs_flag = 1;
+
+	/* The collector context belongs to the sampler thread */
+	if (flag.policy && (flag.self_flag || flag.swap_devices_flag ||
+			    flag.page_census_flag)) {
+		fputs(_("free: --backpressure can't be used with --self-stats, --swap-devices\n"
+			"      or --page-census.\n"), stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!flag.client_flag && !flag.shm_read_flag)
+		src.ctx = collect_open(&flag);
+
+	if (flag.daemon_flag)
+		exit(run_daemon(src.ctx, &flag, secs));
+
+	if (flag.client_flag)
+		src.cfd = client_connect(flag.socket_path);
+
+	if (flag.shm_read_flag)
+		src.shm = shm_attach(flag.shm_name ? flag.shm_name : FREE_SHM_NAME);
 
-		/* Default output (with no arguments provided) */
-		if (!flag.power_flag && !flag.human_flag)
-			print_all_ginfo(&mod, 0, flag.decimal_flag, flag.total_flag);
+	if (flag.live_flag)
+		exit(run_live(&src, &flag, secs, count));
 
+	/* Stop cleanly on ^C, so the final statistics are printed */
+	if (flag.self_flag) {
+		sa.sa_handler = stop_handler;
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+	}
+
+	if (flag.history) {
+		hist_init(&ring, flag.history);
+		sa.sa_handler = dump_handler;
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+
+	if (flag.policy && flag.secs_flag)
+		exit(run_pipeline(&src, &flag, secs, count, &ring));
+
+	if (flag.rates_flag)
+		exit(run_rates(&src, &flag, secs, count, &ring));
+
+	/* Main loop, it will go on if flag.secs_flag or flag.count_flag
+	   is provided as an argument. */
+	do {
+		if (flag.self_flag)
+			self_begin(src.ctx, &frame);
+
+		take_snapshot(&src, &mod);
+		if (flag.history)
+			hist_push(&ring, &mod);
+		if (flag.alerts.len)
+			alert_eval(&flag.alerts, &mod, snap_time(&mod));
+
+		print_frame(&mod, &flag);
+		if (flag.swap_devices_flag)
+			print_swap_frame(src.ctx, &flag);
+		if (flag.page_census_flag)
+			print_census_frame(&flag);
+		if (flag.self_flag)
+			self_end(src.ctx, &frame, flag.json_flag);
+
+		/* JSON output is one object per line, frames
+		   aren't separated by a blank line. */
 		if (flag.secs_flag) {
-			sleep(secs);
-			fputc('\n', stdout);
+			fflush(stdout);
+			if (flag.adaptive_flag)
+				secs = (double)adapt_next(&flag.adapt, &mod) / 1e9;
+			watch_sleep(secs, &ring, &flag);
+			if (!flag.json_flag)
+				fputc('\n', stdout);
 		}
 
 		if (flag.count_flag) {
 			/* If still counting, decrease threshold
 			   and add a newline. */
-			if (--count > 0)
-				fputc('\n', stdout);
-			else
-				exit(EXIT_SUCCESS);
+			if (--count > 0) {
+				if (!flag.json_flag)
+					fputc('\n', stdout);
+			} else {
+				break;
+			}
 		}
-	} while (flag.secs_flag || flag.count_flag);
+	} while ((flag.secs_flag || flag.count_flag) && !stop_flag);
 
-	exit(EXIT_SUCCESS);
+	if (flag.self_flag)
+		self_exit(flag.json_flag);
+
+	exit(run_status());
 }
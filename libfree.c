@@ -0,0 +1,2575 @@
+/*
+ * libfree - Collect the amount of space for RAM and swap.
+ *
+ * BSD 2-Clause License
+ * 
+ * Copyright (c) 2023, rilysh <nightquick@proton.me>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/cdefs.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__FreeBSD__)
+#  include <sys/sysctl.h>
+#  include <vm/vm_param.h>
+#endif
+
+#if defined(__linux__)
+#  include <sys/syscall.h>
+#endif
+
+#include "libfree.h"
+
+/* Multiply with page size */
+#define CONVERT_UNIT(ctx, x) ((uint64_t)(x) * (ctx)->pagesize)
+
+/* sysctlbyname(3) looks the name up with a first sysctl(2)
+   and then reads the value with a second one. */
+#define SYSCTLBYNAME_CALLS    2
+
+/* Longest MIB of a counter, "vm.stats.vm.v_*" has 4 levels */
+#define COUNTER_MIB_MAX    8
+
+/* Statistics of the ZFS ARC on Linux, and the size of the
+   buffer they are read in. The file is about 6 KiB. */
+#define ARC_KSTAT_PATH    "/proc/spl/kstat/zfs/arcstats"
+#define ARC_BUF_SIZE      16384
+
+/* Levels of "vm.swap_info", the device index is appended */
+#define SWAP_MIB_LEN    2
+
+/* Longest name of kern.devname, as on FreeBSD */
+#ifndef SPECNAMELEN
+#  define SPECNAMELEN    255
+#endif
+
+/* Times a snapshot is read again (FREE_CTX_CONSISTENT)
+   before it's clamped */
+#define CONSISTENT_RETRIES    4
+
+/* Columns of a batch are aligned on a cache line, and
+   reduced 4 values (a 256-bit vector) at a time. */
+#define BATCH_ALIGN    64
+#define BATCH_LANES    4
+
+#if defined(__GNUC__) || defined(__clang__)
+#  define HAVE_VECTOR_EXT
+typedef uint64_t vec_u64 __attribute__((vector_size(BATCH_LANES * sizeof(uint64_t))));
+#endif
+
+/* Counters read by MIB */
+enum {
+	CTR_PAGE_COUNT,
+	CTR_FREE_COUNT,
+	CTR_ACTIVE_COUNT,
+	CTR_SHMMAX,
+	CTR_ARC_SIZE,
+	CTR_ARC_MIN,
+	CTR_ARC_TARGET,
+	NR_COUNTERS,
+};
+
+static const char *const counter_names[NR_COUNTERS] = {
+	"vm.stats.vm.v_page_count",
+	"vm.stats.vm.v_free_count",
+	"vm.stats.vm.v_active_count",
+	"kern.ipc.shmmax",
+	"kstat.zfs.misc.arcstats.size",
+	"kstat.zfs.misc.arcstats.c_min",
+	"kstat.zfs.misc.arcstats.c",
+};
+
+/* Collector context. "sample" is the backend, either the
+   kernel or a fixture file. */
+struct free_ctx {
+	/* Backend, the kernel or a fixture: a whole snapshot, and
+	   a single source stamped at "now" */
+	int (*sample)(struct free_ctx *ctx, struct free_model *mod);
+	int (*sample_source)(struct free_ctx *ctx, int src, uint64_t now,
+			     struct free_model *mod);
+	const struct free_sysops *ops;
+	uint64_t pagesize;
+	unsigned int flags;
+	struct free_stats stats;
+
+	/* MIBs of the counters, looked up on their first read
+	   (a length of 0 until then) */
+	int ctr_mib[NR_COUNTERS][COUNTER_MIB_MAX];
+	size_t ctr_miblen[NR_COUNTERS];
+
+	/* MIB of "vm.swap_info", looked up on the first read */
+	int swap_mib[SWAP_MIB_LEN + 1];
+	int has_swap_mib;
+
+	/* ZFS ARC, either a kstat file kept open (arc_fd) or the
+	   sysctls. no_arc is set when there's no ZFS. */
+	int arc_fd;
+	char *arc_buf;
+	int no_arc;
+
+	/* Fixture backend */
+	struct free_model *fixture;
+	size_t nr_fixture;
+	size_t next_fixture;
+};
+
+#if defined(__FreeBSD__)
+/* System calls of the C library */
+static const struct free_sysops default_sysops = {
+	sysctl,
+	sysctlnametomib,
+	sysctlbyname,
+};
+#else
+/* Other systems have no sysctl(3), only the sysops given to
+   free_ctx_open_sysops() can read the counters. */
+static int no_sysctl(const int *mib, unsigned int len, void *buf,
+		     size_t *sz, const void *newp, size_t newlen)
+{
+	(void)mib;
+	(void)len;
+	(void)buf;
+	(void)sz;
+	(void)newp;
+	(void)newlen;
+	errno = ENOTSUP;
+	return (-1);
+}
+
+static int no_sysctlnametomib(const char *name, int *mib, size_t *len)
+{
+	(void)name;
+	(void)mib;
+	(void)len;
+	errno = ENOTSUP;
+	return (-1);
+}
+
+static int no_sysctlbyname(const char *name, void *buf, size_t *sz,
+			   const void *newp, size_t newlen)
+{
+	(void)name;
+	(void)buf;
+	(void)sz;
+	(void)newp;
+	(void)newlen;
+	errno = ENOTSUP;
+	return (-1);
+}
+
+static const struct free_sysops default_sysops = {
+	no_sysctl,
+	no_sysctlnametomib,
+	no_sysctlbyname,
+};
+#endif
+
+/* Read a counter, and account for it. Its name is looked up
+   once, every later read is a single sysctl(2) on its MIB
+   instead of the two of sysctlbyname(3). */
+static int ctx_sysctl(struct free_ctx *ctx, int ctr, void *buf, size_t *sz)
+{
+	size_t len;
+	int ret;
+
+	if (ctx->ctr_miblen[ctr] == 0) {
+		len = COUNTER_MIB_MAX;
+		ctx->stats.syscalls++;
+		if (ctx->ops->sysctlnametomib(counter_names[ctr],
+					      ctx->ctr_mib[ctr], &len) == -1)
+			return (-1);
+		ctx->ctr_miblen[ctr] = len;
+	}
+
+	ret = ctx->ops->sysctl(ctx->ctr_mib[ctr],
+			       (unsigned int)ctx->ctr_miblen[ctr],
+			       buf, sz, NULL, 0);
+	ctx->stats.syscalls++;
+	if (ret == 0)
+		ctx->stats.bytes_read += *sz;
+
+	return (ret);
+}
+
+const struct free_field free_fields[FREE_NR_FIELDS] = {
+	{ "totalram",   offsetof(struct free_model, totalram) },
+	{ "freeram",    offsetof(struct free_model, freeram) },
+	{ "usedram",    offsetof(struct free_model, usedram) },
+	{ "buffer",     offsetof(struct free_model, buffer) },
+	{ "shared",     offsetof(struct free_model, shared) },
+	{ "totalswap",  offsetof(struct free_model, totalswap) },
+	{ "usedswap",   offsetof(struct free_model, usedswap) },
+	{ "freeswap",   offsetof(struct free_model, freeswap) },
+	{ "ts_real",    offsetof(struct free_model, ts_real) },
+	{ "ts_mono",    offsetof(struct free_model, ts_mono) },
+	{ "seq",        offsetof(struct free_model, seq) },
+	{ "age_mem",    offsetof(struct free_model, age_mem) },
+	{ "age_active", offsetof(struct free_model, age_active) },
+	{ "age_shared", offsetof(struct free_model, age_shared) },
+	{ "age_swap",   offsetof(struct free_model, age_swap) },
+	{ "arc_size",   offsetof(struct free_model, arc_size) },
+	{ "arc_min",    offsetof(struct free_model, arc_min) },
+	{ "arc_target", offsetof(struct free_model, arc_target) },
+	{ "avail",      offsetof(struct free_model, avail) },
+	{ "age_arc",    offsetof(struct free_model, age_arc) },
+};
+
+const char *const free_source_names[FREE_NR_SOURCES] = {
+	"mem", "active", "shared", "swap", "arc",
+};
+
+_Static_assert(sizeof(struct free_model) == FREE_NR_FIELDS * sizeof(uint64_t),
+	       "free_fields[] must list every field of struct free_model");
+
+/* Subtract without wrapping around, the counters are read
+   at slightly different times. */
+static inline uint64_t sat_sub(uint64_t a, uint64_t b)
+{
+	return (a > b ? a - b : 0);
+}
+
+/* Get the size of total reachable memory by the operating system. */
+static int get_total_memory(struct free_ctx *ctx, struct free_model *mod)
+{
+	uint64_t total = 0;
+	size_t sz;
+	int ret;
+
+	sz = sizeof(total);
+	ret = ctx_sysctl(ctx, CTR_PAGE_COUNT, &total, &sz);
+	if (ret == -1) {
+		mod->totalram = (uint64_t)-1;
+		return (-1);
+	}
+
+	/* Assign retrieved value to "totalram" */
+	mod->totalram = CONVERT_UNIT(ctx, total);
+	return (0);
+}
+
+/* Get the size of total free (unused) memory */
+static int get_free_memory(struct free_ctx *ctx, struct free_model *mod)
+{
+	uint64_t free = 0;
+	size_t sz;
+	int ret;
+
+	sz = sizeof(free);
+	ret = ctx_sysctl(ctx, CTR_FREE_COUNT, &free, &sz);
+	if (ret == -1) {
+		mod->freeram = (uint64_t)-1;
+		return (-1);
+	}
+
+	mod->freeram = CONVERT_UNIT(ctx, free);
+	return (0);
+}
+
+/* Get the size of total used memory */
+static inline int get_used_memory(struct free_ctx *ctx, struct free_model *mod)
+{
+	int ret;
+
+	ret = get_total_memory(ctx, mod);
+	ret |= get_free_memory(ctx, mod);
+
+	mod->usedram = ret ? (uint64_t)-1 : sat_sub(mod->totalram, mod->freeram);
+	return (ret);
+}
+
+/* Get the size of buffer'd memory
+   Note: I'm not sure whether or not kernel buffer
+   also is included in "vm.stats.vm.v_active_count".
+   We need to look for some documentation on this. */
+static int get_buffer_memory(struct free_ctx *ctx, struct free_model *mod)
+{
+	uint64_t buffer = 0;
+	size_t sz;
+	int ret;
+
+	sz = sizeof(buffer);
+	ret = ctx_sysctl(ctx, CTR_ACTIVE_COUNT, &buffer, &sz);
+	if (ret == -1) {
+		mod->buffer = (uint64_t)-1;
+		return (-1);
+	}
+
+	mod->buffer = CONVERT_UNIT(ctx, buffer);
+	return (0);
+}
+
+/* Get the size of shared memory
+   Note: This isn't like the "shared" memory across
+   the system, it's rather a constant value that can
+   be tune'd.
+
+   e.g.
+   sysctl -w kern.ipc.shmmax=123456789 */
+static int get_shared_memory(struct free_ctx *ctx, struct free_model *mod)
+{
+	uint64_t shared = 0;
+	size_t sz;
+	int ret;
+
+	sz = sizeof(shared);
+	ret = ctx_sysctl(ctx, CTR_SHMMAX, &shared, &sz);
+	if (ret == -1) {
+		mod->shared = (uint64_t)-1;
+		return (-1);
+	}
+
+	/* Already in bytes */
+	mod->shared = shared;
+	return (0);
+}
+
+/* Read the swap device at index "dev" from "vm.swap_info",
+   whose MIB is looked up once. Returns 1, 0 past the last
+   device, or -1 on failure. */
+static int read_swap_info(struct free_ctx *ctx, int dev, struct xswdev *xsw)
+{
+	size_t len, sz;
+
+	if (!ctx->has_swap_mib) {
+		len = SWAP_MIB_LEN;
+		ctx->stats.syscalls++;
+		if (ctx->ops->sysctlnametomib("vm.swap_info", ctx->swap_mib,
+					      &len) == -1)
+			return (-1);
+		if (len != SWAP_MIB_LEN) {
+			errno = EINVAL;
+			return (-1);
+		}
+		ctx->has_swap_mib = 1;
+	}
+
+	ctx->swap_mib[SWAP_MIB_LEN] = dev;
+	sz = sizeof(*xsw);
+	ctx->stats.syscalls++;
+	if (ctx->ops->sysctl(ctx->swap_mib, SWAP_MIB_LEN + 1, xsw, &sz,
+			     NULL, 0) == -1)
+		return (errno == ENOENT ? 0 : -1);
+
+	if (sz != sizeof(*xsw) || xsw->xsw_version != XSWDEV_VERSION) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	ctx->stats.bytes_read += sz;
+	return (1);
+}
+
+/* Get the size of the total and used swap space
+   Note: If you've multiple swap partitions, then
+   the calculated value of the total and used swap
+   size will be the sum of all swap partitions. */
+static int get_total_and_used_swap(struct free_ctx *ctx, struct free_model *mod)
+{
+	struct xswdev xsw;
+	uint64_t total, used;
+	int dev, ret;
+
+	total = used = 0;
+	for (dev = 0; (ret = read_swap_info(ctx, dev, &xsw)) == 1; dev++) {
+		total += (uint64_t)xsw.xsw_nblks;
+		used += (uint64_t)xsw.xsw_used;
+	}
+
+	if (ret == -1) {
+		mod->totalswap = (uint64_t)-1;
+		mod->usedswap = (uint64_t)-1;
+		return (-1);
+	}
+
+	mod->totalswap = CONVERT_UNIT(ctx, total);
+	mod->usedswap = CONVERT_UNIT(ctx, used);
+	return (0);
+}
+
+/* Get the size of free (unused) swap space */
+static inline int get_free_swap(struct free_ctx *ctx, struct free_model *mod)
+{
+	int ret;
+
+	ret = get_total_and_used_swap(ctx, mod);
+
+	mod->freeswap = ret ? (uint64_t)-1 : sat_sub(mod->totalswap, mod->usedswap);
+	return (ret);
+}
+
+/* Parse the kstat file of the ARC, lines of "name type data"
+   after two lines of header. */
+static int parse_arc_kstat(char *buf, struct free_model *mod)
+{
+	char *line, *next, name[32];
+	unsigned long long val;
+	int found;
+
+	found = 0;
+	for (line = buf; line != NULL; line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+
+		if (sscanf(line, "%31s %*u %llu", name, &val) != 2)
+			continue;
+
+		if (strcmp(name, "size") == 0) {
+			mod->arc_size = (uint64_t)val;
+			found |= 1;
+		} else if (strcmp(name, "c_min") == 0) {
+			mod->arc_min = (uint64_t)val;
+			found |= 2;
+		} else if (strcmp(name, "c") == 0) {
+			mod->arc_target = (uint64_t)val;
+			found |= 4;
+		}
+	}
+
+	return (found == 7 ? 0 : -1);
+}
+
+/* Read the ARC from its kstat file, with a single pread(2)
+   on the descriptor kept open. */
+static int read_arc_kstat(struct free_ctx *ctx, struct free_model *mod)
+{
+	ssize_t n;
+
+	n = pread(ctx->arc_fd, ctx->arc_buf, ARC_BUF_SIZE - 1, 0);
+	ctx->stats.syscalls++;
+	if (n == -1)
+		return (-1);
+
+	ctx->stats.bytes_read += (uint64_t)n;
+	ctx->arc_buf[n] = '\0';
+	if (parse_arc_kstat(ctx->arc_buf, mod) == -1) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* Read the ARC from the kstat.zfs.misc.arcstats sysctls. A
+   kernel without ZFS has none, the ARC is then 0. */
+static int read_arc_sysctl(struct free_ctx *ctx, struct free_model *mod)
+{
+	static const int ctrs[] = { CTR_ARC_SIZE, CTR_ARC_MIN, CTR_ARC_TARGET };
+	uint64_t *const vals[] = { &mod->arc_size, &mod->arc_min, &mod->arc_target };
+	size_t i, sz;
+
+	for (i = 0; i < 3; i++) {
+		*vals[i] = 0;
+		sz = sizeof(*vals[i]);
+		if (ctx_sysctl(ctx, ctrs[i], vals[i], &sz) == -1) {
+			if (errno != ENOENT || i != 0)
+				return (-1);
+			ctx->no_arc = 1;
+			return (0);
+		}
+	}
+
+	return (0);
+}
+
+/* Memory available without swapping: the free RAM and the
+   part of the ARC above its floor. */
+static inline void set_avail(struct free_model *mod)
+{
+	if (mod->freeram == (uint64_t)-1 || mod->arc_size == (uint64_t)-1) {
+		mod->avail = (uint64_t)-1;
+		return;
+	}
+
+	mod->avail = mod->freeram + sat_sub(mod->arc_size, mod->arc_min);
+	if (mod->totalram != (uint64_t)-1 && mod->avail > mod->totalram)
+		mod->avail = mod->totalram;
+}
+
+/* Get the size of the ZFS ARC and the available memory */
+static int get_arc(struct free_ctx *ctx, struct free_model *mod)
+{
+	int ret;
+
+	if (ctx->arc_fd != -1) {
+		ret = read_arc_kstat(ctx, mod);
+	} else if (!ctx->no_arc) {
+		ret = read_arc_sysctl(ctx, mod);
+	} else {
+		mod->arc_size = mod->arc_min = mod->arc_target = 0;
+		ret = 0;
+	}
+
+	if (ret == -1)
+		mod->arc_size = mod->arc_min = mod->arc_target = (uint64_t)-1;
+
+	set_avail(mod);
+	return (ret);
+}
+
+/* Read a clock in nanoseconds. clock_gettime(2) is served
+   by the vDSO (the shared page on FreeBSD), it isn't counted
+   as a system call. */
+static inline uint64_t clock_ns(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+/* Check that the counters of a snapshot agree with each other.
+   The free and active pages are read back to back, the others
+   hardly change. */
+static inline int is_consistent(const struct free_model *mod)
+{
+	return (mod->freeram <= mod->totalram &&
+		mod->buffer <= mod->totalram - mod->freeram &&
+		mod->usedswap <= mod->totalswap);
+}
+
+/* Clamp the counters of a snapshot so that they agree */
+static void clamp_model(struct free_model *mod)
+{
+	if (mod->freeram > mod->totalram)
+		mod->freeram = mod->totalram;
+	if (mod->buffer > mod->totalram - mod->freeram)
+		mod->buffer = mod->totalram - mod->freeram;
+	if (mod->usedswap > mod->totalswap)
+		mod->usedswap = mod->totalswap;
+
+	mod->usedram = mod->totalram - mod->freeram;
+	mod->freeswap = mod->totalswap - mod->usedswap;
+	set_avail(mod);
+}
+
+/* Readers of every source, in FREE_SRC_* order */
+static int (*const kernel_sources[FREE_NR_SOURCES])(struct free_ctx *,
+						     struct free_model *) = {
+	get_used_memory,
+	get_buffer_memory,
+	get_shared_memory,
+	get_free_swap,
+	get_arc,
+};
+
+/* Fields of every source, and their age */
+static const struct {
+	size_t first;
+	size_t nr;
+	size_t age;
+} source_fields[FREE_NR_SOURCES] = {
+	{ offsetof(struct free_model, totalram), 3, offsetof(struct free_model, age_mem) },
+	{ offsetof(struct free_model, buffer), 1, offsetof(struct free_model, age_active) },
+	{ offsetof(struct free_model, shared), 1, offsetof(struct free_model, age_shared) },
+	{ offsetof(struct free_model, totalswap), 3, offsetof(struct free_model, age_swap) },
+	{ offsetof(struct free_model, arc_size), 4, offsetof(struct free_model, age_arc) },
+};
+
+/* Kernel backend */
+static int kernel_sample(struct free_ctx *ctx, struct free_model *mod)
+{
+	int ret, tries;
+	size_t i;
+
+	mod->age_mem = mod->age_active = 0;
+	mod->age_shared = mod->age_swap = 0;
+	mod->age_arc = 0;
+
+	for (tries = 0;; tries++) {
+		mod->ts_real = clock_ns(CLOCK_REALTIME);
+		mod->ts_mono = clock_ns(CLOCK_MONOTONIC);
+
+		ret = 0;
+		for (i = 0; i < FREE_NR_SOURCES; i++)
+			ret |= kernel_sources[i](ctx, mod);
+
+		/* Missing values are reported as they are */
+		if (ret)
+			return (-1);
+
+		if (is_consistent(mod))
+			return (0);
+
+		if (!(ctx->flags & FREE_CTX_CONSISTENT) ||
+		    tries == CONSISTENT_RETRIES)
+			break;
+		ctx->stats.retries++;
+	}
+
+	clamp_model(mod);
+	ctx->stats.clamped++;
+	return (0);
+}
+
+/* Kernel backend, read a single source */
+static int kernel_sample_source(struct free_ctx *ctx, int src, uint64_t now,
+				struct free_model *mod)
+{
+	int ret;
+
+	ret = kernel_sources[src](ctx, mod);
+	mod->ts_real = clock_ns(CLOCK_REALTIME);
+	mod->ts_mono = now;
+	return (ret);
+}
+
+/* Whether a field of a source of a fixture snapshot is set to
+   the sentinel, which fails the sample like a failed read */
+static int fixture_missing(const struct free_model *mod, int src)
+{
+	const uint64_t *v;
+	size_t i;
+
+	v = (const uint64_t *)((const char *)mod + source_fields[src].first);
+	for (i = 0; i < source_fields[src].nr; i++) {
+		if (v[i] == (uint64_t)-1)
+			return (1);
+	}
+
+	return (0);
+}
+
+/* Fixture backend, replay the snapshots in a loop */
+static int fixture_sample(struct free_ctx *ctx, struct free_model *mod)
+{
+	int i, ret;
+
+	*mod = ctx->fixture[ctx->next_fixture++];
+	if (ctx->next_fixture == ctx->nr_fixture)
+		ctx->next_fixture = 0;
+
+	ret = 0;
+	for (i = 0; i < FREE_NR_SOURCES; i++) {
+		if (fixture_missing(mod, i))
+			ret = -1;
+	}
+
+	return (ret);
+}
+
+/* Fixture backend, take a single source of the next snapshot */
+static int fixture_sample_source(struct free_ctx *ctx, int src, uint64_t now,
+				 struct free_model *mod)
+{
+	struct free_model rec;
+
+	fixture_sample(ctx, &rec);
+	memcpy((char *)mod + source_fields[src].first,
+	       (char *)&rec + source_fields[src].first,
+	       source_fields[src].nr * sizeof(uint64_t));
+	mod->ts_real = rec.ts_real;
+	mod->ts_mono = rec.ts_mono ? rec.ts_mono : now;
+	return (fixture_missing(&rec, src) ? -1 : 0);
+}
+
+/* Parse a line of a fixture file, a list of "name=value"
+   pairs. Missing fields are set to 0. */
+static int parse_fixture(char *line, struct free_model *mod)
+{
+	char *tok, *val, *save, *eptr;
+	uint64_t num;
+	size_t i;
+
+	memset(mod, 0, sizeof(*mod));
+	for (tok = strtok_r(line, " \t\n", &save); tok != NULL;
+	     tok = strtok_r(NULL, " \t\n", &save)) {
+		val = strchr(tok, '=');
+		if (val == NULL)
+			return (-1);
+		*val++ = '\0';
+
+		for (i = 0; i < FREE_NR_FIELDS; i++) {
+			if (strcmp(tok, free_fields[i].name) == 0)
+				break;
+		}
+
+		/* "-1" is accepted, as the (uint64_t)-1 sentinel, but
+		   strtoull(3) would negate any other negative value */
+		if ((*val < '0' || *val > '9') && strcmp(val, "-1") != 0)
+			return (-1);
+
+		errno = 0;
+		num = strtoull(val, &eptr, 10);
+		if (i == FREE_NR_FIELDS || eptr == val || *eptr != '\0' || errno)
+			return (-1);
+
+		*(uint64_t *)((char *)mod + free_fields[i].off) = num;
+	}
+
+	return (0);
+}
+
+/* Load every snapshot of a fixture file. */
+static int load_fixture(struct free_ctx *ctx, FILE *fp)
+{
+	struct free_model *p;
+	char line[1024], *c;
+	size_t cap;
+
+	cap = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		/* Skip comments and blank lines */
+		c = strchr(line, '#');
+		if (c)
+			*c = '\0';
+		if (strspn(line, " \t\n") == strlen(line))
+			continue;
+
+		if (ctx->nr_fixture == cap) {
+			cap = cap ? cap * 2 : 16;
+			p = realloc(ctx->fixture, cap * sizeof(*p));
+			if (p == NULL)
+				return (-1);
+			ctx->fixture = p;
+		}
+
+		if (parse_fixture(line, &ctx->fixture[ctx->nr_fixture]) == -1) {
+			errno = EINVAL;
+			return (-1);
+		}
+		ctx->nr_fixture++;
+	}
+
+	if (ferror(fp) || ctx->nr_fixture == 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	return (0);
+}
+
+struct free_ctx *free_ctx_open(unsigned int flags)
+{
+	return (free_ctx_open_sysops(flags, NULL));
+}
+
+struct free_ctx *free_ctx_open_sysops(unsigned int flags,
+				      const struct free_sysops *ops)
+{
+	struct free_ctx *ctx;
+	long pagesize;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (pagesize == -1)
+		return (NULL);
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return (NULL);
+
+	ctx->sample = kernel_sample;
+	ctx->sample_source = kernel_sample_source;
+	ctx->ops = ops ? ops : &default_sysops;
+	ctx->arc_fd = -1;
+
+#if defined(__linux__)
+	/* Without ZFS, there's no ARC */
+	if (free_ctx_arcstats(ctx, ARC_KSTAT_PATH) == -1) {
+		if (errno != ENOENT) {
+			free_ctx_close(ctx);
+			return (NULL);
+		}
+		ctx->no_arc = 1;
+	}
+#endif
+	ctx->pagesize = (uint64_t)pagesize;
+	ctx->flags = flags;
+	return (ctx);
+}
+
+struct free_ctx *free_ctx_open_fixture(const char *path)
+{
+	struct free_ctx *ctx;
+	FILE *fp;
+	int ret;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return (NULL);
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		fclose(fp);
+		return (NULL);
+	}
+
+	ctx->arc_fd = -1;
+	ret = load_fixture(ctx, fp);
+	fclose(fp);
+	if (ret == -1) {
+		free_ctx_close(ctx);
+		return (NULL);
+	}
+
+	ctx->sample = fixture_sample;
+	ctx->sample_source = fixture_sample_source;
+	return (ctx);
+}
+
+int free_sample(struct free_ctx *ctx, struct free_model *mod)
+{
+	int ret;
+
+	ret = ctx->sample(ctx, mod);
+	mod->seq = ++ctx->stats.samples;
+	return (ret);
+}
+
+int free_sample_source(struct free_ctx *ctx, int src, struct free_model *mod)
+{
+	uint64_t now, elapsed;
+	size_t i;
+	int ret;
+
+	if (src < 0 || src >= FREE_NR_SOURCES) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	/* Age every source, then renew this one */
+	now = clock_ns(CLOCK_MONOTONIC);
+	elapsed = mod->ts_mono && now > mod->ts_mono ? now - mod->ts_mono : 0;
+	for (i = 0; i < FREE_NR_SOURCES; i++)
+		*(uint64_t *)((char *)mod + source_fields[i].age) += elapsed;
+
+	ret = ctx->sample_source(ctx, src, now, mod);
+
+	/* avail is derived from freeram and the ARC, it follows
+	   either one */
+	if (src == FREE_SRC_MEM || src == FREE_SRC_ARC)
+		set_avail(mod);
+
+	*(uint64_t *)((char *)mod + source_fields[src].age) = 0;
+	mod->seq = ++ctx->stats.samples;
+	return (ret);
+}
+
+int free_ctx_arcstats(struct free_ctx *ctx, const char *path)
+{
+	int fd;
+
+	if (ctx->sample != kernel_sample) {
+		errno = ENOTSUP;
+		return (-1);
+	}
+
+	if (ctx->arc_buf == NULL) {
+		ctx->arc_buf = malloc(ARC_BUF_SIZE);
+		if (ctx->arc_buf == NULL)
+			return (-1);
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return (-1);
+
+	if (ctx->arc_fd != -1)
+		close(ctx->arc_fd);
+	ctx->arc_fd = fd;
+	ctx->no_arc = 0;
+	return (0);
+}
+
+void free_ctx_stats(const struct free_ctx *ctx, struct free_stats *st)
+{
+	*st = ctx->stats;
+}
+
+void free_ctx_close(struct free_ctx *ctx)
+{
+	if (ctx == NULL)
+		return;
+
+	if (ctx->arc_fd != -1)
+		close(ctx->arc_fd);
+	free(ctx->arc_buf);
+	free(ctx->fixture);
+	free(ctx);
+}
+
+#if defined(__linux__)
+/* Parse /proc/swaps, sizes are in kibibytes:
+   Filename   Type   Size   Used   Priority */
+static int read_proc_swaps(struct free_ctx *ctx, struct free_swap_dev *devs,
+			   size_t max)
+{
+	char line[256], name[64];
+	unsigned long long total, used;
+	size_t n;
+	FILE *fp;
+	int prio;
+
+	fp = fopen("/proc/swaps", "r");
+	if (fp == NULL)
+		return (-1);
+
+	/* Skip the header */
+	if (fgets(line, sizeof(line), fp) == NULL) {
+		fclose(fp);
+		return (0);
+	}
+	ctx->stats.bytes_read += strlen(line);
+
+	for (n = 0; n < max && fgets(line, sizeof(line), fp); ) {
+		ctx->stats.bytes_read += strlen(line);
+		if (sscanf(line, "%63s %*s %llu %llu %d",
+			   name, &total, &used, &prio) != 4)
+			continue;
+
+		snprintf(devs[n].name, sizeof(devs[n].name), "%s", name);
+		devs[n].total = (uint64_t)total * 1024;
+		devs[n].used = (uint64_t)used * 1024;
+		devs[n].priority = prio;
+		n++;
+	}
+
+	/* open(2), read(2) and close(2), the file is small */
+	ctx->stats.syscalls += 3;
+	fclose(fp);
+	return ((int)n);
+}
+#endif
+
+/* Name a swap device like devname(3), through the sysops */
+static void swap_dev_name(struct free_ctx *ctx, dev_t dev, char *buf,
+			  size_t len)
+{
+	char name[SPECNAMELEN + 1];
+	size_t sz;
+
+	if (dev == NODEV) {
+		snprintf(buf, len, "[NFS swap]");
+		return;
+	}
+
+	sz = sizeof(name);
+	ctx->stats.syscalls += SYSCTLBYNAME_CALLS;
+	if (ctx->ops->sysctlbyname("kern.devname", name, &sz, &dev,
+				   sizeof(dev)) == -1) {
+		snprintf(buf, len, "#%jx", (uintmax_t)dev);
+		return;
+	}
+
+	ctx->stats.bytes_read += sz;
+	name[sizeof(name) - 1] = '\0';
+
+	/* The name is truncated to the size of the buffer */
+	snprintf(buf, len, "/dev/%.*s", len > 5 ? (int)(len - 6) : 0, name);
+}
+
+int free_swap_devices(struct free_ctx *ctx, struct free_swap_dev *devs,
+		      size_t max)
+{
+	struct xswdev xsw;
+	int n, ret;
+
+	if (ctx->sample != kernel_sample) {
+		errno = ENOTSUP;
+		return (-1);
+	}
+
+	if (max > FREE_SWAP_DEV_MAX)
+		max = FREE_SWAP_DEV_MAX;
+
+#if defined(__linux__)
+	/* Linux has no vm.swap_info, unless the sysops fake it */
+	if (ctx->ops == &default_sysops)
+		return (read_proc_swaps(ctx, devs, max));
+#endif
+
+	for (n = 0; (size_t)n < max &&
+		     (ret = read_swap_info(ctx, n, &xsw)) == 1; n++) {
+		swap_dev_name(ctx, xsw.xsw_dev, devs[n].name,
+			      sizeof(devs[n].name));
+		devs[n].total = CONVERT_UNIT(ctx, xsw.xsw_nblks);
+		devs[n].used = CONVERT_UNIT(ctx, xsw.xsw_used);
+		devs[n].priority = FREE_SWAP_NO_PRIORITY;
+	}
+
+	return ((size_t)n < max && ret == -1 ? -1 : n);
+}
+
+/* Directories waiting to be walked by a worker of
+   free_cache_scan(), a ring of paths. The owner takes the
+   newest one (depth first, the inodes are still cached), the
+   other workers steal the oldest one, usually the largest
+   subtree left. */
+struct cache_deque {
+	pthread_mutex_t lock;
+	char **items;
+	size_t head;
+	size_t len;
+	size_t cap;
+};
+
+/* Min-heap of the largest entries, the smallest one on top */
+struct cache_top {
+	struct free_cache_entry *ents;
+	size_t len;
+};
+
+struct cache_pool;
+
+/* Worker of free_cache_scan(), with its own counters, top
+   entries and mincore(2) vector, merged once all are done. */
+struct cache_worker {
+	struct cache_pool *pool;
+	struct cache_deque dq;
+	struct cache_top top_dirs;
+	struct cache_top top_files;
+	uint64_t cached;
+	uint64_t size;
+	uint64_t files;
+	uint64_t ndirs;
+	uint64_t errors;
+	unsigned char *vec;
+	size_t vec_len;
+	unsigned int id;
+	pthread_t thr;
+};
+
+struct cache_pool {
+	struct cache_worker *workers;
+	unsigned int nr_workers;
+	const char *const *roots;
+	size_t nr_roots;
+	_Atomic size_t next_root;   /* First root no worker took yet */
+	_Atomic size_t pending;     /* Roots and directories not walked yet */
+	_Atomic int use_mincore;    /* cachestat(2) isn't available */
+	size_t top;
+	uint64_t pagesize;
+};
+
+/* Largest mapping given to mincore(2) at once, so the
+   vector of a worker stays small. */
+#define CACHE_WINDOW      ((size_t)1 << 30)
+
+/* Initial room of a deque */
+#define CACHE_DEQUE_INIT  64
+
+#if defined(__linux__)
+#  ifndef __NR_cachestat
+#    define __NR_cachestat    451
+#  endif
+
+/* Arguments of cachestat(2), from <linux/mman.h> */
+struct cache_range {
+	uint64_t off;
+	uint64_t len;
+};
+
+struct cache_stat {
+	uint64_t nr_cache;
+	uint64_t nr_dirty;
+	uint64_t nr_writeback;
+	uint64_t nr_evicted;
+	uint64_t nr_recently_evicted;
+};
+#endif
+
+static int deque_push(struct cache_deque *dq, char *path)
+{
+	char **items;
+	size_t i, cap;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->len == dq->cap) {
+		cap = dq->cap ? dq->cap * 2 : CACHE_DEQUE_INIT;
+		items = malloc(cap * sizeof(*items));
+		if (items == NULL) {
+			pthread_mutex_unlock(&dq->lock);
+			return (-1);
+		}
+
+		for (i = 0; i < dq->len; i++)
+			items[i] = dq->items[(dq->head + i) % dq->cap];
+		free(dq->items);
+		dq->items = items;
+		dq->head = 0;
+		dq->cap = cap;
+	}
+
+	dq->items[(dq->head + dq->len++) % dq->cap] = path;
+	pthread_mutex_unlock(&dq->lock);
+	return (0);
+}
+
+/* Take the newest path, or the oldest one when stealing */
+static char *deque_take(struct cache_deque *dq, int is_steal)
+{
+	char *path;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->len == 0) {
+		path = NULL;
+	} else if (is_steal) {
+		path = dq->items[dq->head];
+		dq->head = (dq->head + 1) % dq->cap;
+		dq->len--;
+	} else {
+		path = dq->items[(dq->head + --dq->len) % dq->cap];
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return (path);
+}
+
+/* Restore the heap property below an entry */
+static void top_sift_down(struct cache_top *top, size_t i)
+{
+	struct free_cache_entry tmp;
+	size_t l, r, min;
+
+	for (;;) {
+		l = 2 * i + 1;
+		r = l + 1;
+		min = i;
+		if (l < top->len && top->ents[l].cached < top->ents[min].cached)
+			min = l;
+		if (r < top->len && top->ents[r].cached < top->ents[min].cached)
+			min = r;
+		if (min == i)
+			return;
+
+		tmp = top->ents[i];
+		top->ents[i] = top->ents[min];
+		top->ents[min] = tmp;
+		i = min;
+	}
+}
+
+/* Join a directory and a name, or copy the directory
+   without a name */
+static char *cache_join(const char *dir, const char *name)
+{
+	size_t len;
+	char *path;
+
+	if (name == NULL)
+		return (strdup(dir));
+
+	len = strlen(dir);
+	path = malloc(len + strlen(name) + 2);
+	if (path != NULL)
+		sprintf(path, "%s%s%s", dir,
+			len && dir[len - 1] == '/' ? "" : "/", name);
+	return (path);
+}
+
+/* Keep an entry if it's among the largest. The path is
+   "dir/name" (or dir without a name), only built when kept. */
+static int top_offer(struct cache_top *top, size_t cap, const char *dir,
+		     const char *name, uint64_t cached, uint64_t size,
+		     uint64_t files)
+{
+	struct free_cache_entry *ent, tmp;
+	size_t i;
+	char *path;
+
+	if (cap == 0 || (top->len == cap && cached <= top->ents[0].cached))
+		return (0);
+
+	path = cache_join(dir, name);
+	if (path == NULL)
+		return (-1);
+
+	/* Replace the smallest one, or append and sift up */
+	if (top->len == cap) {
+		ent = &top->ents[0];
+		free(ent->path);
+		ent->path = path;
+		ent->cached = cached;
+		ent->size = size;
+		ent->files = files;
+		top_sift_down(top, 0);
+		return (0);
+	}
+
+	i = top->len++;
+	top->ents[i].path = path;
+	top->ents[i].cached = cached;
+	top->ents[i].size = size;
+	top->ents[i].files = files;
+	while (i > 0 && top->ents[(i - 1) / 2].cached > top->ents[i].cached) {
+		tmp = top->ents[i];
+		top->ents[i] = top->ents[(i - 1) / 2];
+		top->ents[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+
+	return (0);
+}
+
+/* Count the cached pages of a file with mincore(2), a
+   window of the file mapped at a time. */
+static int cache_mincore(struct cache_worker *w, int fd, uint64_t size,
+			 uint64_t *cached)
+{
+	uint64_t ps, off, pages, i;
+	unsigned char *vec;
+	size_t len;
+	void *addr;
+	int ret;
+
+	ps = w->pool->pagesize;
+	*cached = 0;
+	for (off = 0; off < size; off += len) {
+		len = size - off < CACHE_WINDOW ? (size_t)(size - off) : CACHE_WINDOW;
+		pages = (len + ps - 1) / ps;
+		if (pages > w->vec_len) {
+			vec = realloc(w->vec, (size_t)pages);
+			if (vec == NULL)
+				return (-1);
+			w->vec = vec;
+			w->vec_len = (size_t)pages;
+		}
+
+		addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, (off_t)off);
+		if (addr == MAP_FAILED)
+			return (-1);
+
+		ret = mincore(addr, len, (void *)w->vec);
+		munmap(addr, len);
+		if (ret == -1)
+			return (-1);
+
+		for (i = 0; i < pages; i++)
+			*cached += w->vec[i] & 1;
+	}
+
+	*cached *= ps;
+	return (0);
+}
+
+/* Get the size of a file and its bytes in the page cache */
+static int cache_residency(struct cache_worker *w, int fd, uint64_t *size,
+			   uint64_t *cached)
+{
+	struct stat st;
+#if defined(__linux__)
+	struct cache_range range = { 0, 0 };
+	struct cache_stat cs;
+#endif
+
+	if (fstat(fd, &st) == -1)
+		return (-1);
+
+	*size = (uint64_t)st.st_size;
+	*cached = 0;
+	if (st.st_size == 0)
+		return (0);
+
+#if defined(__linux__)
+	/* A single call for the whole file, without a mapping */
+	if (!atomic_load_explicit(&w->pool->use_mincore, memory_order_relaxed)) {
+		if (syscall(__NR_cachestat, fd, &range, &cs, 0) == 0) {
+			*cached = cs.nr_cache * w->pool->pagesize;
+			return (0);
+		}
+		if (errno == ENOSYS)
+			atomic_store(&w->pool->use_mincore, 1);
+	}
+#endif
+
+	return (cache_mincore(w, fd, *size, cached));
+}
+
+/* Account for a regular file, opened relative to its
+   directory (name), or a root given as a file (dir). A root
+   is followed if it's a symlink, a file found by the walk
+   isn't. */
+static void cache_file(struct cache_worker *w, int dirfd, const char *dir,
+		       const char *name, uint64_t *dcached, uint64_t *dsize)
+{
+	uint64_t size, cached;
+	int fd, ret;
+
+	fd = openat(dirfd, name ? name : dir, O_RDONLY | O_NONBLOCK |
+		    O_CLOEXEC | (name ? O_NOFOLLOW : 0));
+	if (fd == -1) {
+		w->errors++;
+		return;
+	}
+
+	ret = cache_residency(w, fd, &size, &cached);
+	close(fd);
+	if (ret == -1) {
+		w->errors++;
+		return;
+	}
+
+	w->cached += cached;
+	w->size += size;
+	w->files++;
+	*dcached += cached;
+	*dsize += size;
+	if (top_offer(&w->top_files, w->pool->top, dir, name, cached, size, 1) == -1)
+		w->errors++;
+}
+
+/* Walk a directory: account for its files and hand its
+   subdirectories to the pool. A root is followed if it's a
+   symlink, and accounted for as a file if it isn't a
+   directory. */
+static void cache_dir(struct cache_worker *w, const char *path, int is_root)
+{
+	uint64_t dcached, dsize, dfiles;
+	struct dirent *de;
+	struct stat st;
+	char *child;
+	DIR *dir;
+	int fd, type;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC |
+		  (is_root ? 0 : O_NOFOLLOW));
+	if (fd == -1 && errno == ENOTDIR && is_root) {
+		dcached = dsize = 0;
+		cache_file(w, AT_FDCWD, path, NULL, &dcached, &dsize);
+		return;
+	}
+
+	if (fd == -1 || (dir = fdopendir(fd)) == NULL) {
+		if (fd != -1)
+			close(fd);
+		w->errors++;
+		return;
+	}
+
+	dcached = dsize = dfiles = 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+		    (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+			continue;
+
+		/* Some file systems don't fill d_type */
+		type = de->d_type;
+		if (type == DT_UNKNOWN) {
+			if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+				w->errors++;
+				continue;
+			}
+			type = S_ISDIR(st.st_mode) ? DT_DIR :
+				S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		if (type == DT_DIR) {
+			child = cache_join(path, de->d_name);
+			if (child == NULL) {
+				w->errors++;
+				continue;
+			}
+
+			atomic_fetch_add(&w->pool->pending, 1);
+			if (deque_push(&w->dq, child) == -1) {
+				atomic_fetch_sub(&w->pool->pending, 1);
+				free(child);
+				w->errors++;
+			}
+		} else if (type == DT_REG) {
+			dfiles++;
+			cache_file(w, fd, path, de->d_name, &dcached, &dsize);
+		}
+	}
+
+	closedir(dir);
+	w->ndirs++;
+	if (top_offer(&w->top_dirs, w->pool->top, path, NULL, dcached, dsize,
+		      dfiles) == -1)
+		w->errors++;
+}
+
+static void *cache_worker_main(void *arg)
+{
+	struct cache_worker *w = arg;
+	struct cache_pool *pool = w->pool;
+	unsigned int i;
+	size_t root;
+	char *path;
+
+	for (;;) {
+		/* The roots first, spread over the workers */
+		if (atomic_load(&pool->next_root) < pool->nr_roots &&
+		    (root = atomic_fetch_add(&pool->next_root, 1)) <
+		    pool->nr_roots) {
+			cache_dir(w, pool->roots[root], 1);
+			atomic_fetch_sub(&pool->pending, 1);
+			continue;
+		}
+
+		path = deque_take(&w->dq, 0);
+		for (i = 1; path == NULL && i < pool->nr_workers; i++)
+			path = deque_take(&pool->workers[(w->id + i) %
+							 pool->nr_workers].dq, 1);
+
+		/* Nothing to steal: done once no directory is left
+		   anywhere, else one will be pushed soon. */
+		if (path == NULL) {
+			if (atomic_load(&pool->pending) == 0)
+				break;
+			sched_yield();
+			continue;
+		}
+
+		cache_dir(w, path, 0);
+		free(path);
+		atomic_fetch_sub(&pool->pending, 1);
+	}
+
+	return (NULL);
+}
+
+static int cmp_cache_entry(const void *a, const void *b)
+{
+	const struct free_cache_entry *x = a, *y = b;
+
+	return ((x->cached < y->cached) - (x->cached > y->cached));
+}
+
+/* Merge the top entries of every worker, largest first */
+static int cache_merge(struct cache_pool *pool, size_t off,
+		       struct free_cache_entry **out, size_t *nr)
+{
+	struct free_cache_entry *ents;
+	struct cache_top *top;
+	size_t i, j, n;
+
+	for (i = n = 0; i < pool->nr_workers; i++)
+		n += ((struct cache_top *)((char *)&pool->workers[i] + off))->len;
+
+	ents = calloc(n + 1, sizeof(*ents));
+	if (ents == NULL)
+		return (-1);
+
+	for (i = n = 0; i < pool->nr_workers; i++) {
+		top = (struct cache_top *)((char *)&pool->workers[i] + off);
+		for (j = 0; j < top->len; j++)
+			ents[n++] = top->ents[j];
+		top->len = 0;
+	}
+
+	qsort(ents, n, sizeof(*ents), cmp_cache_entry);
+	for (i = pool->top; i < n; i++)
+		free(ents[i].path);
+
+	*out = ents;
+	*nr = n < pool->top ? n : pool->top;
+	return (0);
+}
+
+int free_cache_scan(const char *const *paths, size_t n, unsigned int threads,
+		    size_t top, struct free_cache_report *rep)
+{
+	struct cache_pool pool = {0};
+	struct cache_worker *w;
+	unsigned int i, started;
+	long val;
+	char *path;
+	int ret, err;
+
+	memset(rep, 0, sizeof(*rep));
+	if (threads == 0) {
+		val = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = val > 0 ? (unsigned int)val : 1;
+	}
+	if (threads > FREE_CACHE_MAX_THREADS)
+		threads = FREE_CACHE_MAX_THREADS;
+
+	val = sysconf(_SC_PAGESIZE);
+	if (val == -1)
+		return (-1);
+
+	pool.pagesize = (uint64_t)val;
+	pool.top = top;
+	pool.roots = paths;
+	pool.nr_roots = n;
+	pool.pending = n;
+	pool.nr_workers = threads;
+	pool.workers = calloc(threads, sizeof(*pool.workers));
+	if (pool.workers == NULL)
+		return (-1);
+
+	ret = 0;
+	for (i = 0; i < threads; i++) {
+		w = &pool.workers[i];
+		w->pool = &pool;
+		w->id = i;
+		pthread_mutex_init(&w->dq.lock, NULL);
+		w->top_dirs.ents = calloc(top + 1, sizeof(*w->top_dirs.ents));
+		w->top_files.ents = calloc(top + 1, sizeof(*w->top_files.ents));
+		if (w->top_dirs.ents == NULL || w->top_files.ents == NULL)
+			ret = -1;
+	}
+
+	for (started = 0; ret == 0 && started < threads; started++) {
+		err = pthread_create(&pool.workers[started].thr, NULL,
+				     cache_worker_main, &pool.workers[started]);
+		if (err != 0) {
+			errno = err;
+			ret = -1;
+			break;
+		}
+	}
+
+	/* The workers steal from every deque, so the pool drains
+	   even if some of them couldn't be started. */
+	if (started > 0)
+		ret = 0;
+	for (i = 0; i < started; i++)
+		pthread_join(pool.workers[i].thr, NULL);
+
+	for (i = 0; i < threads; i++) {
+		w = &pool.workers[i];
+		rep->cached += w->cached;
+		rep->size += w->size;
+		rep->files += w->files;
+		rep->dirs += w->ndirs;
+		rep->errors += w->errors;
+	}
+#if defined(__linux__)
+	rep->method = pool.use_mincore ? FREE_CACHE_MINCORE : FREE_CACHE_CACHESTAT;
+#else
+	rep->method = FREE_CACHE_MINCORE;
+#endif
+
+	if (ret == 0 &&
+	    (cache_merge(&pool, offsetof(struct cache_worker, top_dirs),
+			 &rep->top_dirs, &rep->nr_dirs) == -1 ||
+	     cache_merge(&pool, offsetof(struct cache_worker, top_files),
+			 &rep->top_files, &rep->nr_files) == -1))
+		ret = -1;
+
+	for (i = 0; i < threads; i++) {
+		w = &pool.workers[i];
+		while ((path = deque_take(&w->dq, 0)) != NULL)
+			free(path);
+		while (w->top_dirs.len)
+			free(w->top_dirs.ents[--w->top_dirs.len].path);
+		while (w->top_files.len)
+			free(w->top_files.ents[--w->top_files.len].path);
+		free(w->top_dirs.ents);
+		free(w->top_files.ents);
+		free(w->dq.items);
+		free(w->vec);
+		pthread_mutex_destroy(&w->dq.lock);
+	}
+	free(pool.workers);
+
+	if (ret == -1)
+		free_cache_report_free(rep);
+	return (ret);
+}
+
+void free_cache_report_free(struct free_cache_report *rep)
+{
+	size_t i;
+
+	for (i = 0; i < rep->nr_dirs; i++)
+		free(rep->top_dirs[i].path);
+	for (i = 0; i < rep->nr_files; i++)
+		free(rep->top_files[i].path);
+	free(rep->top_dirs);
+	free(rep->top_files);
+	rep->top_dirs = rep->top_files = NULL;
+	rep->nr_dirs = rep->nr_files = 0;
+}
+
+int free_batch_init(struct free_batch *batch, size_t cap)
+{
+	size_t i, per_line;
+
+	memset(batch, 0, sizeof(*batch));
+
+	/* aligned_alloc(3) wants a multiple of the alignment */
+	per_line = BATCH_ALIGN / sizeof(uint64_t);
+	if (cap == 0 || cap > SIZE_MAX / sizeof(uint64_t) - per_line) {
+		errno = EINVAL;
+		return (-1);
+	}
+	cap = (cap + per_line - 1) & ~(per_line - 1);
+
+	for (i = 0; i < FREE_NR_FIELDS; i++) {
+		batch->col[i] = aligned_alloc(BATCH_ALIGN, cap * sizeof(uint64_t));
+		if (batch->col[i] == NULL) {
+			free_batch_free(batch);
+			return (-1);
+		}
+	}
+
+	batch->cap = cap;
+	return (0);
+}
+
+int free_batch_push(struct free_batch *batch, const struct free_model *mod)
+{
+	size_t i;
+
+	if (batch->len == batch->cap) {
+		errno = ENOBUFS;
+		return (-1);
+	}
+
+	for (i = 0; i < FREE_NR_FIELDS; i++)
+		batch->col[i][batch->len] = FREE_FIELD(mod, i);
+	batch->len++;
+	return (0);
+}
+
+void free_batch_get(const struct free_batch *batch, size_t i,
+		    struct free_model *mod)
+{
+	size_t j;
+
+	for (j = 0; j < FREE_NR_FIELDS; j++)
+		*(uint64_t *)((char *)mod + free_fields[j].off) = batch->col[j][i];
+}
+
+/* Partial reduction of a column. The sum is kept as two sums
+   of 32-bit halves, which can't overflow below 2^32 snapshots,
+   so it saturates instead of wrapping and the mean stays right. */
+struct reduce_acc {
+	uint64_t hi;
+	uint64_t lo;
+	uint64_t min;
+	uint64_t max;
+};
+
+#ifdef HAVE_VECTOR_EXT
+/* Reduce the first values of a column, BATCH_LANES at a time.
+   Returns the number of values reduced. */
+static inline __attribute__((always_inline))
+size_t reduce_vec(const uint64_t *col, size_t n, struct reduce_acc *acc)
+{
+	vec_u64 vhi = {0}, vlo = {0}, vmax = {0}, vmin, v, m;
+	size_t i, j;
+
+	vmin = ~vmax;
+	for (i = 0; i + BATCH_LANES <= n; i += BATCH_LANES) {
+		/* The window may start anywhere in the column */
+		memcpy(&v, col + i, sizeof(v));
+		vhi += v >> 32;
+		vlo += v & 0xffffffff;
+
+		/* Select with the comparison masks */
+		m = (vec_u64)(v < vmin);
+		vmin = (v & m) | (vmin & ~m);
+		m = (vec_u64)(v > vmax);
+		vmax = (v & m) | (vmax & ~m);
+	}
+
+	for (j = 0; j < BATCH_LANES; j++) {
+		acc->hi += vhi[j];
+		acc->lo += vlo[j];
+		if (vmin[j] < acc->min)
+			acc->min = vmin[j];
+		if (vmax[j] > acc->max)
+			acc->max = vmax[j];
+	}
+	return (i);
+}
+#endif
+
+#if defined(HAVE_VECTOR_EXT) && defined(__x86_64__)
+/* The baseline of x86-64 (SSE2) has no 64-bit vector compare,
+   the emulated one is slower than scalar code. The vectors are
+   only used with AVX2, detected at run time. */
+__attribute__((target("avx2")))
+static size_t reduce_avx2(const uint64_t *col, size_t n, struct reduce_acc *acc)
+{
+	return (reduce_vec(col, n, acc));
+}
+
+static size_t reduce_fast(const uint64_t *col, size_t n, struct reduce_acc *acc)
+{
+	if (__builtin_cpu_supports("avx2"))
+		return (reduce_avx2(col, n, acc));
+	return (0);
+}
+#elif defined(HAVE_VECTOR_EXT)
+static size_t reduce_fast(const uint64_t *col, size_t n, struct reduce_acc *acc)
+{
+	return (reduce_vec(col, n, acc));
+}
+#else
+static size_t reduce_fast(const uint64_t *col, size_t n, struct reduce_acc *acc)
+{
+	(void)col;
+	(void)n;
+	(void)acc;
+	return (0);
+}
+#endif
+
+void free_batch_reduce(const struct free_batch *batch, size_t field,
+		       size_t first, size_t n, struct free_reduce *out)
+{
+	struct reduce_acc acc = { 0, 0, UINT64_MAX, 0 };
+	const uint64_t *col;
+	uint64_t sum;
+	size_t i;
+
+	if (first > batch->len)
+		first = batch->len;
+	if (n > batch->len - first)
+		n = batch->len - first;
+
+	memset(out, 0, sizeof(*out));
+	if (n == 0)
+		return;
+
+	col = batch->col[field] + first;
+	for (i = reduce_fast(col, n, &acc); i < n; i++) {
+		acc.hi += col[i] >> 32;
+		acc.lo += col[i] & 0xffffffff;
+		if (col[i] < acc.min)
+			acc.min = col[i];
+		if (col[i] > acc.max)
+			acc.max = col[i];
+	}
+
+	/* sum = hi * 2^32 + lo, unless it overflows */
+	sum = (acc.hi >> 32) ? UINT64_MAX : acc.hi << 32;
+	if (sum != UINT64_MAX && (sum += acc.lo) < acc.lo)
+		sum = UINT64_MAX;
+
+	out->sum = sum;
+	out->min = acc.min;
+	out->max = acc.max;
+	out->mean = ((double)acc.hi * 4294967296.0 + (double)acc.lo) / (double)n;
+}
+
+void free_batch_clear(struct free_batch *batch)
+{
+	batch->len = 0;
+}
+
+void free_batch_free(struct free_batch *batch)
+{
+	size_t i;
+
+	for (i = 0; i < FREE_NR_FIELDS; i++) {
+		free(batch->col[i]);
+		batch->col[i] = NULL;
+	}
+	batch->len = batch->cap = 0;
+}
+
+_Static_assert(sizeof(struct free_model) % sizeof(uint64_t) == 0,
+	       "struct free_model must only hold 64-bit words");
+
+void free_shm_publish(struct free_shm *shm, const struct free_model *mod)
+{
+	uint64_t words[FREE_SHM_WORDS];
+	uint64_t seq;
+	size_t i;
+
+	memcpy(words, mod, sizeof(words));
+	seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	for (i = 0; i < FREE_SHM_WORDS; i++)
+		atomic_store_explicit(&shm->words[i], words[i],
+				      memory_order_relaxed);
+
+	atomic_store_explicit(&shm->seq, seq + 2, memory_order_release);
+}
+
+void free_shm_read(const struct free_shm *shm, struct free_model *mod)
+{
+	uint64_t words[FREE_SHM_WORDS];
+	uint64_t seq1, seq2;
+	size_t i;
+
+	do {
+		seq1 = atomic_load_explicit(&shm->seq, memory_order_acquire);
+		if (seq1 & 1)
+			continue;
+
+		for (i = 0; i < FREE_SHM_WORDS; i++)
+			words[i] = atomic_load_explicit(&shm->words[i],
+							memory_order_relaxed);
+
+		atomic_thread_fence(memory_order_acquire);
+		seq2 = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+	} while ((seq1 & 1) || seq1 != seq2);
+
+	memcpy(mod, words, sizeof(words));
+}
+
+const char *const free_page_class_names[FREE_NR_PAGE_CLASSES] = {
+	"anon", "file", "slab", "buddy", "thp", "locked", "dirty", "writeback",
+};
+
+#if defined(__linux__)
+/* Flags of /proc/kpageflags, from <linux/kernel-page-flags.h> */
+#define KPF_LOCKED       0
+#define KPF_DIRTY        4
+#define KPF_LRU          5
+#define KPF_SLAB         7
+#define KPF_WRITEBACK    8
+#define KPF_BUDDY        10
+#define KPF_MMAP         11
+#define KPF_ANON         12
+#define KPF_NOPAGE       20
+#define KPF_THP          22
+
+/* Entries read at once by a thread of free_page_census(), 1 MiB */
+#define CENSUS_CHUNK     ((size_t)1 << 17)
+
+/* Counters of the census, the classes and the existing pages */
+#define CENSUS_COUNTERS  (FREE_NR_PAGE_CLASSES + 1)
+
+/* A thread of free_page_census() and its PFN range */
+struct census_worker {
+	int fd;
+	uint64_t first;
+	uint64_t last;
+	uint64_t counts[CENSUS_COUNTERS];
+	int err;
+	pthread_t thr;
+};
+
+/* Count the classes of one page. Every class is a bit, or a
+   combination of bits, so the counting is branchless. */
+static inline void census_one(uint64_t f, uint64_t *counts)
+{
+	counts[FREE_PAGE_ANON] += (f >> KPF_ANON) & 1;
+	counts[FREE_PAGE_FILE] += ((f >> KPF_LRU) | (f >> KPF_MMAP)) &
+		~(f >> KPF_ANON) & 1;
+	counts[FREE_PAGE_SLAB] += (f >> KPF_SLAB) & 1;
+	counts[FREE_PAGE_BUDDY] += (f >> KPF_BUDDY) & 1;
+	counts[FREE_PAGE_THP] += (f >> KPF_THP) & 1;
+	counts[FREE_PAGE_LOCKED] += (f >> KPF_LOCKED) & 1;
+	counts[FREE_PAGE_DIRTY] += (f >> KPF_DIRTY) & 1;
+	counts[FREE_PAGE_WRITEBACK] += (f >> KPF_WRITEBACK) & 1;
+	counts[FREE_NR_PAGE_CLASSES] += ~(f >> KPF_NOPAGE) & 1;
+}
+
+#ifdef HAVE_VECTOR_EXT
+/* Count the first flags of a chunk, BATCH_LANES at a time.
+   Shifts and masks only, which the SSE2 baseline has too.
+   Returns the number of flags counted. */
+static inline __attribute__((always_inline))
+size_t census_vec(const uint64_t *flags, size_t n, uint64_t *counts)
+{
+	vec_u64 acc[CENSUS_COUNTERS] = {{0}};
+	vec_u64 v;
+	size_t i, j, k;
+
+	for (i = 0; i + BATCH_LANES <= n; i += BATCH_LANES) {
+		memcpy(&v, flags + i, sizeof(v));
+		acc[FREE_PAGE_ANON] += (v >> KPF_ANON) & 1;
+		acc[FREE_PAGE_FILE] += ((v >> KPF_LRU) | (v >> KPF_MMAP)) &
+			~(v >> KPF_ANON) & 1;
+		acc[FREE_PAGE_SLAB] += (v >> KPF_SLAB) & 1;
+		acc[FREE_PAGE_BUDDY] += (v >> KPF_BUDDY) & 1;
+		acc[FREE_PAGE_THP] += (v >> KPF_THP) & 1;
+		acc[FREE_PAGE_LOCKED] += (v >> KPF_LOCKED) & 1;
+		acc[FREE_PAGE_DIRTY] += (v >> KPF_DIRTY) & 1;
+		acc[FREE_PAGE_WRITEBACK] += (v >> KPF_WRITEBACK) & 1;
+		acc[FREE_NR_PAGE_CLASSES] += ~(v >> KPF_NOPAGE) & 1;
+	}
+
+	for (k = 0; k < CENSUS_COUNTERS; k++) {
+		for (j = 0; j < BATCH_LANES; j++)
+			counts[k] += acc[k][j];
+	}
+	return (i);
+}
+#endif
+
+#if defined(HAVE_VECTOR_EXT) && defined(__x86_64__)
+__attribute__((target("avx2")))
+static size_t census_avx2(const uint64_t *flags, size_t n, uint64_t *counts)
+{
+	return (census_vec(flags, n, counts));
+}
+
+static size_t census_fast(const uint64_t *flags, size_t n, uint64_t *counts)
+{
+	if (__builtin_cpu_supports("avx2"))
+		return (census_avx2(flags, n, counts));
+	return (census_vec(flags, n, counts));
+}
+#elif defined(HAVE_VECTOR_EXT)
+static size_t census_fast(const uint64_t *flags, size_t n, uint64_t *counts)
+{
+	return (census_vec(flags, n, counts));
+}
+#else
+static size_t census_fast(const uint64_t *flags, size_t n, uint64_t *counts)
+{
+	(void)flags;
+	(void)n;
+	(void)counts;
+	return (0);
+}
+#endif
+
+/* Read the PFN range of a worker in chunks, with pread(2) on
+   the descriptor shared by all the workers. */
+static void *census_main(void *arg)
+{
+	struct census_worker *w = arg;
+	uint64_t *flags, pfn;
+	size_t n, i;
+	ssize_t ret;
+
+	flags = aligned_alloc(BATCH_ALIGN, CENSUS_CHUNK * sizeof(uint64_t));
+	if (flags == NULL) {
+		w->err = errno;
+		return (NULL);
+	}
+
+	for (pfn = w->first; pfn < w->last; pfn += n) {
+		n = w->last - pfn < CENSUS_CHUNK ? (size_t)(w->last - pfn) :
+			CENSUS_CHUNK;
+		ret = pread(w->fd, flags, n * sizeof(uint64_t),
+			    (off_t)(pfn * sizeof(uint64_t)));
+		if (ret == -1) {
+			w->err = errno;
+			break;
+		}
+
+		/* The end of the physical memory */
+		n = (size_t)ret / sizeof(uint64_t);
+		if (n == 0)
+			break;
+
+		i = census_fast(flags, n, w->counts);
+		for (; i < n; i++)
+			census_one(flags[i], w->counts);
+	}
+
+	free(flags);
+	return (NULL);
+}
+
+/* Find the highest PFN, the end of the last zone in
+   /proc/zoneinfo (under "root"). Returns 0 if it can't be
+   read. */
+static uint64_t census_max_pfn(const char *root)
+{
+	unsigned long long spanned, start;
+	uint64_t max;
+	char line[256], path[PATH_MAX];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/proc/zoneinfo", root);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return (0);
+
+	max = spanned = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, " spanned %llu", &spanned) == 1)
+			continue;
+		if (sscanf(line, " start_pfn: %llu", &start) == 1 &&
+		    start + spanned > max)
+			max = start + spanned;
+	}
+
+	fclose(fp);
+	return (max);
+}
+#endif
+
+int free_page_census(unsigned int threads, struct free_page_census *pc)
+{
+	return (free_page_census_root("", threads, pc));
+}
+
+int free_page_census_root(const char *root, unsigned int threads,
+			  struct free_page_census *pc)
+{
+#if defined(__linux__)
+	struct census_worker *workers;
+	uint64_t max, per;
+	unsigned int i, k, started;
+	char path[PATH_MAX];
+	long val;
+	int fd, err;
+
+	memset(pc, 0, sizeof(*pc));
+	val = sysconf(_SC_PAGESIZE);
+	if (val == -1)
+		return (-1);
+	pc->pagesize = (uint64_t)val;
+
+	if (threads == 0) {
+		val = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = val > 0 ? (unsigned int)val : 1;
+	}
+	if (threads > FREE_CACHE_MAX_THREADS)
+		threads = FREE_CACHE_MAX_THREADS;
+
+	/* Without the zones, a single thread reads up to the end */
+	max = census_max_pfn(root);
+	if (max == 0) {
+		max = UINT64_MAX / sizeof(uint64_t);
+		threads = 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/proc/kpageflags", root);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return (-1);
+
+	workers = calloc(threads, sizeof(*workers));
+	if (workers == NULL) {
+		close(fd);
+		return (-1);
+	}
+
+	/* Ranges are whole chunks, the last one takes the rest */
+	per = (max / threads + CENSUS_CHUNK - 1) / CENSUS_CHUNK * CENSUS_CHUNK;
+	err = 0;
+	for (started = 0; started < threads; started++) {
+		workers[started].fd = fd;
+		workers[started].first = per * started;
+		workers[started].last = started == threads - 1 ? max :
+			per * (started + 1);
+		if (workers[started].first > max)
+			workers[started].first = max;
+		if (workers[started].last > max)
+			workers[started].last = max;
+
+		err = pthread_create(&workers[started].thr, NULL, census_main,
+				     &workers[started]);
+		if (err != 0)
+			break;
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i].thr, NULL);
+		if (workers[i].err)
+			err = workers[i].err;
+		for (k = 0; k < FREE_NR_PAGE_CLASSES; k++)
+			pc->counts[k] += workers[i].counts[k];
+		pc->pages += workers[i].counts[FREE_NR_PAGE_CLASSES];
+	}
+
+	free(workers);
+	close(fd);
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+
+	return (0);
+#else
+	(void)root;
+	(void)threads;
+	(void)pc;
+	errno = ENOTSUP;
+	return (-1);
+#endif
+}
+
+#if defined(__linux__)
+#define PAGE_IDLE_PATH   "%s/sys/kernel/mm/page_idle/bitmap"
+
+/* Entries of /proc/PID/pagemap */
+#define PM_PRESENT       ((uint64_t)1 << 63)
+#define PM_PFN_MASK      (((uint64_t)1 << 55) - 1)
+
+/* A word of the idle bitmap, for the PFNs idx * 64 to
+   idx * 64 + 63, and the ones of the working set in it */
+struct wss_word {
+	uint64_t idx;
+	uint64_t mask;
+};
+
+/* Words of the working set, by increasing index */
+struct wss_words {
+	struct wss_word *v;
+	size_t len;
+	size_t cap;
+};
+
+enum {
+	WSS_SCAN,       /* Find the pages of the cgroup */
+	WSS_MARK,       /* Mark the pages idle */
+	WSS_CHECK,      /* Count the pages no longer idle */
+};
+
+/* A thread of free_wss(): a PFN range of /proc/kpagecgroup to
+   scan, or a slice of the words to mark or check */
+struct wss_worker {
+	int fd;
+	int phase;
+	uint64_t first;
+	uint64_t last;
+	uint64_t ino;
+	struct wss_words words;
+	struct wss_word *v;
+	size_t len;
+	uint64_t count;
+	int err;
+	pthread_t thr;
+};
+
+/* Add a page to the words, PFNs must come in increasing order.
+   Returns 0, or -1 if out of memory. */
+static int wss_add(struct wss_words *w, uint64_t pfn)
+{
+	struct wss_word *v;
+	size_t cap;
+
+	if (w->len && w->v[w->len - 1].idx == pfn / 64) {
+		w->v[w->len - 1].mask |= (uint64_t)1 << (pfn % 64);
+		return (0);
+	}
+
+	if (w->len == w->cap) {
+		cap = w->cap ? w->cap * 2 : 1024;
+		v = realloc(w->v, cap * sizeof(*v));
+		if (v == NULL)
+			return (-1);
+		w->v = v;
+		w->cap = cap;
+	}
+
+	w->v[w->len].idx = pfn / 64;
+	w->v[w->len].mask = (uint64_t)1 << (pfn % 64);
+	w->len++;
+	return (0);
+}
+
+/* Scan a PFN range of /proc/kpagecgroup for the pages charged
+   to the cgroup of inode "ino". */
+static int wss_scan(struct wss_worker *w, uint64_t *buf)
+{
+	uint64_t pfn;
+	size_t n, i;
+	ssize_t ret;
+
+	for (pfn = w->first; pfn < w->last; pfn += n) {
+		n = w->last - pfn < CENSUS_CHUNK ? (size_t)(w->last - pfn) :
+			CENSUS_CHUNK;
+		ret = pread(w->fd, buf, n * sizeof(uint64_t),
+			    (off_t)(pfn * sizeof(uint64_t)));
+		if (ret == -1)
+			return (-1);
+
+		n = (size_t)ret / sizeof(uint64_t);
+		if (n == 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			if (buf[i] == w->ino && wss_add(&w->words, pfn + i) == -1)
+				return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/* Mark or check a slice of the words. The bitmap is read and
+   written a chunk of 64-bit words at a time, the gaps between
+   the words of the slice as 0 (which doesn't change them).
+   Only the pages on an LRU list can be idle, so after marking
+   them the bitmap is read back to keep only those. */
+static int wss_bitmap(struct wss_worker *w, uint64_t *buf)
+{
+	uint64_t base, idle;
+	size_t i, j, k, n;
+	ssize_t ret;
+
+	for (i = 0; i < w->len; i = j) {
+		base = w->v[i].idx;
+		for (j = i; j < w->len && w->v[j].idx - base < CENSUS_CHUNK; j++)
+			;
+		n = (size_t)(w->v[j - 1].idx - base + 1);
+
+		if (w->phase == WSS_MARK) {
+			memset(buf, 0, n * sizeof(uint64_t));
+			for (k = i; k < j; k++)
+				buf[w->v[k].idx - base] = w->v[k].mask;
+			if (pwrite(w->fd, buf, n * sizeof(uint64_t),
+				   (off_t)(base * sizeof(uint64_t))) == -1)
+				return (-1);
+		}
+
+		ret = pread(w->fd, buf, n * sizeof(uint64_t),
+			    (off_t)(base * sizeof(uint64_t)));
+		if (ret == -1)
+			return (-1);
+		if ((size_t)ret < n * sizeof(uint64_t))
+			memset((char *)buf + ret, 0, n * sizeof(uint64_t) - (size_t)ret);
+
+		for (k = i; k < j; k++) {
+			idle = buf[w->v[k].idx - base];
+			if (w->phase == WSS_MARK) {
+				w->v[k].mask &= idle;
+				w->count += (uint64_t)__builtin_popcountll(w->v[k].mask);
+			} else {
+				w->count += (uint64_t)__builtin_popcountll(w->v[k].mask & ~idle);
+			}
+		}
+	}
+
+	return (0);
+}
+
+static void *wss_main(void *arg)
+{
+	struct wss_worker *w = arg;
+	uint64_t *buf;
+	int ret;
+
+	buf = aligned_alloc(BATCH_ALIGN, CENSUS_CHUNK * sizeof(uint64_t));
+	if (buf == NULL) {
+		w->err = errno;
+		return (NULL);
+	}
+
+	if (w->phase == WSS_SCAN)
+		ret = wss_scan(w, buf);
+	else
+		ret = wss_bitmap(w, buf);
+	if (ret == -1)
+		w->err = errno;
+
+	free(buf);
+	return (NULL);
+}
+
+/* Run the workers, each one on a thread. Returns 0, or -1 and
+   sets errno to the error of a worker. */
+static int wss_run(struct wss_worker *workers, unsigned int n)
+{
+	unsigned int i, started;
+	int err;
+
+	err = 0;
+	for (started = 0; started < n; started++) {
+		err = pthread_create(&workers[started].thr, NULL, wss_main,
+				     &workers[started]);
+		if (err != 0)
+			break;
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i].thr, NULL);
+		if (workers[i].err)
+			err = workers[i].err;
+	}
+
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+
+	return (0);
+}
+
+static int cmp_pfn(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+/* Collect the words of the pages mapped by a process, from
+   its mappings and /proc/PID/pagemap (under "root"). Returns
+   0, or -1 and sets errno (EPERM if the PFNs are hidden,
+   without root). */
+static int wss_pid_words(const char *root, pid_t pid, uint64_t pagesize,
+			 struct wss_words *words)
+{
+	unsigned long start, end;
+	uint64_t *buf, *pfns, *p, vpn, last;
+	size_t n, i, len, cap, hidden;
+	char path[PATH_MAX], line[512];
+	ssize_t ret;
+	FILE *fp;
+	int fd, err;
+
+	snprintf(path, sizeof(path), "%s/proc/%ld/maps", root, (long)pid);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return (-1);
+
+	snprintf(path, sizeof(path), "%s/proc/%ld/pagemap", root, (long)pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fclose(fp);
+		return (-1);
+	}
+
+	buf = aligned_alloc(BATCH_ALIGN, CENSUS_CHUNK * sizeof(uint64_t));
+	pfns = NULL;
+	len = cap = hidden = 0;
+	err = buf == NULL ? errno : 0;
+	while (err == 0 && fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%lx-%lx", &start, &end) != 2)
+			continue;
+
+		/* A mapping which can't be read, e.g. [vsyscall], is skipped */
+		last = end / pagesize;
+		for (vpn = start / pagesize; vpn < last && err == 0; vpn += n) {
+			n = last - vpn < CENSUS_CHUNK ? (size_t)(last - vpn) :
+				CENSUS_CHUNK;
+			ret = pread(fd, buf, n * sizeof(uint64_t),
+				    (off_t)(vpn * sizeof(uint64_t)));
+			if (ret <= 0)
+				break;
+
+			n = (size_t)ret / sizeof(uint64_t);
+			for (i = 0; i < n; i++) {
+				if (!(buf[i] & PM_PRESENT))
+					continue;
+				if ((buf[i] & PM_PFN_MASK) == 0) {
+					hidden++;
+					continue;
+				}
+
+				if (len == cap) {
+					cap = cap ? cap * 2 : 4096;
+					p = realloc(pfns, cap * sizeof(*p));
+					if (p == NULL) {
+						err = errno;
+						break;
+					}
+					pfns = p;
+				}
+				pfns[len++] = buf[i] & PM_PFN_MASK;
+			}
+		}
+	}
+
+	if (err == 0 && len == 0 && hidden)
+		err = EPERM;
+
+	/* Pages mapped more than once add the same bit again */
+	if (err == 0)
+		qsort(pfns, len, sizeof(*pfns), cmp_pfn);
+	for (i = 0; err == 0 && i < len; i++) {
+		if (wss_add(words, pfns[i]) == -1)
+			err = errno;
+	}
+
+	free(pfns);
+	free(buf);
+	close(fd);
+	fclose(fp);
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* Collect the words of the pages charged to a cgroup, from
+   /proc/kpagecgroup (under "root"), the PFN range split over
+   the threads. */
+static int wss_cgroup_words(const char *root, const char *cgroup,
+			    unsigned int threads, struct wss_words *words)
+{
+	struct wss_worker *workers;
+	struct wss_word *v;
+	struct stat st;
+	uint64_t max, per;
+	unsigned int i;
+	char path[PATH_MAX];
+	int fd, ret;
+
+	if (stat(cgroup, &st) == -1)
+		return (-1);
+	if (!S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		return (-1);
+	}
+
+	/* Without the zones, a single thread reads up to the end */
+	max = census_max_pfn(root);
+	if (max == 0) {
+		max = UINT64_MAX / sizeof(uint64_t);
+		threads = 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/proc/kpagecgroup", root);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return (-1);
+
+	workers = calloc(threads, sizeof(*workers));
+	if (workers == NULL) {
+		close(fd);
+		return (-1);
+	}
+
+	/* Ranges are whole chunks, so no word is split between two
+	   threads, and the last one takes the rest. */
+	per = (max / threads + CENSUS_CHUNK - 1) / CENSUS_CHUNK * CENSUS_CHUNK;
+	for (i = 0; i < threads; i++) {
+		workers[i].fd = fd;
+		workers[i].phase = WSS_SCAN;
+		workers[i].ino = (uint64_t)st.st_ino;
+		workers[i].first = per * i < max ? per * i : max;
+		workers[i].last = i == threads - 1 || per * (i + 1) > max ? max :
+			per * (i + 1);
+	}
+
+	ret = wss_run(workers, threads);
+	for (i = 0; i < threads; i++) {
+		if (ret == 0 && workers[i].words.len) {
+			v = realloc(words->v, (words->len + workers[i].words.len) *
+				    sizeof(*v));
+			if (v == NULL) {
+				ret = -1;
+			} else {
+				memcpy(v + words->len, workers[i].words.v,
+				       workers[i].words.len * sizeof(*v));
+				words->v = v;
+				words->len += workers[i].words.len;
+				words->cap = words->len;
+			}
+		}
+		free(workers[i].words.v);
+	}
+
+	free(workers);
+	close(fd);
+	return (ret);
+}
+
+/* Mark or check the words, split in equal slices over the
+   threads, and count the pages. Returns 0, or -1 and sets
+   errno. */
+static int wss_phase(int fd, int phase, struct wss_words *words,
+		     unsigned int threads, uint64_t *count)
+{
+	struct wss_worker w[FREE_CACHE_MAX_THREADS];
+	size_t per, off;
+	unsigned int i;
+
+	memset(w, 0, sizeof(w));
+	if (threads > words->len)
+		threads = words->len ? (unsigned int)words->len : 1;
+
+	per = (words->len + threads - 1) / threads;
+	for (i = 0, off = 0; i < threads; i++, off += per) {
+		w[i].fd = fd;
+		w[i].phase = phase;
+		w[i].v = words->v + (off < words->len ? off : words->len);
+		w[i].len = off < words->len ? MIN(per, words->len - off) : 0;
+	}
+
+	if (wss_run(w, threads) == -1)
+		return (-1);
+
+	*count = 0;
+	for (i = 0; i < threads; i++)
+		*count += w[i].count;
+	return (0);
+}
+#endif
+
+int free_wss(pid_t pid, const char *cgroup, uint64_t window_ns,
+	     unsigned int threads, struct free_wss *ws)
+{
+	return (free_wss_root("", pid, cgroup, window_ns, threads, ws));
+}
+
+int free_wss_root(const char *root, pid_t pid, const char *cgroup,
+		  uint64_t window_ns, unsigned int threads,
+		  struct free_wss *ws)
+{
+#if defined(__linux__)
+	struct wss_words words = {0};
+	struct timespec ts;
+	char path[PATH_MAX];
+	long val;
+	int fd, ret, err;
+
+	memset(ws, 0, sizeof(*ws));
+	val = sysconf(_SC_PAGESIZE);
+	if (val == -1)
+		return (-1);
+	ws->pagesize = (uint64_t)val;
+
+	if (threads == 0) {
+		val = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = val > 0 ? (unsigned int)val : 1;
+	}
+	if (threads > FREE_CACHE_MAX_THREADS)
+		threads = FREE_CACHE_MAX_THREADS;
+
+	/* Without CONFIG_IDLE_PAGE_TRACKING, fail before any scan */
+	snprintf(path, sizeof(path), PAGE_IDLE_PATH, root);
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd == -1)
+		return (-1);
+
+	if (pid)
+		ret = wss_pid_words(root, pid, ws->pagesize, &words);
+	else
+		ret = wss_cgroup_words(root, cgroup, threads, &words);
+
+	if (ret == 0)
+		ret = wss_phase(fd, WSS_MARK, &words, threads, &ws->tracked);
+
+	if (ret == 0) {
+		ts.tv_sec = (time_t)(window_ns / 1000000000);
+		ts.tv_nsec = (long)(window_ns % 1000000000);
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+
+		ret = wss_phase(fd, WSS_CHECK, &words, threads, &ws->accessed);
+	}
+
+	err = errno;
+	free(words.v);
+	close(fd);
+	errno = err;
+	return (ret);
+#else
+	(void)root;
+	(void)pid;
+	(void)cgroup;
+	(void)window_ns;
+	(void)threads;
+	(void)ws;
+	errno = ENOTSUP;
+	return (-1);
+#endif
+}
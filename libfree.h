@@ -0,0 +1,417 @@
+/*
+ * libfree - Collect the amount of space for RAM and swap.
+ *
+ * BSD 2-Clause License
+ * 
+ * Copyright (c) 2023, rilysh <nightquick@proton.me>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBFREE_H
+#define LIBFREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Structure where retrieved values will reside.
+   All values are in bytes. A value that couldn't be
+   retrieved is set to (uint64_t)-1.
+
+   Every snapshot is stamped when its collection starts, in
+   nanoseconds of CLOCK_REALTIME and CLOCK_MONOTONIC (both
+   read through the vDSO, without a system call), and numbered
+   by its context from 1. The fixture backend keeps the
+   stamps of its file, 0 if there are none.
+
+   The ages tell how old the values of each source (see
+   free_sample_source()) are at ts_mono, in nanoseconds. They
+   are 0 after free_sample(), which reads every source.
+
+   arc_size, arc_min and arc_target are the size of the ZFS
+   ARC, its floor and its target, all 0 without ZFS. The ARC
+   is counted in usedram, but it shrinks down to its floor
+   under pressure: avail is freeram plus that reclaimable
+   part. */
+struct free_model {
+	uint64_t totalram;
+	uint64_t freeram;
+	uint64_t usedram;
+	uint64_t buffer;
+	uint64_t shared;
+	uint64_t totalswap;
+	uint64_t usedswap;
+	uint64_t freeswap;
+	uint64_t ts_real;
+	uint64_t ts_mono;
+	uint64_t seq;
+	uint64_t age_mem;
+	uint64_t age_active;
+	uint64_t age_shared;
+	uint64_t age_swap;
+	uint64_t arc_size;
+	uint64_t arc_min;
+	uint64_t arc_target;
+	uint64_t avail;
+	uint64_t age_arc;
+};
+
+/* Name and offset of every field of "struct free_model" */
+struct free_field {
+	const char *name;
+	size_t off;
+};
+
+#define FREE_NR_FIELDS    20
+
+extern const struct free_field free_fields[FREE_NR_FIELDS];
+
+/* Value of the i-th field of a snapshot */
+#define FREE_FIELD(mod, i) \
+	(*(const uint64_t *)((const char *)(mod) + free_fields[i].off))
+
+/* Cost of the samples taken through a context, as
+   returned by free_ctx_stats(). */
+struct free_stats {
+	uint64_t samples;      /* Number of free_sample() calls */
+	uint64_t syscalls;     /* System calls issued to collect them */
+	uint64_t bytes_read;   /* Bytes copied out of the kernel */
+	uint64_t retries;      /* Snapshots re-read (FREE_CTX_CONSISTENT) */
+	uint64_t clamped;      /* Snapshots clamped to be consistent */
+};
+
+/* Collector context. It holds the handles and the page size
+   used to take a snapshot, so they are set up once and not on
+   every sample.
+
+   Contexts don't share any state, different threads may sample
+   concurrently as long as each one uses its own context. A
+   single context must not be used by two threads at once. */
+struct free_ctx;
+
+/* Flags of free_ctx_open()
+
+   The counters are read one at a time, so a snapshot mixes
+   slightly different moments. With FREE_CTX_CONSISTENT, a
+   snapshot whose counters contradict each other (more free
+   than total RAM, more active than used RAM, more used than
+   total swap) is read again, a few times. In any mode, such a
+   snapshot is finally clamped, used RAM and free swap never
+   wrap around. */
+#define FREE_CTX_DEFAULT    0x0
+#define FREE_CTX_CONSISTENT 0x1
+
+/* Open a collector context. Returns NULL and sets errno
+   on failure. */
+struct free_ctx *free_ctx_open(unsigned int flags);
+
+/* System calls of a collector context, with the prototypes of
+   sysctl(3). They can be replaced, e.g. to run the collector
+   against canned values on another system. */
+struct free_sysops {
+	int (*sysctl)(const int *mib, unsigned int len, void *buf,
+		      size_t *sz, const void *newp, size_t newlen);
+	int (*sysctlnametomib)(const char *name, int *mib, size_t *len);
+	int (*sysctlbyname)(const char *name, void *buf, size_t *sz,
+			    const void *newp, size_t newlen);
+};
+
+#if !defined(__FreeBSD__)
+/* A swap device of "vm.swap_info", with the layout of
+   <vm/vm_param.h>, for the sysops faking it on other systems.
+   A swap file on NFS has no device (NODEV). */
+#define XSWDEV_VERSION    2
+
+#ifndef NODEV
+#  define NODEV    ((dev_t)-1)
+#endif
+
+struct xswdev {
+	unsigned int xsw_version;
+	dev_t xsw_dev;
+	int xsw_flags;
+	int xsw_nblks;
+	int xsw_used;
+};
+#endif
+
+/* Open a collector context which calls ops instead of the
+   C library (NULL for the C library). ops must outlive the
+   context. Returns NULL and sets errno on failure. */
+struct free_ctx *free_ctx_open_sysops(unsigned int flags,
+				      const struct free_sysops *ops);
+
+/* Open a collector context which replays the snapshots of a
+   fixture file instead of reading the kernel, in a loop. Every
+   line is a snapshot, written as "name=value" pairs with the
+   names of free_fields[], e.g.
+
+   totalram=17179869184 freeram=4294967296 usedram=12884901888
+
+   Missing fields are 0, "-1" is the (uint64_t)-1 sentinel (and
+   fails the sample, like a failed read) and '#' starts a
+   comment. Returns NULL and sets errno on failure (EINVAL for a
+   malformed file). */
+struct free_ctx *free_ctx_open_fixture(const char *path);
+
+/* Read the ZFS ARC from the kstat file at path, written like
+   /proc/spl/kstat/zfs/arcstats, instead of the kernel. The file
+   is kept open and read again for every sample. On Linux, the
+   ARC is read from /proc/spl/kstat/zfs/arcstats by default, on
+   FreeBSD from the kstat.zfs.misc.arcstats sysctls. Returns 0,
+   or -1 and sets errno (ENOTSUP for a fixture context). */
+int free_ctx_arcstats(struct free_ctx *ctx, const char *path);
+
+/* Take a snapshot of RAM and swap. Returns 0 on success, or -1
+   if any value couldn't be retrieved (see "struct free_model"). */
+int free_sample(struct free_ctx *ctx, struct free_model *mod);
+
+/* Sources of a snapshot, which can be read on their own:
+   FREE_SRC_MEM     totalram, freeram, usedram
+   FREE_SRC_ACTIVE  buffer
+   FREE_SRC_SHARED  shared
+   FREE_SRC_SWAP    totalswap, usedswap, freeswap
+   FREE_SRC_ARC     arc_size, arc_min, arc_target, avail (with
+                    the latest freeram) */
+enum {
+	FREE_SRC_MEM,
+	FREE_SRC_ACTIVE,
+	FREE_SRC_SHARED,
+	FREE_SRC_SWAP,
+	FREE_SRC_ARC,
+	FREE_NR_SOURCES,
+};
+
+/* Names of the sources, e.g. "mem" */
+extern const char *const free_source_names[FREE_NR_SOURCES];
+
+/* Update the fields of a single source in a snapshot, keeping
+   the others and ageing them. The stamps and the sequence
+   number are renewed. A fixture context replays the next
+   record for every call. Returns 0 on success, or -1. */
+int free_sample_source(struct free_ctx *ctx, int src, struct free_model *mod);
+
+/* Get the cost of all the samples taken so far. */
+void free_ctx_stats(const struct free_ctx *ctx, struct free_stats *st);
+
+/* Close a collector context. */
+void free_ctx_close(struct free_ctx *ctx);
+
+/* Most swap devices returned by free_swap_devices() */
+#define FREE_SWAP_DEV_MAX    32
+
+#define FREE_SWAP_NO_PRIORITY    INT32_MIN
+
+/* A swap device. Sizes are in bytes, the priority is
+   FREE_SWAP_NO_PRIORITY where swap devices have none (FreeBSD),
+   Linux priorities may be negative. */
+struct free_swap_dev {
+	char name[64];
+	uint64_t total;
+	uint64_t used;
+	int priority;
+};
+
+/* Get up to max swap devices, all of them in a single pass
+   ("vm.swap_info" on FreeBSD, /proc/swaps on Linux).
+   Returns the number of devices, or -1 and sets errno on
+   failure (ENOTSUP for a fixture context). */
+int free_swap_devices(struct free_ctx *ctx, struct free_swap_dev *devs,
+		      size_t max);
+
+/* Most threads of free_cache_scan() */
+#define FREE_CACHE_MAX_THREADS    64
+
+/* How the residency of the files was asked for */
+enum {
+	FREE_CACHE_CACHESTAT,   /* cachestat(2), Linux 6.5 and later */
+	FREE_CACHE_MINCORE,     /* mmap(2) and mincore(2) */
+};
+
+/* A file, or a directory with the files right in it (not in
+   its subdirectories), and the bytes of them in the page
+   cache. Sizes are in bytes. */
+struct free_cache_entry {
+	char *path;
+	uint64_t cached;
+	uint64_t size;
+	uint64_t files;
+};
+
+/* Page cache residency of the files under some paths, and the
+   directories and files holding most of it, largest first. */
+struct free_cache_report {
+	uint64_t cached;
+	uint64_t size;
+	uint64_t files;
+	uint64_t dirs;
+	uint64_t errors;        /* Files and directories not read */
+	int method;             /* FREE_CACHE_* */
+	struct free_cache_entry *top_dirs;
+	size_t nr_dirs;
+	struct free_cache_entry *top_files;
+	size_t nr_files;
+};
+
+/* Walk the trees under paths (files or directories) on
+   "threads" threads (0 for one per CPU), which steal the
+   directories left to walk from each other, and ask the kernel
+   which pages of every regular file are cached. Symbolic links
+   aren't followed. The "top" largest directories and files are
+   kept. Returns 0, or -1 and sets errno; the report is freed
+   with free_cache_report_free(). */
+int free_cache_scan(const char *const *paths, size_t n, unsigned int threads,
+		    size_t top, struct free_cache_report *rep);
+
+/* Free the entries of a report. */
+void free_cache_report_free(struct free_cache_report *rep);
+
+/* Batch of snapshots, stored column by column: col[i] holds the
+   values of free_fields[i] for every snapshot, in one array
+   aligned on a cache line. Walking a field over many snapshots
+   is a sequential read, which the reductions below vectorise. */
+struct free_batch {
+	uint64_t *col[FREE_NR_FIELDS];
+	size_t len;
+	size_t cap;
+};
+
+/* Reduction of a field over a window of a batch. "sum" is
+   UINT64_MAX if it doesn't fit, "mean" is exact up to the
+   precision of a double in any case. */
+struct free_reduce {
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	double mean;
+};
+
+/* Allocate a batch of (at least) cap snapshots. Returns 0, or
+   -1 and sets errno on failure. */
+int free_batch_init(struct free_batch *batch, size_t cap);
+
+/* Append a snapshot to a batch. Returns 0, or -1 and sets errno
+   to ENOBUFS if the batch is full. */
+int free_batch_push(struct free_batch *batch, const struct free_model *mod);
+
+/* Get the i-th snapshot of a batch. */
+void free_batch_get(const struct free_batch *batch, size_t i,
+		    struct free_model *mod);
+
+/* Reduce the field free_fields[field] over the n snapshots of a
+   batch starting at first. The window is clamped to the batch,
+   an empty window reduces to 0. */
+void free_batch_reduce(const struct free_batch *batch, size_t field,
+		       size_t first, size_t n, struct free_reduce *out);
+
+/* Empty a batch, keeping its memory. */
+void free_batch_clear(struct free_batch *batch);
+
+/* Free the memory of a batch. */
+void free_batch_free(struct free_batch *batch);
+
+/* Snapshot published in shared memory, guarded by a seqlock.
+   "seq" is odd while the writer is writing "words", readers
+   retry until they see the same even "seq" before and after
+   copying the snapshot. Every word is accessed atomically, so
+   a torn copy is a retry and never a data race. "magic" and
+   "version" are left to the caller. */
+#define FREE_SHM_WORDS (sizeof(struct free_model) / sizeof(uint64_t))
+
+struct free_shm {
+	uint32_t magic;
+	uint32_t version;
+	_Atomic uint64_t seq;
+	_Atomic uint64_t words[FREE_SHM_WORDS];
+};
+
+/* Publish a snapshot (writer side of the seqlock). There must
+   be a single writer. */
+void free_shm_publish(struct free_shm *shm, const struct free_model *mod);
+
+/* Take a consistent snapshot (reader side of the seqlock),
+   without any system call. */
+void free_shm_read(const struct free_shm *shm, struct free_model *mod);
+
+/* Classes of the physical pages counted by free_page_census().
+   A page may be in several of them, e.g. anon and thp. "file"
+   is a page cache page (mapped or on an LRU list, not anon),
+   "buddy" the first page of every free block of the buddy
+   allocator (the others aren't marked). */
+enum {
+	FREE_PAGE_ANON,
+	FREE_PAGE_FILE,
+	FREE_PAGE_SLAB,
+	FREE_PAGE_BUDDY,
+	FREE_PAGE_THP,
+	FREE_PAGE_LOCKED,
+	FREE_PAGE_DIRTY,
+	FREE_PAGE_WRITEBACK,
+	FREE_NR_PAGE_CLASSES,
+};
+
+/* Names of the classes, e.g. "anon" */
+extern const char *const free_page_class_names[FREE_NR_PAGE_CLASSES];
+
+/* Census of the physical pages, in pages of pagesize bytes */
+struct free_page_census {
+	uint64_t pagesize;
+	uint64_t pages;         /* Pages which exist */
+	uint64_t counts[FREE_NR_PAGE_CLASSES];
+};
+
+/* Classify every physical page from /proc/kpageflags (Linux,
+   readable by root only), the PFN range split over "threads"
+   threads (0 for one per CPU). Returns 0, or -1 and sets errno
+   (ENOTSUP on other systems). */
+int free_page_census(unsigned int threads, struct free_page_census *pc);
+
+/* Same as free_page_census(), with the files of the kernel
+   read under the directory "root", e.g. captured ones. */
+int free_page_census_root(const char *root, unsigned int threads,
+			  struct free_page_census *pc);
+
+/* Working set measured by free_wss(), in pages of pagesize bytes */
+struct free_wss {
+	uint64_t pagesize;
+	uint64_t tracked;       /* Pages marked idle */
+	uint64_t accessed;      /* Pages accessed during the window */
+};
+
+/* Estimate the working set of the process "pid" or, if it's
+   0, of the cgroup whose directory is "cgroup", e.g.
+   /sys/fs/cgroup/app: mark its pages idle in the idle page
+   bitmap, wait "window_ns" and count the ones accessed since.
+   The bitmap is read and written by "threads" threads (0 for
+   one per CPU). Linux only, root only. Returns 0, or -1 and
+   sets errno. */
+int free_wss(pid_t pid, const char *cgroup, uint64_t window_ns,
+	     unsigned int threads, struct free_wss *ws);
+
+/* Same as free_wss(), with the files of the kernel under the
+   directory "root". The cgroup is still looked up as given. */
+int free_wss_root(const char *root, pid_t pid, const char *cgroup,
+		  uint64_t window_ns, unsigned int threads,
+		  struct free_wss *ws);
+
+#endif /* LIBFREE_H */
@@ -0,0 +1,488 @@
+/*
+ * free(1) - Render the collected RAM and swap information.
+ *
+ * BSD 2-Clause License
+ * 
+ * Copyright (c) 2023, rilysh <nightquick@proton.me>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "libfree.h"
+#include "render.h"
+
+/* Header of the RAM and swap tables, and with the columns
+   of the ZFS ARC */
+#define TABLE_HEADER \
+	"               total        free        used        buffer       shared\n"
+#define TABLE_HEADER_ARC \
+	"               total        free        used        buffer       shared          arc        avail\n"
+
+/* The ARC columns are shown only on hosts with one */
+#define HAS_ARC(mod)    ((mod)->arc_size != 0)
+
+/* A value which couldn't be collected, shown as "-" */
+#define MISSING(v)      ((v) == (uint64_t)-1)
+
+/* Division by a unit. Binary units are a shift. Decimal units,
+   pow(1000, n) = pow(2, 3n) * pow(5, 3n), are a shift by 3n and
+   a multiply-high by a reciprocal of pow(5, 3n), which is exact
+   for every input as the shifted value has 3n bits less. */
+struct unit_div {
+	unsigned char shift;    /* Binary: v >> shift */
+	unsigned char pre;      /* Decimal: mulhi(v >> pre, magic) >> post */
+	unsigned char post;
+	unsigned char is_zero;  /* Unit larger than any value */
+	uint64_t magic;         /* 0 for the binary units */
+	uint64_t divisor;       /* Without a 128-bit type */
+};
+
+static const struct unit_div unit_divs[] = {
+	[TO_B]  = { 0, 0, 0, 0, 0, 1 },
+	[TO_K]  = { 0, 3, 4, 0, 0x20c49ba5e353f7cf, 1000ULL },
+	[TO_M]  = { 0, 6, 8, 0, 0x0431bde82d7b634e, 1000000ULL },
+	[TO_G]  = { 0, 9, 12, 0, 0x0089705f4136b4a6, 1000000000ULL },
+	[TO_T]  = { 0, 12, 16, 0, 0x00119799812dea12, 1000000000000ULL },
+	[TO_P]  = { 0, 15, 20, 0, 0x00024075f3dceac3, 1000000000000000ULL },
+	[TO_E]  = { 0, 18, 24, 0, 0x000049c97747490f, 1000000000000000000ULL },
+	[TO_Z]  = { 0, 0, 0, 1, 0, 0 },
+	[TO_Y]  = { 0, 0, 0, 1, 0, 0 },
+	[TO_Bi] = { 0, 0, 0, 0, 0, 1 },
+	[TO_Ki] = { 10, 0, 0, 0, 0, 0 },
+	[TO_Mi] = { 20, 0, 0, 0, 0, 0 },
+	[TO_Gi] = { 30, 0, 0, 0, 0, 0 },
+	[TO_Ti] = { 40, 0, 0, 0, 0, 0 },
+	[TO_Pi] = { 50, 0, 0, 0, 0, 0 },
+	[TO_Ei] = { 60, 0, 0, 0, 0, 0 },
+	[TO_Zi] = { 0, 0, 0, 1, 0, 0 },
+	[TO_Yi] = { 0, 0, 0, 1, 0, 0 },
+};
+
+/* Convert a value in bytes to a unit */
+static inline uint64_t unit_convert(const struct unit_div *u, uint64_t v)
+{
+	if (u->is_zero)
+		return (0);
+	if (u->magic == 0)
+		return (v >> u->shift);
+#ifdef __SIZEOF_INT128__
+	return ((uint64_t)(((unsigned __int128)(v >> u->pre) * u->magic) >> 64) >> u->post);
+#else
+	return (v / u->divisor);
+#endif
+}
+
+/* Append a value right-aligned in a column of "width"
+   characters, or wider if needed, like "%*lu". */
+static char *put_col(char *p, uint64_t v, int width)
+{
+	char digits[20];
+	int n;
+
+	n = 0;
+	do {
+		digits[n++] = (char)('0' + v % 10);
+		v /= 10;
+	} while (v);
+
+	for (; width > n; width--)
+		*p++ = ' ';
+	while (n)
+		*p++ = digits[--n];
+	return (p);
+}
+
+/* Append a value converted to a unit in a column, or "-" if
+   it's missing. */
+static char *put_val(char *p, const struct unit_div *u, uint64_t v, int width)
+{
+	if (!MISSING(v))
+		return (put_col(p, unit_convert(u, v), width));
+
+	for (; width > 1; width--)
+		*p++ = ' ';
+	*p++ = '-';
+	return (p);
+}
+
+/* Add two values. The sum is missing if either one is, and
+   saturates short of the sentinel on huge values. */
+static inline uint64_t sat_add(uint64_t a, uint64_t b)
+{
+	if (MISSING(a) || MISSING(b))
+		return ((uint64_t)-1);
+	return (a + b < a || a + b == UINT64_MAX ? UINT64_MAX - 1 : a + b);
+}
+
+/* Format the output bytes to a human readable format.
+   e.g.
+   Input: 1985596 (in kB, decimal)
+   Output: 1.9Gi (in binary) and 2.0G (in decimal) */
+char *pretty_format(uint64_t nsz, int is_decimal)
+{
+	double base, res;
+	int idx;
+	char *p;
+
+	if (MISSING(nsz))
+		return strdup("-");
+	if (nsz <= 0)
+		return strdup("0B");
+
+	p = calloc(30, sizeof(char));
+	if (p == NULL) {
+		perror("calloc()");
+	        abort();
+		/* unreachable */
+	}
+
+	/* Decimal pow(1000, n) */
+	if (is_decimal) {
+		const char *suff[10] = {
+			"B", "K", "M", "G", "T",
+			"P", "E", "Z", "Y"
+		};
+
+		base = log10((double)nsz) / log10(1000.0);
+		res = round(pow(1000.0, base - floor(base)) * 10.0) / 10.0;
+		idx = (int)floor(base);
+
+		snprintf(p, (size_t)30, "%0.1lf%s", res, suff[idx]);
+
+	/* Binary pow(1024, n) */
+	} else {
+	        const char *suff[10] = {
+			"B", "Ki", "Mi", "Gi", "Ti",
+			"Pi", "Ei", "Zi", "Yi"
+		};
+
+		base = log10((double)nsz) / log10(1024.0);
+		res = round(pow(1024.0, base - floor(base)) * 10.0) / 10.0;
+		idx = (int)floor(base);
+
+		snprintf(p, (size_t)30, "%0.1lf%s", res, suff[idx]);
+	}
+
+	return (p);
+}
+
+/* Print all collected information about RAM and swap.
+   These are, "totalram", "freeram", "usedram",
+   "buffer", "shared", "totalswap", "freeswap",
+   "usedswap", "total_ram_swap", "free_ram_swap",
+   and "used_ram_swap", and "arc_size" and "avail"
+   with a ZFS ARC. */
+void print_general_memory(
+	FILE *fp, const struct free_model *mod, int is_pretty, int is_decimal, int is_total)
+{
+	/* Hold the values temporarily */
+	char *totalram, *freeram, *usedram,
+		*buffer, *shared, *totalswap,
+		*freeswap, *usedswap, *total_ram_swap,
+		*free_ram_swap, *used_ram_swap, *arc, *avail;
+
+	if (!is_pretty) {
+		print_unit_memory(fp, mod, is_decimal ? TO_K : TO_Ki, is_total);
+		return;
+	}
+
+	fputs(HAS_ARC(mod) ? TABLE_HEADER_ARC : TABLE_HEADER, fp);
+
+	/* RAM information */
+	totalram = pretty_format(mod->totalram, is_decimal);
+	freeram = pretty_format(mod->freeram, is_decimal);
+	usedram = pretty_format(mod->usedram, is_decimal);
+	buffer = pretty_format(mod->buffer, is_decimal);
+	shared = pretty_format(mod->shared, is_decimal);
+
+	/* Swap information */
+	totalswap = pretty_format(mod->totalswap, is_decimal);
+	freeswap = pretty_format(mod->freeswap, is_decimal);
+	usedswap = pretty_format(mod->usedswap, is_decimal);
+
+	fprintf(fp,
+		"Mem: %15s %11s %11s %13s %12s", totalram, freeram,
+		usedram, buffer, shared);
+	if (HAS_ARC(mod)) {
+		arc = pretty_format(mod->arc_size, is_decimal);
+		avail = pretty_format(mod->avail, is_decimal);
+		fprintf(fp, " %12s %12s", arc, avail);
+		free(arc);
+		free(avail);
+	}
+	fputc('\n', fp);
+	fprintf(fp,
+		"Swap: %14s %11s %11s\n",
+	        totalswap, freeswap, usedswap);
+
+	if (is_total) {
+		total_ram_swap = pretty_format(sat_add(mod->totalram, mod->totalswap), is_decimal);
+		free_ram_swap = pretty_format(sat_add(mod->freeram, mod->freeswap), is_decimal);
+		used_ram_swap = pretty_format(sat_add(mod->usedram, mod->usedswap), is_decimal);
+
+		fprintf(fp,
+			"Total: %13s %11s %11s\n",
+			total_ram_swap, free_ram_swap, used_ram_swap);
+
+		/* Free allocated buffers */
+		free(total_ram_swap);
+		free(free_ram_swap);
+		free(used_ram_swap);
+	}
+
+	/* RAM */
+	free(totalram);
+	free(freeram);
+	free(usedram);
+	free(buffer);
+	free(shared);
+
+	/* Swap */
+	free(totalswap);
+	free(freeswap);
+	free(usedswap);
+}
+
+/* Print all collected information about RAM and swap
+   in a unit.
+   Printed values are, "totalram", "freeram", "usedram",
+   "buffer", "shared", "totalswap", "freeswap", and
+   "usedswap", their sums with "is_total", and the ARC
+   columns with a ZFS ARC. The table is formatted in a
+   buffer and written at once. */
+void print_unit_memory(FILE *fp, const struct free_model *mod, int unit,
+		       int is_total)
+{
+	const struct unit_div *u = &unit_divs[unit];
+	char buf[512], *p;
+
+	p = buf;
+	if (HAS_ARC(mod)) {
+		memcpy(p, TABLE_HEADER_ARC, sizeof(TABLE_HEADER_ARC) - 1);
+		p += sizeof(TABLE_HEADER_ARC) - 1;
+	} else {
+		memcpy(p, TABLE_HEADER, sizeof(TABLE_HEADER) - 1);
+		p += sizeof(TABLE_HEADER) - 1;
+	}
+
+	memcpy(p, "Mem: ", 5);
+	p = put_val(p + 5, u, mod->totalram, 15);
+	*p++ = ' ';
+	p = put_val(p, u, mod->freeram, 11);
+	*p++ = ' ';
+	p = put_val(p, u, mod->usedram, 11);
+	*p++ = ' ';
+	p = put_val(p, u, mod->buffer, 13);
+	*p++ = ' ';
+	p = put_val(p, u, mod->shared, 12);
+	if (HAS_ARC(mod)) {
+		*p++ = ' ';
+		p = put_val(p, u, mod->arc_size, 12);
+		*p++ = ' ';
+		p = put_val(p, u, mod->avail, 12);
+	}
+
+	memcpy(p, "\nSwap: ", 7);
+	p = put_val(p + 7, u, mod->totalswap, 14);
+	*p++ = ' ';
+	p = put_val(p, u, mod->freeswap, 11);
+	*p++ = ' ';
+	p = put_val(p, u, mod->usedswap, 11);
+	*p++ = '\n';
+
+	if (is_total) {
+		memcpy(p, "Total: ", 7);
+		p = put_val(p + 7, u, sat_add(mod->totalram, mod->totalswap), 13);
+		*p++ = ' ';
+		p = put_val(p, u, sat_add(mod->freeram, mod->freeswap), 11);
+		*p++ = ' ';
+		p = put_val(p, u, sat_add(mod->usedram, mod->usedswap), 11);
+		*p++ = '\n';
+	}
+
+	fwrite(buf, sizeof(char), (size_t)(p - buf), fp);
+}
+
+/* Print the size, usage and priority of every swap device.
+   A device without priority shows "-" (null in JSON). */
+void print_swap_devices(FILE *fp, const struct free_swap_dev *devs, size_t n,
+			int is_pretty, int is_decimal, int unit)
+{
+	const struct unit_div *u = &unit_divs[unit];
+	char *total, *used;
+	char prio[16];
+	size_t i;
+
+	fprintf(fp, "%-24s %12s %11s %10s\n", "Device", "total", "used",
+		"priority");
+	for (i = 0; i < n; i++) {
+		if (devs[i].priority == FREE_SWAP_NO_PRIORITY)
+			snprintf(prio, sizeof(prio), "-");
+		else
+			snprintf(prio, sizeof(prio), "%d", devs[i].priority);
+
+		if (is_pretty) {
+			total = pretty_format(devs[i].total, is_decimal);
+			used = pretty_format(devs[i].used, is_decimal);
+			fprintf(fp, "%-24s %12s %11s %10s\n", devs[i].name,
+				total, used, prio);
+			free(total);
+			free(used);
+		} else {
+			fprintf(fp, "%-24s %12lu %11lu %10s\n", devs[i].name,
+				unit_convert(u, devs[i].total),
+				unit_convert(u, devs[i].used), prio);
+		}
+	}
+}
+
+/* Print a string as JSON, escaping what has to be */
+void print_json_string(FILE *fp, const char *str)
+{
+	const unsigned char *p;
+
+	fputc('"', fp);
+	for (p = (const unsigned char *)str; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(fp, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(fp, "\\u%04x", *p);
+		else
+			fputc(*p, fp);
+	}
+	fputc('"', fp);
+}
+
+/* Print the swap devices as a single line JSON object,
+   sizes in bytes. */
+void print_swap_devices_json(FILE *fp, const struct free_swap_dev *devs,
+			     size_t n)
+{
+	char prio[16];
+	size_t i;
+
+	fputs("{\"swap_devices\":[", fp);
+	for (i = 0; i < n; i++) {
+		if (devs[i].priority == FREE_SWAP_NO_PRIORITY)
+			snprintf(prio, sizeof(prio), "null");
+		else
+			snprintf(prio, sizeof(prio), "%d", devs[i].priority);
+
+		fputs(i ? ",{\"name\":" : "{\"name\":", fp);
+		print_json_string(fp, devs[i].name);
+		fprintf(fp, ",\"total\":%lu,\"used\":%lu,\"priority\":%s}",
+			devs[i].total, devs[i].used, prio);
+	}
+	fputs("]}\n", fp);
+}
+
+/* Print the page census as a histogram, one class per line:
+   its size, its share of the physical pages and a bar of up
+   to 40 '#' scaled to 100%. */
+void print_page_census(FILE *fp, const struct free_page_census *pc,
+		       int is_pretty, int is_decimal, int unit)
+{
+	const struct unit_div *u = &unit_divs[unit];
+	char bar[41], *size;
+	uint64_t bytes;
+	double pct;
+	size_t i, len;
+
+	fprintf(fp, "%-10s %12s %7s\n", "Pages", "size", "%");
+	for (i = 0; i < FREE_NR_PAGE_CLASSES; i++) {
+		bytes = pc->counts[i] * pc->pagesize;
+		pct = pc->pages ? 100.0 * (double)pc->counts[i] /
+			(double)pc->pages : 0.0;
+		len = (size_t)(pct * 40 / 100 + 0.5);
+		if (len > 40)
+			len = 40;
+		memset(bar, '#', len);
+		bar[len] = '\0';
+
+		if (is_pretty) {
+			size = pretty_format(bytes, is_decimal);
+			fprintf(fp, "%-10s %12s %6.1f%%%s%s\n",
+				free_page_class_names[i], size, pct,
+				len ? "  " : "", bar);
+			free(size);
+		} else {
+			fprintf(fp, "%-10s %12lu %6.1f%%%s%s\n",
+				free_page_class_names[i], unit_convert(u, bytes),
+				pct, len ? "  " : "", bar);
+		}
+	}
+}
+
+/* Print the page census as a single line JSON object,
+   sizes in bytes. */
+void print_page_census_json(FILE *fp, const struct free_page_census *pc)
+{
+	size_t i;
+
+	fprintf(fp, "{\"page_census\":{\"total\":%lu",
+		pc->pages * pc->pagesize);
+	for (i = 0; i < FREE_NR_PAGE_CLASSES; i++)
+		fprintf(fp, ",\"%s\":%lu", free_page_class_names[i],
+			pc->counts[i] * pc->pagesize);
+	fputs("}}\n", fp);
+}
+
+/* Format a snapshot as a single line JSON object.
+   Values are in bytes, as they are collected, and null if
+   they couldn't be. Returns the length of the formatted
+   string. */
+size_t format_json(char *buf, size_t len, const struct free_model *mod)
+{
+	size_t i, off;
+
+	off = (size_t)snprintf(buf, len, "{");
+	for (i = 0; i < FREE_NR_FIELDS && off < len; i++) {
+		if (MISSING(FREE_FIELD(mod, i)))
+			off += (size_t)snprintf(buf + off, len - off, "%s\"%s\":null",
+						i ? "," : "", free_fields[i].name);
+		else
+			off += (size_t)snprintf(buf + off, len - off, "%s\"%s\":%lu",
+						i ? "," : "", free_fields[i].name,
+						FREE_FIELD(mod, i));
+	}
+
+	if (off < len)
+		off += (size_t)snprintf(buf + off, len - off, "}\n");
+
+	return (off < len ? off : len - 1);
+}
+
+/* Print a snapshot as a single line JSON object. */
+void print_json(FILE *fp, const struct free_model *mod)
+{
+	char buf[1024];
+	size_t len;
+
+	len = format_json(buf, sizeof(buf), mod);
+	fwrite(buf, sizeof(char), len, fp);
+}
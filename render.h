@@ -0,0 +1,107 @@
+/*
+ * free(1) - Render the collected RAM and swap information.
+ *
+ * BSD 2-Clause License
+ * 
+ * Copyright (c) 2023, rilysh <nightquick@proton.me>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "libfree.h"
+
+/* Units of print_unit_memory(), pow(1000, n) and pow(1024, n)
+   bytes. Zetta, yotta and their binary forms are larger than
+   any 64-bit value, values in those units are always 0. */
+enum {
+	/* Decimal */
+	TO_B = 1,
+	TO_K,
+	TO_M,
+	TO_G,
+	TO_T,
+	TO_P,
+	TO_E,
+	TO_Z,
+	TO_Y,
+
+	/* Binary */
+	TO_Bi,
+	TO_Ki,
+	TO_Mi,
+	TO_Gi,
+	TO_Ti,
+	TO_Pi,
+	TO_Ei,
+	TO_Zi,
+	TO_Yi,
+};
+
+/* Format the output bytes to a human readable format, "-"
+   for the (uint64_t)-1 sentinel. The returned string must be
+   freed by the caller. */
+char *pretty_format(uint64_t nsz, int is_decimal);
+
+/* Print the RAM and swap table, either in human readable
+   form or in kibibytes (kilobytes with "is_decimal"). */
+void print_general_memory(FILE *fp, const struct free_model *mod,
+			  int is_pretty, int is_decimal, int is_total);
+
+/* Print the RAM and swap table in "unit" (one of TO_*). */
+void print_unit_memory(FILE *fp, const struct free_model *mod, int unit,
+		       int is_total);
+
+/* Print the table of the swap devices, in human readable
+   form or in "unit" (one of TO_*). */
+void print_swap_devices(FILE *fp, const struct free_swap_dev *devs, size_t n,
+			int is_pretty, int is_decimal, int unit);
+
+/* Print a string as a JSON string, escaping the quotes, the
+   backslashes and the control characters. */
+void print_json_string(FILE *fp, const char *str);
+
+/* Print the swap devices as a single line JSON object. */
+void print_swap_devices_json(FILE *fp, const struct free_swap_dev *devs,
+			     size_t n);
+
+/* Print the page census as a histogram, in human readable
+   form or in "unit" (one of TO_*). */
+void print_page_census(FILE *fp, const struct free_page_census *pc,
+		       int is_pretty, int is_decimal, int unit);
+
+/* Print the page census as a single line JSON object. */
+void print_page_census_json(FILE *fp, const struct free_page_census *pc);
+
+/* Format a snapshot as a single line JSON object. Returns
+   the length of the formatted string. */
+size_t format_json(char *buf, size_t len, const struct free_model *mod);
+
+/* Print a snapshot as a single line JSON object. */
+void print_json(FILE *fp, const struct free_model *mod);
+
+#endif /* RENDER_H */
@@ -0,0 +1,199 @@
+/*
+ * cache - Walk a tree of files with free_cache_scan().
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2023, rilysh <nightquick@proton.me>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "libfree.h"
+
+/* Report a failed check and go on with the next ones */
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failed++; \
+		} \
+	} while (0)
+
+static int failed;
+
+/* Write a file of "size" bytes, which leaves it in the page cache */
+static int write_file(const char *dir, const char *name, size_t size)
+{
+	char path[1024], buf[4096];
+	size_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return (-1);
+
+	memset(buf, 'x', sizeof(buf));
+	for (; size > 0; size -= n) {
+		n = size < sizeof(buf) ? size : sizeof(buf);
+		if (write(fd, buf, n) != (ssize_t)n) {
+			close(fd);
+			return (-1);
+		}
+	}
+
+	return (close(fd));
+}
+
+/* Does "path" end with "/name"? */
+static int ends_with(const char *path, const char *name)
+{
+	size_t len = strlen(path), n = strlen(name);
+
+	return (len > n && path[len - n - 1] == '/' &&
+		strcmp(path + len - n, name) == 0);
+}
+
+/* A tree of 3 files in 2 directories, and symbolic links */
+static void test_tree(const char *root, unsigned int threads)
+{
+	struct free_cache_report rep;
+	const char *paths[] = { root };
+
+	CHECK(free_cache_scan(paths, 1, threads, 5, &rep) == 0);
+	CHECK(rep.files == 3);
+	CHECK(rep.dirs == 2);
+	CHECK(rep.errors == 0);
+	CHECK(rep.size == 1048576 + 262144);
+	CHECK(rep.cached <= rep.size);
+	CHECK(rep.method == FREE_CACHE_CACHESTAT ||
+	      rep.method == FREE_CACHE_MINCORE);
+
+	/* The file just written is cached, and holds the most */
+	CHECK(rep.nr_files == 3);
+	if (rep.nr_files == 3) {
+		CHECK(ends_with(rep.top_files[0].path, "a"));
+		CHECK(rep.top_files[0].size == 1048576);
+		CHECK(rep.top_files[0].cached == 1048576);
+		CHECK(rep.top_files[1].cached <= rep.top_files[0].cached);
+		CHECK(rep.top_files[2].cached <= rep.top_files[1].cached);
+	}
+
+	/* The directories count the files right in them */
+	CHECK(rep.nr_dirs == 2);
+	if (rep.nr_dirs == 2) {
+		CHECK(strcmp(rep.top_dirs[0].path, root) == 0);
+		CHECK(rep.top_dirs[0].files == 1);
+		CHECK(ends_with(rep.top_dirs[1].path, "sub"));
+		CHECK(rep.top_dirs[1].files == 2);
+		CHECK(rep.top_dirs[1].size == 262144);
+	}
+
+	free_cache_report_free(&rep);
+
+	/* Without any top list */
+	CHECK(free_cache_scan(paths, 1, threads, 0, &rep) == 0);
+	CHECK(rep.files == 3 && rep.nr_files == 0 && rep.nr_dirs == 0);
+	free_cache_report_free(&rep);
+}
+
+/* Roots which are symbolic links are followed, to a directory
+   as well as to a file, unlike the links found by the walk */
+static void test_links(const char *root, unsigned int threads)
+{
+	struct free_cache_report rep;
+	char dir[64], file[64];
+	const char *paths[] = { dir, file };
+
+	snprintf(dir, sizeof(dir), "%s/sublink", root);
+	snprintf(file, sizeof(file), "%s/alink", root);
+	CHECK(free_cache_scan(paths, 2, threads, 5, &rep) == 0);
+	CHECK(rep.files == 3);
+	CHECK(rep.dirs == 1);
+	CHECK(rep.errors == 0);
+	CHECK(rep.size == 1048576 + 262144);
+	free_cache_report_free(&rep);
+}
+
+int main(void)
+{
+	static const char *const files[] = {
+		"sub/b", "sub/c", "sub", "a", "link", "sublink", "alink"
+	};
+	char root[] = "/tmp/free-cacheXXXXXX", sub[64], link[64], path[64];
+	size_t i;
+
+	if (mkdtemp(root) == NULL) {
+		perror("mkdtemp()");
+		return (EXIT_FAILURE);
+	}
+
+	snprintf(sub, sizeof(sub), "%s/sub", root);
+	snprintf(link, sizeof(link), "%s/link", root);
+	if (mkdir(sub, 0755) == -1 ||
+	    write_file(root, "a", 1048576) == -1 ||
+	    write_file(sub, "b", 262144) == -1 ||
+	    write_file(sub, "c", 0) == -1 ||
+	    symlink("/usr", link) == -1) {
+		perror(root);
+		return (EXIT_FAILURE);
+	}
+
+	snprintf(path, sizeof(path), "%s/sublink", root);
+	if (symlink("sub", path) == -1) {
+		perror(path);
+		return (EXIT_FAILURE);
+	}
+	snprintf(path, sizeof(path), "%s/alink", root);
+	if (symlink("a", path) == -1) {
+		perror(path);
+		return (EXIT_FAILURE);
+	}
+
+	test_tree(root, 1);
+	test_tree(root, 4);
+	test_links(root, 1);
+	test_links(root, 4);
+
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", root, files[i]);
+		CHECK(remove(path) == 0);
+	}
+	CHECK(rmdir(root) == 0);
+
+	if (failed) {
+		fprintf(stderr, "cache: %d checks failed\n", failed);
+		return (EXIT_FAILURE);
+	}
+
+	puts("cache: ok");
+	return (EXIT_SUCCESS);
+}
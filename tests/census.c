@@ -0,0 +1,213 @@
+/*
+ * census - Count the classes of pages of a captured kpageflags.
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2023, rilysh <nightquick@proton.me>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "libfree.h"
+
+/* Report a failed check and go on with the next ones */
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failed++; \
+		} \
+	} while (0)
+
+/* PFNs of the zones, and pages of kpageflags past the last one.
+   The count isn't a multiple of the vector width nor of the
+   chunks read by the threads. */
+#define MAX_PFN      300003
+#define NR_EXTRA     101
+
+static int failed;
+
+/* Classes of a page, as documented for /proc/kpageflags */
+static void classify(uint64_t f, uint64_t *counts, uint64_t *pages)
+{
+	if (f & (1ULL << 20))   /* NOPAGE */
+		return;
+	(*pages)++;
+
+	if (f & (1ULL << 12))
+		counts[FREE_PAGE_ANON]++;
+	else if (f & ((1ULL << 5) | (1ULL << 11)))      /* LRU, MMAP */
+		counts[FREE_PAGE_FILE]++;
+	if (f & (1ULL << 7))
+		counts[FREE_PAGE_SLAB]++;
+	if (f & (1ULL << 10))
+		counts[FREE_PAGE_BUDDY]++;
+	if (f & (1ULL << 22))
+		counts[FREE_PAGE_THP]++;
+	if (f & (1ULL << 0))
+		counts[FREE_PAGE_LOCKED]++;
+	if (f & (1ULL << 4))
+		counts[FREE_PAGE_DIRTY]++;
+	if (f & (1ULL << 8))
+		counts[FREE_PAGE_WRITEBACK]++;
+}
+
+/* Flags of a page, from a xorshift generator */
+static uint64_t next_flags(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	/* A hole on 1 PFN in 16, where the kernel reports NOPAGE alone */
+	return ((x & 0xf) ? x & ~(1ULL << 20) : 1ULL << 20);
+}
+
+static int write_str(const char *path, const char *str)
+{
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (fp == NULL)
+		return (-1);
+	fputs(str, fp);
+	return (fclose(fp));
+}
+
+static void check_census(const char *root, unsigned int threads,
+			 const uint64_t *counts, uint64_t pages)
+{
+	struct free_page_census pc;
+	size_t i;
+
+	CHECK(free_page_census_root(root, threads, &pc) == 0);
+	CHECK(pc.pagesize == (uint64_t)sysconf(_SC_PAGESIZE));
+	CHECK(pc.pages == pages);
+	for (i = 0; i < FREE_NR_PAGE_CLASSES; i++) {
+		if (pc.counts[i] != counts[i]) {
+			fprintf(stderr, "census: %u threads, %s: %lu, expected %lu\n",
+				threads, free_page_class_names[i],
+				pc.counts[i], counts[i]);
+			failed++;
+		}
+	}
+}
+
+int main(void)
+{
+	static const char zoneinfo[] =
+		"Node 0, zone      DMA\n"
+		"  pages free     3\n"
+		"        spanned  4095\n"
+		"        present  3998\n"
+		"  start_pfn:           1\n"
+		"Node 0, zone   Normal\n"
+		"  pages free     1000\n"
+		"        spanned  295907\n"
+		"        present  295907\n"
+		"  start_pfn:           4096\n"
+		"Node 0, zone  Movable\n"
+		"  pages free     0\n"
+		"        spanned  0\n"
+		"        present  0\n";
+	uint64_t counts[FREE_NR_PAGE_CLASSES] = {0}, all[FREE_NR_PAGE_CLASSES];
+	uint64_t *flags, state, pages, all_pages = 0;
+	char root[] = "/tmp/free-censusXXXXXX", path[128];
+	size_t i;
+	FILE *fp;
+
+	if (mkdtemp(root) == NULL) {
+		perror("mkdtemp()");
+		return (EXIT_FAILURE);
+	}
+
+	snprintf(path, sizeof(path), "%s/proc", root);
+	if (mkdir(path, 0755) == -1) {
+		perror(path);
+		return (EXIT_FAILURE);
+	}
+
+	flags = malloc((MAX_PFN + NR_EXTRA) * sizeof(*flags));
+	if (flags == NULL)
+		return (EXIT_FAILURE);
+
+	state = 0x9e3779b97f4a7c15ULL;
+	pages = 0;
+	for (i = 0; i < MAX_PFN + NR_EXTRA; i++) {
+		flags[i] = next_flags(&state);
+		if (i == MAX_PFN) {
+			memcpy(all, counts, sizeof(all));
+			all_pages = pages;
+		}
+		classify(flags[i], counts, &pages);
+	}
+
+	snprintf(path, sizeof(path), "%s/proc/kpageflags", root);
+	fp = fopen(path, "w");
+	if (fp == NULL || fwrite(flags, sizeof(*flags), MAX_PFN + NR_EXTRA, fp) !=
+	    MAX_PFN + NR_EXTRA || fclose(fp) != 0) {
+		perror(path);
+		return (EXIT_FAILURE);
+	}
+
+	/* The pages of the zones, split over the threads */
+	snprintf(path, sizeof(path), "%s/proc/zoneinfo", root);
+	CHECK(write_str(path, zoneinfo) == 0);
+	check_census(root, 1, all, all_pages);
+	check_census(root, 3, all, all_pages);
+	check_census(root, 8, all, all_pages);
+
+	/* Without the zones, every page up to the end of the file */
+	CHECK(unlink(path) == 0);
+	check_census(root, 4, counts, pages);
+
+	snprintf(path, sizeof(path), "%s/proc/kpageflags", root);
+	CHECK(unlink(path) == 0);
+	errno = 0;
+	CHECK(free_page_census_root(root, 1, &(struct free_page_census){0}) == -1);
+	CHECK(errno == ENOENT);
+
+	snprintf(path, sizeof(path), "%s/proc", root);
+	CHECK(rmdir(path) == 0);
+	CHECK(rmdir(root) == 0);
+	free(flags);
+
+	if (failed) {
+		fprintf(stderr, "census: %d checks failed\n", failed);
+		return (EXIT_FAILURE);
+	}
+
+	puts("census: ok");
+	return (EXIT_SUCCESS);
+}
@@ -0,0 +1,132 @@
+#!/bin/sh
+#
+# golden.sh - Compare the output of free on fixture files with
+# the golden outputs of tests/golden, byte for byte.
+#
+# Usage: tests/golden.sh [-u] FREE
+#   -u  write the golden outputs again instead of comparing
+
+update=0
+if [ "$1" = "-u" ]; then
+	update=1
+	shift
+fi
+
+free=${1:-./free}
+dir=$(dirname "$0")
+out=$(mktemp)
+trap 'rm -f "$out"' EXIT
+
+# Messages aren't translated, so they compare too
+LC_ALL=C
+export LC_ALL
+
+failed=0
+total=0
+
+# Every case is "name fixture arguments...", the output of
+# free (stdout and stderr) is followed by its exit status.
+while read -r name fixture args; do
+	case "$name" in
+	''|'#'*) continue ;;
+	esac
+
+	total=$((total + 1))
+	# shellcheck disable=SC2086
+	"$free" --fixture "$dir/fixtures/$fixture" $args >"$out" 2>&1
+	echo "exit $?" >>"$out"
+
+	if [ $update -eq 1 ]; then
+		cp "$out" "$dir/golden/$name.out"
+	elif ! cmp -s "$out" "$dir/golden/$name.out"; then
+		echo "golden: $name differs (free --fixture $fixture $args)"
+		diff -u "$dir/golden/$name.out" "$out" | head -20
+		failed=$((failed + 1))
+	fi
+done <<CASES
+# Default table, the units and the totals
+default          edge.txt -c 4
+total            edge.txt -c 4 -t
+human            edge.txt -c 4 -h
+human-total      edge.txt -c 4 -h -t
+decimal          edge.txt -c 4 --decimal
+decimal-total    edge.txt -c 4 --decimal -t
+human-decimal    edge.txt -c 4 -h --decimal
+human-decimal-total edge.txt -c 4 -h --decimal -t
+bytes            edge.txt -c 4 --bytes
+bytes-total      edge.txt -c 4 --bytes -t
+kilo             edge.txt -c 4 --kilo
+kilo-total       edge.txt -c 4 --kilo -t
+mega             edge.txt -c 4 --mega
+mega-total       edge.txt -c 4 --mega -t
+giga             edge.txt -c 4 --giga
+giga-total       edge.txt -c 4 --giga -t
+tera             edge.txt -c 4 --tera
+tera-total       edge.txt -c 4 --tera -t
+peta             edge.txt -c 4 --peta
+peta-total       edge.txt -c 4 --peta -t
+exa              edge.txt -c 4 --exa
+exa-total        edge.txt -c 4 --exa -t
+zetta            edge.txt -c 4 --zetta
+yotta            edge.txt -c 4 --yotta
+kibi             edge.txt -c 4 --kibi
+kibi-total       edge.txt -c 4 --kibi -t
+mibi             edge.txt -c 4 --mibi
+mibi-total       edge.txt -c 4 --mibi -t
+gibi             edge.txt -c 4 --gibi
+gibi-total       edge.txt -c 4 --gibi -t
+tibi             edge.txt -c 4 --tibi
+tibi-total       edge.txt -c 4 --tibi -t
+pibi             edge.txt -c 4 --pibi
+pibi-total       edge.txt -c 4 --pibi -t
+exbi             edge.txt -c 4 --exbi
+exbi-total       edge.txt -c 4 --exbi -t
+zebi             edge.txt -c 4 --zebi
+yobi             edge.txt -c 4 --yobi
+
+# JSON and the stamps of the snapshots
+json             edge.txt -c 4 --json
+json-total       edge.txt -c 4 --json -t
+timestamp        edge.txt -c 4 --timestamp
+timestamp-human  edge.txt -c 4 --timestamp -h
+timestamp-json   edge.txt -c 4 --timestamp --json
+
+# The loop, -s and -c
+count-1          edge.txt -c 1
+secs-count       edge.txt -s 0.01 -c 3
+secs-count-json  edge.txt -s 0.01 -c 3 --json
+secs-count-human edge.txt -s 0.01 -c 3 -h -t
+
+# Hosts with a ZFS ARC
+arc              arc.txt -c 3
+arc-human        arc.txt -c 3 -h -t
+arc-mibi         arc.txt -c 3 --mibi
+arc-json         arc.txt -c 3 --json
+arc-alert        arc.txt -c 3 --json --alert avail<40%
+
+# Values which couldn't be read
+missing          missing.txt -c 2
+missing-total    missing.txt -c 2 -t
+missing-human    missing.txt -c 2 -h -t
+missing-kibi     missing.txt -c 2 --kibi -t
+missing-json     missing.txt -c 2 --json
+missing-alert    missing.txt -c 2 --json --alert used>50%
+
+# Rules checked on every snapshot
+alert            edge.txt -c 4 --json --alert used>50%
+
+# Options which can't be used with a fixture, or are malformed
+bad-count        edge.txt -c 0
+bad-secs         edge.txt -s x
+bad-arcstats     edge.txt --arcstats /nonexistent
+bad-census       edge.txt --page-census
+bad-backpressure edge.txt --backpressure drop-newest -c 2
+bad-history      edge.txt --live --history 4 -c 2
+CASES
+
+if [ $failed -ne 0 ]; then
+	echo "golden: $failed of $total cases failed"
+	exit 1
+fi
+
+echo "golden: ok ($total cases)"
@@ -0,0 +1,93 @@
+/*
+ * render - Check the JSON of the renderers against expected strings.
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2023, rilysh <nightquick@proton.me>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libfree.h"
+#include "render.h"
+
+/* Report a failed check and go on with the next ones */
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failed++; \
+		} \
+	} while (0)
+
+static int failed;
+
+/* Swap device names come from the system, e.g. a file
+   in a directory whose name has quotes or a tab */
+static void test_swap_devices_json(void)
+{
+	static const struct free_swap_dev devs[] = {
+		{ "/dev/ada0p3", 4096, 1024, FREE_SWAP_NO_PRIORITY },
+		{ "/swap/\"a\\b\"\t\x01", 8192, 0, -2 },
+	};
+	static const char expected[] =
+		"{\"swap_devices\":["
+		"{\"name\":\"/dev/ada0p3\",\"total\":4096,\"used\":1024,"
+		"\"priority\":null},"
+		"{\"name\":\"/swap/\\\"a\\\\b\\\"\\u0009\\u0001\",\"total\":8192,"
+		"\"used\":0,\"priority\":-2}]}\n";
+	char *buf;
+	size_t len;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &len);
+	if (fp == NULL) {
+		perror("open_memstream()");
+		failed++;
+		return;
+	}
+
+	print_swap_devices_json(fp, devs, 2);
+	CHECK(fclose(fp) == 0);
+	CHECK(strcmp(buf, expected) == 0);
+	if (strcmp(buf, expected) != 0)
+		fprintf(stderr, "render: got %s", buf);
+	free(buf);
+}
+
+int main(void)
+{
+	test_swap_devices_json();
+
+	if (failed) {
+		fprintf(stderr, "render: %d checks failed\n", failed);
+		return (EXIT_FAILURE);
+	}
+
+	puts("render: ok");
+	return (EXIT_SUCCESS);
+}
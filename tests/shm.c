@@ -0,0 +1,161 @@
+/*
+ * shm - Stress the seqlock of the shared memory snapshots.
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2023, rilysh <nightquick@proton.me>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "libfree.h"
+
+/* Snapshots published by the writer, and the readers racing it */
+#define NR_PUBLISH    2000000
+#define NR_READERS    8
+
+/* The shared memory segment, mapped like the one of the daemon */
+static struct free_shm *shm;
+static atomic_int done;
+
+/* Reader of the segment, and what it saw */
+struct reader {
+	pthread_t thr;
+	uint64_t reads;
+	uint64_t torn;
+	uint64_t backwards;
+};
+
+/* The i-th word of the n-th snapshot is n * FREE_SHM_WORDS + i,
+   so a copy mixing two snapshots is told apart. */
+static void publish(uint64_t n)
+{
+	uint64_t words[FREE_SHM_WORDS];
+	struct free_model mod;
+	size_t i;
+
+	for (i = 0; i < FREE_SHM_WORDS; i++)
+		words[i] = n * FREE_SHM_WORDS + i;
+	memcpy(&mod, words, sizeof(mod));
+	free_shm_publish(shm, &mod);
+}
+
+static void *writer_main(void *arg)
+{
+	uint64_t n;
+
+	(void)arg;
+	for (n = 1; n <= NR_PUBLISH; n++)
+		publish(n);
+
+	atomic_store(&done, 1);
+	return (NULL);
+}
+
+static void *reader_main(void *arg)
+{
+	uint64_t words[FREE_SHM_WORDS], last;
+	struct reader *r = arg;
+	struct free_model mod;
+	size_t i;
+
+	last = 0;
+	while (!atomic_load(&done)) {
+		free_shm_read(shm, &mod);
+		memcpy(words, &mod, sizeof(words));
+		r->reads++;
+
+		for (i = 1; i < FREE_SHM_WORDS; i++) {
+			if (words[i] != words[0] + i) {
+				r->torn++;
+				break;
+			}
+		}
+
+		/* Snapshots are never seen out of order */
+		if (words[0] < last)
+			r->backwards++;
+		last = words[0];
+	}
+
+	return (NULL);
+}
+
+int main(void)
+{
+	struct reader readers[NR_READERS];
+	uint64_t reads, torn, backwards;
+	pthread_t writer;
+	int i;
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED) {
+		perror("mmap()");
+		return (EXIT_FAILURE);
+	}
+
+	/* The readers start with a complete snapshot */
+	publish(0);
+
+	memset(readers, 0, sizeof(readers));
+	for (i = 0; i < NR_READERS; i++) {
+		if (pthread_create(&readers[i].thr, NULL, reader_main,
+				   &readers[i]) != 0) {
+			perror("pthread_create()");
+			return (EXIT_FAILURE);
+		}
+	}
+
+	if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+		perror("pthread_create()");
+		return (EXIT_FAILURE);
+	}
+
+	pthread_join(writer, NULL);
+	reads = torn = backwards = 0;
+	for (i = 0; i < NR_READERS; i++) {
+		pthread_join(readers[i].thr, NULL);
+		reads += readers[i].reads;
+		torn += readers[i].torn;
+		backwards += readers[i].backwards;
+	}
+
+	if (torn || backwards) {
+		fprintf(stderr, "shm: %lu torn and %lu out of order in %lu reads\n",
+			torn, backwards, reads);
+		return (EXIT_FAILURE);
+	}
+
+	printf("shm: ok (%d publishes, %lu reads)\n", NR_PUBLISH, reads);
+	return (EXIT_SUCCESS);
+}
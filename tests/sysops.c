@@ -0,0 +1,477 @@
+/*
+ * sysops - Run the collector of libfree against canned sysctls.
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2023, rilysh <nightquick@proton.me>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#if defined(__FreeBSD__)
+#  include <sys/param.h>
+#  include <vm/vm_param.h>
+#endif
+
+#include "libfree.h"
+
+/* Report a failed check and go on with the next ones */
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failed++; \
+		} \
+	} while (0)
+
+/* First level of the fake MIBs */
+#define MIB_VALUE    100
+#define MIB_SWAP     200
+
+/* Canned sysctls, as on a host with 16 GiB of 4 KiB pages */
+static struct {
+	const char *name;
+	uint64_t val;
+	size_t sz;
+} values[] = {
+	{ "vm.stats.vm.v_page_count",   4194304, sizeof(unsigned int) },
+	{ "vm.stats.vm.v_free_count",   1048576, sizeof(unsigned int) },
+	{ "vm.stats.vm.v_active_count", 524288, sizeof(unsigned int) },
+	{ "kern.ipc.shmmax",            536870912, sizeof(uint64_t) },
+};
+
+#define NR_VALUES    (sizeof(values) / sizeof(values[0]))
+
+/* Swap devices of vm.swap_info, in pages */
+static struct xswdev swap_devs[] = {
+	{ XSWDEV_VERSION, 0x5a, 0, 262144, 1024 },
+	{ XSWDEV_VERSION, NODEV, 0, 131072, 0 },
+};
+
+static size_t nr_swap_devs;
+static int swap_info_missing;
+static unsigned int swap_version = XSWDEV_VERSION;
+
+/* Calls to the sysops, and names looked up (vm.swap_info last) */
+static unsigned int nr_nametomib;
+static unsigned int nr_sysctl;
+static unsigned int resolved[NR_VALUES + 1];
+
+/* Directory of the kstat files of the ARC */
+static const char *fixtures = "tests/fixtures";
+
+static int failed;
+
+static int fake_nametomib(const char *name, int *mib, size_t *len)
+{
+	size_t i;
+
+	nr_nametomib++;
+	if (strcmp(name, "vm.swap_info") == 0 && !swap_info_missing) {
+		resolved[NR_VALUES]++;
+		mib[0] = MIB_SWAP;
+		mib[1] = 0;
+		*len = 2;
+		return (0);
+	}
+
+	for (i = 0; i < NR_VALUES; i++) {
+		if (strcmp(name, values[i].name) == 0) {
+			resolved[i]++;
+			mib[0] = MIB_VALUE;
+			mib[1] = (int)i;
+			*len = 2;
+			return (0);
+		}
+	}
+
+	errno = ENOENT;
+	return (-1);
+}
+
+static int fake_sysctl(const int *mib, unsigned int len, void *buf,
+		       size_t *sz, const void *newp, size_t newlen)
+{
+	struct xswdev xsw;
+	uint64_t val;
+	unsigned int v32;
+
+	(void)newp;
+	(void)newlen;
+
+	nr_sysctl++;
+	if (len == 2 && mib[0] == MIB_VALUE && (size_t)mib[1] < NR_VALUES) {
+		val = values[mib[1]].val;
+		v32 = (unsigned int)val;
+		if (*sz < values[mib[1]].sz) {
+			errno = ENOMEM;
+			return (-1);
+		}
+		*sz = values[mib[1]].sz;
+		memcpy(buf, *sz == sizeof(v32) ? (void *)&v32 : (void *)&val, *sz);
+		return (0);
+	}
+
+	if (len == 3 && mib[0] == MIB_SWAP) {
+		if (mib[2] < 0 || (size_t)mib[2] >= nr_swap_devs) {
+			errno = ENOENT;
+			return (-1);
+		}
+		xsw = swap_devs[mib[2]];
+		xsw.xsw_version = swap_version;
+		*sz = sizeof(xsw);
+		memcpy(buf, &xsw, sizeof(xsw));
+		return (0);
+	}
+
+	errno = ENOENT;
+	return (-1);
+}
+
+/* kern.devname names a device from its dev_t */
+static int fake_sysctlbyname(const char *name, void *buf, size_t *sz,
+			     const void *newp, size_t newlen)
+{
+	dev_t dev;
+
+	if (strcmp(name, "kern.devname") != 0 || newlen != sizeof(dev)) {
+		errno = ENOENT;
+		return (-1);
+	}
+
+	memcpy(&dev, newp, sizeof(dev));
+	*sz = (size_t)snprintf(buf, *sz, "ada0p%d", (int)(dev & 0xf)) + 1;
+	return (0);
+}
+
+static const struct free_sysops fake_ops = {
+	fake_sysctl,
+	fake_nametomib,
+	fake_sysctlbyname,
+};
+
+/* Swap is the sum of the devices of vm.swap_info */
+static void test_swap(void)
+{
+	struct free_swap_dev devs[FREE_SWAP_DEV_MAX];
+	struct free_model mod;
+	struct free_ctx *ctx;
+	uint64_t page;
+	int n;
+
+	page = (uint64_t)sysconf(_SC_PAGESIZE);
+	nr_swap_devs = 2;
+	ctx = free_ctx_open_sysops(FREE_CTX_DEFAULT, &fake_ops);
+	CHECK(ctx != NULL);
+	if (ctx == NULL)
+		return;
+
+	CHECK(free_sample(ctx, &mod) == 0);
+	CHECK(mod.totalram == 4194304 * page);
+	CHECK(mod.freeram == 1048576 * page);
+	CHECK(mod.usedram == 3145728 * page);
+	CHECK(mod.buffer == 524288 * page);
+	CHECK(mod.shared == 536870912);
+	CHECK(mod.totalswap == 393216 * page);
+	CHECK(mod.usedswap == 1024 * page);
+	CHECK(mod.freeswap == 392192 * page);
+
+	/* The devices are named through kern.devname, NFS has none */
+	n = free_swap_devices(ctx, devs, FREE_SWAP_DEV_MAX);
+	CHECK(n == 2);
+	if (n == 2) {
+		CHECK(strcmp(devs[0].name, "/dev/ada0p10") == 0);
+		CHECK(devs[0].total == 262144 * page);
+		CHECK(devs[0].used == 1024 * page);
+		CHECK(devs[0].priority == FREE_SWAP_NO_PRIORITY);
+		CHECK(strcmp(devs[1].name, "[NFS swap]") == 0);
+	}
+
+	/* Only as many devices as asked for */
+	CHECK(free_swap_devices(ctx, devs, 1) == 1);
+	free_ctx_close(ctx);
+
+	/* No swap at all */
+	nr_swap_devs = 0;
+	ctx = free_ctx_open_sysops(FREE_CTX_DEFAULT, &fake_ops);
+	CHECK(ctx != NULL && free_sample(ctx, &mod) == 0);
+	CHECK(mod.totalswap == 0 && mod.usedswap == 0 && mod.freeswap == 0);
+	CHECK(free_swap_devices(ctx, devs, FREE_SWAP_DEV_MAX) == 0);
+	free_ctx_close(ctx);
+}
+
+/* A failure is reported as the -1 sentinel, without aborting */
+static void test_swap_errors(void)
+{
+	struct free_model mod;
+	struct free_ctx *ctx;
+
+	nr_swap_devs = 2;
+	swap_info_missing = 1;
+	ctx = free_ctx_open_sysops(FREE_CTX_DEFAULT, &fake_ops);
+	CHECK(ctx != NULL && free_sample(ctx, &mod) == -1);
+	CHECK(mod.totalswap == (uint64_t)-1);
+	CHECK(mod.usedswap == (uint64_t)-1);
+	CHECK(mod.freeswap == (uint64_t)-1);
+	CHECK(mod.totalram != (uint64_t)-1);
+	free_ctx_close(ctx);
+	swap_info_missing = 0;
+
+	/* A struct xswdev of another version isn't trusted */
+	swap_version = XSWDEV_VERSION + 1;
+	ctx = free_ctx_open_sysops(FREE_CTX_DEFAULT, &fake_ops);
+	CHECK(ctx != NULL && free_sample(ctx, &mod) == -1);
+	CHECK(mod.totalswap == (uint64_t)-1);
+	free_ctx_close(ctx);
+	swap_version = XSWDEV_VERSION;
+}
+
+/* The names are looked up on the first sample only, every
+   later one reads the cached MIBs, one sysctl(2) per counter
+   and swap device, and one past the last device. */
+static void test_resolve_once(void)
+{
+	struct free_stats st0, st1;
+	struct free_model mod;
+	struct free_ctx *ctx;
+	unsigned int calls, lookups;
+	size_t i;
+	int src, n;
+
+	nr_swap_devs = 2;
+	nr_nametomib = nr_sysctl = 0;
+	memset(resolved, 0, sizeof(resolved));
+	ctx = free_ctx_open_sysops(FREE_CTX_DEFAULT, &fake_ops);
+	CHECK(ctx != NULL && free_sample(ctx, &mod) == 0);
+	if (ctx == NULL)
+		return;
+
+	for (i = 0; i < NR_VALUES + 1; i++)
+		CHECK(resolved[i] == 1);
+
+	lookups = nr_nametomib;
+	for (n = 0; n < 10; n++) {
+		/* The ARC isn't read through the sysops on every system */
+		calls = nr_sysctl;
+		free_ctx_stats(ctx, &st0);
+		for (src = 0; src < FREE_NR_SOURCES; src++) {
+			if (src != FREE_SRC_ARC)
+				CHECK(free_sample_source(ctx, src, &mod) == 0);
+		}
+		free_ctx_stats(ctx, &st1);
+
+		CHECK(nr_sysctl - calls == NR_VALUES + nr_swap_devs + 1);
+		CHECK(st1.syscalls - st0.syscalls == nr_sysctl - calls);
+	}
+
+	CHECK(nr_nametomib == lookups);
+	for (i = 0; i < NR_VALUES + 1; i++)
+		CHECK(resolved[i] == 1);
+	free_ctx_close(ctx);
+}
+
+/* Open a context reading the ARC from a kstat fixture, and
+   take a snapshot. Returns -1 if the fixture can't be opened. */
+static int sample_arc(const char *name, struct free_model *mod)
+{
+	struct free_ctx *ctx;
+	char path[1024];
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", fixtures, name);
+	ctx = free_ctx_open_sysops(FREE_CTX_DEFAULT, &fake_ops);
+	CHECK(ctx != NULL);
+	if (ctx == NULL)
+		return (-1);
+
+	ret = free_ctx_arcstats(ctx, path);
+	if (ret == 0)
+		ret = free_sample(ctx, mod) == 0 ? 0 : -2;
+
+	free_ctx_close(ctx);
+	return (ret);
+}
+
+/* The available memory is the free RAM and the part of the
+   ARC above its floor, up to the total RAM. */
+static void test_arc(void)
+{
+	struct free_model mod;
+	struct free_ctx *ctx;
+	char path[1024], tmp[] = "/tmp/arcstatsXXXXXX";
+	FILE *src, *dst;
+	uint64_t page;
+	int c, fd;
+
+	page = (uint64_t)sysconf(_SC_PAGESIZE);
+	nr_swap_devs = 1;
+
+	CHECK(sample_arc("arcstats-above.txt", &mod) == 0);
+	CHECK(mod.arc_size == 6442450944);
+	CHECK(mod.arc_min == 1073741824);
+	CHECK(mod.arc_target == 8589934592);
+	CHECK(mod.avail == 1048576 * page + 5368709120);
+
+	/* Below its floor, the ARC doesn't shrink any further */
+	CHECK(sample_arc("arcstats-below.txt", &mod) == 0);
+	CHECK(mod.arc_size == 536870912);
+	CHECK(mod.avail == mod.freeram);
+
+	CHECK(sample_arc("arcstats-huge.txt", &mod) == 0);
+	CHECK(mod.avail == mod.totalram);
+
+	/* A kstat file without c_min is an error, not a guess */
+	CHECK(sample_arc("arcstats-truncated.txt", &mod) == -2);
+	CHECK(mod.arc_size == (uint64_t)-1);
+	CHECK(mod.avail == (uint64_t)-1);
+
+	errno = 0;
+	CHECK(sample_arc("arcstats-missing.txt", &mod) == -1);
+	CHECK(errno == ENOENT);
+
+	/* The file is kept open and read again on every snapshot */
+	fd = mkstemp(tmp);
+	CHECK(fd != -1);
+	if (fd == -1)
+		return;
+
+	snprintf(path, sizeof(path), "%s/arcstats-above.txt", fixtures);
+	src = fopen(path, "r");
+	dst = fdopen(fd, "w");
+	CHECK(src != NULL && dst != NULL);
+	if (src == NULL || dst == NULL)
+		return;
+	while ((c = fgetc(src)) != EOF)
+		fputc(c, dst);
+	fclose(src);
+	fclose(dst);
+
+	ctx = free_ctx_open_sysops(FREE_CTX_DEFAULT, &fake_ops);
+	CHECK(ctx != NULL && free_ctx_arcstats(ctx, tmp) == 0);
+	CHECK(free_sample(ctx, &mod) == 0 && mod.arc_size == 6442450944);
+
+	snprintf(path, sizeof(path), "%s/arcstats-below.txt", fixtures);
+	src = fopen(path, "r");
+	dst = fopen(tmp, "w");
+	CHECK(src != NULL && dst != NULL);
+	if (src != NULL && dst != NULL) {
+		while ((c = fgetc(src)) != EOF)
+			fputc(c, dst);
+	}
+	if (src != NULL)
+		fclose(src);
+	if (dst != NULL)
+		fclose(dst);
+
+	CHECK(free_sample(ctx, &mod) == 0 && mod.arc_size == 536870912);
+	free_ctx_close(ctx);
+	unlink(tmp);
+}
+
+/* Under --rates, a source is read alone. The available memory
+   follows the free RAM as well as the ARC. */
+static void test_sources(void)
+{
+	struct free_model mod;
+	struct free_ctx *ctx;
+	char path[1024];
+	uint64_t page;
+
+	page = (uint64_t)sysconf(_SC_PAGESIZE);
+	nr_swap_devs = 1;
+	snprintf(path, sizeof(path), "%s/arcstats-above.txt", fixtures);
+	ctx = free_ctx_open_sysops(FREE_CTX_DEFAULT, &fake_ops);
+	CHECK(ctx != NULL);
+	if (ctx == NULL)
+		return;
+
+	CHECK(free_ctx_arcstats(ctx, path) == 0);
+	CHECK(free_sample(ctx, &mod) == 0);
+	CHECK(mod.avail == 1048576 * page + 5368709120);
+
+	values[1].val = 2097152;
+	CHECK(free_sample_source(ctx, FREE_SRC_MEM, &mod) == 0);
+	CHECK(mod.freeram == 2097152 * page);
+	CHECK(mod.avail == 2097152 * page + 5368709120);
+	CHECK(mod.age_mem == 0);
+	values[1].val = 1048576;
+
+	errno = 0;
+	CHECK(free_sample_source(ctx, FREE_NR_SOURCES, &mod) == -1);
+	CHECK(errno == EINVAL);
+	free_ctx_close(ctx);
+}
+
+/* A fixture value may be the -1 sentinel, but no other
+   negative number, which strtoull(3) would wrap around. */
+static void test_fixture_values(void)
+{
+	struct free_model mod;
+	struct free_ctx *ctx;
+	char path[1024];
+
+	snprintf(path, sizeof(path), "%s/missing.txt", fixtures);
+	ctx = free_ctx_open_fixture(path);
+	CHECK(ctx != NULL);
+	if (ctx != NULL) {
+		CHECK(free_sample(ctx, &mod) == -1);
+		CHECK(mod.totalram == 17179869184ULL);
+		CHECK(mod.buffer == (uint64_t)-1);
+		free_ctx_close(ctx);
+	}
+
+	snprintf(path, sizeof(path), "%s/negative.txt", fixtures);
+	errno = 0;
+	ctx = free_ctx_open_fixture(path);
+	CHECK(ctx == NULL);
+	CHECK(errno == EINVAL);
+	if (ctx != NULL)
+		free_ctx_close(ctx);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		fixtures = argv[1];
+
+	test_swap();
+	test_swap_errors();
+	test_resolve_once();
+	test_arc();
+	test_sources();
+	test_fixture_values();
+
+	if (failed) {
+		fprintf(stderr, "sysops: %d checks failed\n", failed);
+		return (EXIT_FAILURE);
+	}
+
+	puts("sysops: ok");
+	return (EXIT_SUCCESS);
+}
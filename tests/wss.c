@@ -0,0 +1,375 @@
+/*
+ * wss - Measure a working set against a generated idle page bitmap.
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2023, rilysh <nightquick@proton.me>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "libfree.h"
+
+/* Report a failed check and go on with the next ones */
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failed++; \
+		} \
+	} while (0)
+
+#define PM_PRESENT   ((uint64_t)1 << 63)
+
+/* PFNs of the zones, kpagecgroup has a few more past them */
+#define MAX_PFN      200003
+#define NR_EXTRA     100
+
+/* Window of a measure, the accesses are made early in it */
+#define WINDOW_NS    500000000ULL
+
+/* Pages of the process, and the ones it accesses */
+#define PID          42
+#define HIDDEN_PID   43
+
+static const uint64_t pid_pfns[] = { 5000, 5001, 5063, 5064, 70000 };
+static const uint64_t pid_accessed[] = { 5001, 70000 };
+
+/* Directories of the root, in the order to create them */
+static const char *const dirs[] = {
+	"proc", "proc/42", "proc/43", "sys", "sys/kernel", "sys/kernel/mm",
+	"sys/kernel/mm/page_idle", "cg",
+};
+
+/* Files and directories of the root, in the order to remove them */
+static const char *const entries[] = {
+	"proc/42/maps", "proc/42/pagemap", "proc/42",
+	"proc/43/maps", "proc/43/pagemap", "proc/43",
+	"proc/zoneinfo", "proc/kpagecgroup", "proc",
+	"sys/kernel/mm/page_idle/bitmap", "sys/kernel/mm/page_idle",
+	"sys/kernel/mm", "sys/kernel", "sys", "cg",
+};
+
+static int failed;
+static char root[] = "/tmp/free-wssXXXXXX";
+static char bitmap[128];
+
+/* The pages a process accesses while it's measured */
+struct access {
+	const uint64_t *pfns;
+	size_t len;
+	int err;
+};
+
+static void sleep_ms(long ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+/* Read the word of the bitmap holding "pfn", 0 past the end */
+static int read_word(int fd, uint64_t pfn, uint64_t *word)
+{
+	*word = 0;
+	return (pread(fd, word, sizeof(*word), (off_t)(pfn / 64 * 8)) == -1 ?
+		-1 : 0);
+}
+
+static int idle(int fd, uint64_t pfn)
+{
+	uint64_t word;
+
+	if (read_word(fd, pfn, &word) == -1)
+		return (-1);
+	return ((word >> (pfn % 64)) & 1);
+}
+
+/* Wait until the pages are marked idle, then access them, as
+   the kernel would: clear their bits in the bitmap. */
+static void *access_main(void *arg)
+{
+	struct access *a = arg;
+	uint64_t word;
+	size_t i;
+	int fd, tries;
+
+	fd = open(bitmap, O_RDWR);
+	if (fd == -1) {
+		a->err = errno;
+		return (NULL);
+	}
+
+	for (i = 0, tries = 0; i < a->len && tries < 5000; tries++) {
+		while (i < a->len && idle(fd, a->pfns[i]) == 1)
+			i++;
+		if (i < a->len)
+			sleep_ms(1);
+	}
+	if (i < a->len) {
+		a->err = ETIMEDOUT;
+		close(fd);
+		return (NULL);
+	}
+
+	/* Let the markers read the bitmap back first */
+	sleep_ms(50);
+	for (i = 0; i < a->len; i++) {
+		if (read_word(fd, a->pfns[i], &word) == -1) {
+			a->err = errno;
+			break;
+		}
+		word &= ~((uint64_t)1 << (a->pfns[i] % 64));
+		if (pwrite(fd, &word, sizeof(word),
+			   (off_t)(a->pfns[i] / 64 * 8)) == -1) {
+			a->err = errno;
+			break;
+		}
+	}
+
+	close(fd);
+	return (NULL);
+}
+
+/* Measure with an empty bitmap, while "a" accesses its pages */
+static int measure(pid_t pid, const char *cgroup, unsigned int threads,
+		   struct access *a, struct free_wss *ws)
+{
+	pthread_t thr;
+	int fd, ret, err;
+
+	fd = open(bitmap, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || close(fd) == -1)
+		return (-1);
+
+	a->err = 0;
+	if (pthread_create(&thr, NULL, access_main, a) != 0)
+		return (-1);
+
+	ret = free_wss_root(root, pid, cgroup, WINDOW_NS, threads, ws);
+	err = errno;
+	pthread_join(thr, NULL);
+	CHECK(a->err == 0);
+	errno = err;
+	return (ret);
+}
+
+static int write_str(const char *name, const char *str)
+{
+	char path[128];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	fp = fopen(path, "w");
+	if (fp == NULL)
+		return (-1);
+	fputs(str, fp);
+	return (fclose(fp));
+}
+
+/* Write an entry of 64 bits at "idx" of the file "name" */
+static int write_entry(const char *name, uint64_t idx, uint64_t val)
+{
+	char path[128];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (fd == -1)
+		return (-1);
+	ret = pwrite(fd, &val, sizeof(val), (off_t)(idx * 8)) == sizeof(val) ?
+		0 : -1;
+	close(fd);
+	return (ret);
+}
+
+static int make_dir(const char *name)
+{
+	char path[128];
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	return (mkdir(path, 0755));
+}
+
+/* A process with 2 mappings, and one more past the end of its
+   pagemap, like [vsyscall]. Some pages are not present, one is
+   mapped twice. */
+static void test_pid(uint64_t pagesize)
+{
+	struct access a = { pid_accessed, 2, 0 };
+	struct free_wss ws;
+	char maps[256];
+	unsigned int threads;
+
+	snprintf(maps, sizeof(maps),
+		 "%lx-%lx r-xp 00000000 00:00 0\n"
+		 "%lx-%lx rw-p 00000000 00:00 0          [heap]\n"
+		 "%lx-%lx r-xp 00000000 00:00 0          [vsyscall]\n",
+		 16 * pagesize, 24 * pagesize, 1000 * pagesize,
+		 1004 * pagesize, 100000 * pagesize, 100001 * pagesize);
+	CHECK(write_str("proc/42/maps", maps) == 0);
+	CHECK(write_entry("proc/42/pagemap", 16, PM_PRESENT | 5000) == 0);
+	CHECK(write_entry("proc/42/pagemap", 17, 0) == 0);
+	CHECK(write_entry("proc/42/pagemap", 18, PM_PRESENT | 5001) == 0);
+	CHECK(write_entry("proc/42/pagemap", 19, PM_PRESENT | 5000) == 0);
+	CHECK(write_entry("proc/42/pagemap", 20, PM_PRESENT | 70000) == 0);
+	CHECK(write_entry("proc/42/pagemap", 1000, PM_PRESENT | 5063) == 0);
+	CHECK(write_entry("proc/42/pagemap", 1001, PM_PRESENT | 5064) == 0);
+	CHECK(write_entry("proc/42/pagemap", 1003, 0) == 0);
+
+	for (threads = 1; threads <= 2; threads++) {
+		CHECK(measure(PID, NULL, threads, &a, &ws) == 0);
+		CHECK(ws.pagesize == pagesize);
+		CHECK(ws.tracked == sizeof(pid_pfns) / sizeof(pid_pfns[0]));
+		CHECK(ws.accessed == sizeof(pid_accessed) / sizeof(pid_accessed[0]));
+	}
+
+	/* Without root, the PFNs read as 0 */
+	snprintf(maps, sizeof(maps), "%lx-%lx r-xp 00000000 00:00 0\n",
+		 16 * pagesize, 18 * pagesize);
+	CHECK(write_str("proc/43/maps", maps) == 0);
+	CHECK(write_entry("proc/43/pagemap", 16, PM_PRESENT) == 0);
+	CHECK(write_entry("proc/43/pagemap", 17, PM_PRESENT) == 0);
+	errno = 0;
+	CHECK(free_wss_root(root, HIDDEN_PID, NULL, 0, 1, &ws) == -1);
+	CHECK(errno == EPERM);
+}
+
+/* A cgroup charged with 1 page in 7, of which 1 in 13 is
+   accessed, over the PFN range split between the threads */
+static void test_cgroup(void)
+{
+	static const unsigned int nr_threads[] = { 1, 4 };
+	struct free_wss ws;
+	struct access a;
+	struct stat st;
+	uint64_t *pfns, *groups, pfn, tracked;
+	char cgroup[128], path[128];
+	size_t i;
+	FILE *fp;
+
+	snprintf(cgroup, sizeof(cgroup), "%s/cg", root);
+	if (stat(cgroup, &st) == -1) {
+		perror(cgroup);
+		failed++;
+		return;
+	}
+
+	groups = malloc((MAX_PFN + NR_EXTRA) * sizeof(*groups));
+	pfns = malloc(MAX_PFN * sizeof(*pfns));
+	if (groups == NULL || pfns == NULL) {
+		free(groups);
+		free(pfns);
+		failed++;
+		return;
+	}
+
+	tracked = 0;
+	a.pfns = pfns;
+	a.len = 0;
+	for (pfn = 0; pfn < MAX_PFN + NR_EXTRA; pfn++) {
+		groups[pfn] = pfn % 7 == 3 ? (uint64_t)st.st_ino : 1;
+		if (pfn < MAX_PFN && pfn % 7 == 3)
+			tracked++;
+		if (pfn < MAX_PFN && pfn % 91 == 3)
+			pfns[a.len++] = pfn;
+	}
+
+	snprintf(path, sizeof(path), "%s/proc/kpagecgroup", root);
+	fp = fopen(path, "w");
+	CHECK(fp != NULL);
+	if (fp != NULL) {
+		CHECK(fwrite(groups, sizeof(*groups), MAX_PFN + NR_EXTRA, fp) ==
+		      MAX_PFN + NR_EXTRA);
+		CHECK(fclose(fp) == 0);
+	}
+
+	CHECK(write_str("proc/zoneinfo",
+			"Node 0, zone   Normal\n"
+			"        spanned  200002\n"
+			"  start_pfn:           1\n") == 0);
+
+	for (i = 0; i < sizeof(nr_threads) / sizeof(nr_threads[0]); i++) {
+		CHECK(measure(0, cgroup, nr_threads[i], &a, &ws) == 0);
+		CHECK(ws.tracked == tracked);
+		CHECK(ws.accessed == a.len);
+	}
+
+	errno = 0;
+	CHECK(free_wss_root(root, 0, path, 0, 1, &ws) == -1);
+	CHECK(errno == ENOTDIR);
+
+	free(groups);
+	free(pfns);
+}
+
+int main(void)
+{
+	struct free_wss ws;
+	char path[128];
+	size_t i;
+
+	if (mkdtemp(root) == NULL) {
+		perror("mkdtemp()");
+		return (EXIT_FAILURE);
+	}
+	snprintf(bitmap, sizeof(bitmap), "%s/sys/kernel/mm/page_idle/bitmap",
+		 root);
+
+	for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++)
+		CHECK(make_dir(dirs[i]) == 0);
+
+	/* Without idle page tracking, nothing is scanned */
+	errno = 0;
+	CHECK(free_wss_root(root, PID, NULL, 0, 1, &ws) == -1);
+	CHECK(errno == ENOENT);
+
+	test_pid((uint64_t)sysconf(_SC_PAGESIZE));
+	test_cgroup();
+
+	for (i = 0; i < sizeof(entries) / sizeof(entries[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", root, entries[i]);
+		CHECK(remove(path) == 0);
+	}
+	CHECK(rmdir(root) == 0);
+
+	if (failed) {
+		fprintf(stderr, "wss: %d checks failed\n", failed);
+		return (EXIT_FAILURE);
+	}
+
+	puts("wss: ok");
+	return (EXIT_SUCCESS);
+}